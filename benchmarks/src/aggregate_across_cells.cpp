@@ -0,0 +1,79 @@
+#include "utils.h"
+
+#include "scran_aggregate/aggregate_across_cells.hpp"
+
+#include <vector>
+#include <random>
+
+// Arguments are: layout, density (per mille), number of groups, number of threads.
+static void BM_AggregateAcrossCells(benchmark::State& state) {
+    const int nr = 2000, nc = 20000;
+    const auto layout = static_cast<Layout>(state.range(0));
+    const auto sim = simulate_matrix(nr, nc, layout, state.range(1));
+
+    const int ngroups = state.range(2);
+    std::vector<int> groups(nc);
+    std::mt19937_64 rng(ngroups);
+    for (auto& g : groups) {
+        g = rng() % ngroups;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.num_threads = state.range(3);
+
+    for (auto _ : state) {
+        auto res = scran_aggregate::aggregate_across_cells(*(sim.matrix), groups.data(), opt);
+        benchmark::DoNotOptimize(res.sums.data());
+        benchmark::ClobberMemory();
+    }
+
+    report_counters(state, sim);
+}
+
+BENCHMARK(BM_AggregateAcrossCells)
+    ->ArgNames({ "layout", "density", "ngroups", "threads" })
+    ->ArgsProduct({
+        { 0, 1, 2, 3 },
+        { 10, 100, 500 },
+        { 5, 50, 1000 },
+        { 1, 4 }
+    })
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Same as above, but also computing medians, which requires the group-sorted layout in the column path.
+static void BM_AggregateAcrossCellsMedians(benchmark::State& state) {
+    const int nr = 2000, nc = 20000;
+    const auto layout = static_cast<Layout>(state.range(0));
+    const auto sim = simulate_matrix(nr, nc, layout, state.range(1));
+
+    const int ngroups = state.range(2);
+    std::vector<int> groups(nc);
+    std::mt19937_64 rng(ngroups);
+    for (auto& g : groups) {
+        g = rng() % ngroups;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.num_threads = state.range(3);
+
+    for (auto _ : state) {
+        auto res = scran_aggregate::aggregate_across_cells(*(sim.matrix), groups.data(), opt);
+        benchmark::DoNotOptimize(res.medians.data());
+        benchmark::ClobberMemory();
+    }
+
+    report_counters(state, sim);
+}
+
+BENCHMARK(BM_AggregateAcrossCellsMedians)
+    ->ArgNames({ "layout", "density", "ngroups", "threads" })
+    ->ArgsProduct({
+        { 0, 1, 2, 3 },
+        { 100 },
+        { 5, 50 },
+        { 1, 4 }
+    })
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
@@ -0,0 +1,55 @@
+#include "utils.h"
+
+#include "scran_aggregate/aggregate_across_genes.hpp"
+
+#include <vector>
+#include <tuple>
+#include <random>
+#include <algorithm>
+#include <numeric>
+
+// Arguments are: layout, density (per mille), number of gene sets, size of each gene set, number of threads.
+static void BM_AggregateAcrossGenes(benchmark::State& state) {
+    const int nr = 2000, nc = 20000;
+    const auto layout = static_cast<Layout>(state.range(0));
+    const auto sim = simulate_matrix(nr, nc, layout, state.range(1));
+
+    const int nsets = state.range(2);
+    const int set_size = state.range(3);
+    std::vector<int> all_genes(nr);
+    std::iota(all_genes.begin(), all_genes.end(), 0);
+
+    std::vector<std::vector<int> > sets(nsets);
+    std::vector<std::tuple<std::size_t, const int*, const double*> > gene_sets;
+    gene_sets.reserve(nsets);
+    std::mt19937_64 rng(nsets * set_size);
+    for (auto& s : sets) {
+        std::shuffle(all_genes.begin(), all_genes.end(), rng);
+        s.insert(s.end(), all_genes.begin(), all_genes.begin() + set_size);
+        std::sort(s.begin(), s.end());
+        gene_sets.emplace_back(s.size(), s.data(), static_cast<const double*>(NULL));
+    }
+
+    scran_aggregate::AggregateAcrossGenesOptions opt;
+    opt.num_threads = state.range(4);
+
+    for (auto _ : state) {
+        auto res = scran_aggregate::aggregate_across_genes(*(sim.matrix), gene_sets, opt);
+        benchmark::DoNotOptimize(res.sum.data());
+        benchmark::ClobberMemory();
+    }
+
+    report_counters(state, sim);
+}
+
+BENCHMARK(BM_AggregateAcrossGenes)
+    ->ArgNames({ "layout", "density", "nsets", "setsize", "threads" })
+    ->ArgsProduct({
+        { 0, 1, 2, 3 },
+        { 10, 100, 500 },
+        { 1, 50 },
+        { 20, 500 },
+        { 1, 4 }
+    })
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
@@ -0,0 +1,92 @@
+#ifndef UTILS_H
+#define UTILS_H
+
+#include "benchmark/benchmark.h"
+#include "tatami/tatami.hpp"
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <cstdint>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// Matrix layouts to be benchmarked, each of which exercises a different extraction path.
+enum class Layout : int { DENSE_ROW = 0, DENSE_COLUMN = 1, SPARSE_ROW = 2, SPARSE_COLUMN = 3 };
+
+struct SimulatedMatrix {
+    std::shared_ptr<tatami::Matrix<double, int> > matrix;
+    std::size_t nnz;
+};
+
+// Simulating count-like data with the specified density (in units of 0.1%),
+// so that the non-zero values are positive and mostly small integers.
+// Each layout is generated directly to avoid inflating the peak RSS with a dense intermediate.
+inline SimulatedMatrix simulate_matrix(const int nr, const int nc, const Layout layout, const int density_permille, const std::uint64_t seed = 42) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> unif(0, 1);
+    std::poisson_distribution<int> pois(2);
+    const double density = density_permille / 1000.0;
+
+    const bool row = (layout == Layout::DENSE_ROW || layout == Layout::SPARSE_ROW);
+    const int primary = (row ? nr : nc);
+    const int secondary = (row ? nc : nr);
+
+    SimulatedMatrix output;
+    output.nnz = 0;
+
+    if (layout == Layout::DENSE_ROW || layout == Layout::DENSE_COLUMN) {
+        std::vector<double> values(static_cast<std::size_t>(nr) * static_cast<std::size_t>(nc));
+        for (auto& v : values) {
+            if (unif(rng) < density) {
+                v = pois(rng) + 1;
+                ++output.nnz;
+            }
+        }
+        output.matrix.reset(new tatami::DenseMatrix<double, int, std::vector<double> >(nr, nc, std::move(values), row));
+
+    } else {
+        std::vector<double> values;
+        std::vector<int> indices;
+        std::vector<std::size_t> pointers(1);
+        for (int p = 0; p < primary; ++p) {
+            for (int s = 0; s < secondary; ++s) {
+                if (unif(rng) < density) {
+                    values.push_back(pois(rng) + 1);
+                    indices.push_back(s);
+                }
+            }
+            pointers.push_back(indices.size());
+        }
+        output.nnz = values.size();
+        output.matrix.reset(new tatami::CompressedSparseMatrix<double, int, std::vector<double>, std::vector<int>, std::vector<std::size_t> >(
+            nr, nc, std::move(values), std::move(indices), std::move(pointers), row
+        ));
+    }
+
+    return output;
+}
+
+// Reporting throughput in terms of cells and non-zero values per second, along with the peak RSS.
+// Note that the latter is the high-water mark for the entire process, including the input matrix,
+// so it is only meaningful when a single benchmark is run at a time, e.g., with '--benchmark_filter'.
+inline void report_counters(benchmark::State& state, const SimulatedMatrix& sim) {
+    state.counters["cells/s"] = benchmark::Counter(sim.matrix->ncol(), benchmark::Counter::kIsIterationInvariantRate);
+    state.counters["nnz/s"] = benchmark::Counter(sim.nnz, benchmark::Counter::kIsIterationInvariantRate);
+
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        const double peak = usage.ru_maxrss; // already in bytes.
+#else
+        const double peak = static_cast<double>(usage.ru_maxrss) * 1024;
+#endif
+        state.counters["peak_rss"] = benchmark::Counter(peak, benchmark::Counter::kDefaults, benchmark::Counter::OneK::kIs1024);
+    }
+#endif
+}
+
+#endif
@@ -2,16 +2,29 @@
 #define SCRAN_AGGREGATE_AGGREGATE_ACROSS_CELLS_HPP
 
 #include <algorithm>
+#include <numeric>
+#include <cmath>
 #include <vector>
 #include <cstddef>
 #include <type_traits>
-#include <cassert>
+#include <limits>
+#include <optional>
+#include <memory>
+#include <stdexcept>
 
 #include "tatami/tatami.hpp"
 #include "tatami_stats/tatami_stats.hpp"
 #include "sanisizer/sanisizer.hpp"
 
 #include "utils.hpp"
+#include "quantile_sketch.hpp"
+#include "group_layout.hpp"
+#include "aggregate_across_cells_plan.hpp"
+#include "fused_kernels.hpp"
+#include "compensated_sum.hpp"
+#include "contiguous_matrix.hpp"
+#include "parallelize_by_cost.hpp"
+#include "instrumentation.hpp"
 
 /**
  * @file aggregate_across_cells.hpp
@@ -38,15 +51,166 @@ struct AggregateAcrossCellsOptions {
 
     /**
      * Whether to compute the median expression withine ach group.
+     * For integer-typed matrices with a small range of values (e.g., counts), medians are computed by counting rather than selection.
      * This option only affects the `aggregate_across_cells()` overload where an `AggregateAcrossCellsResults` object is returned.
      */
     bool compute_medians = false; // false by default as we usually don't need this.
 
+    /**
+     * Whether to compute the sum of squared expression values within each group.
+     * This can be combined with the sums to obtain the variance within each group, see `compute_variances()`.
+     * This option only affects the `aggregate_across_cells()` overload where an `AggregateAcrossCellsResults` object is returned.
+     */
+    bool compute_sums_of_squares = false;
+
+    /**
+     * Whether to compute the minimum expression value within each group.
+     * This option only affects the `aggregate_across_cells()` overload where an `AggregateAcrossCellsResults` object is returned.
+     */
+    bool compute_minima = false;
+
+    /**
+     * Whether to compute the maximum expression value within each group.
+     * This option only affects the `aggregate_across_cells()` overload where an `AggregateAcrossCellsResults` object is returned.
+     */
+    bool compute_maxima = false;
+
+    /**
+     * Probabilities of the quantiles to compute within each group, each of which should lie in \f$[0, 1]\f$.
+     * Quantiles are approximated with a `QuantileSketch` for each group, so memory usage does not scale with the number of cells.
+     * If empty, no quantiles are computed.
+     */
+    std::vector<double> quantile_probabilities;
+
+    /**
+     * Size of the `QuantileSketch` used to approximate the quantiles in each group.
+     * Larger values improve accuracy at the cost of memory, and quantiles are exact for groups with fewer cells than this value.
+     * Only relevant if `quantile_probabilities` is not empty.
+     */
+    std::size_t quantile_sketch_size = 200;
+
+    /**
+     * Maximum number of expression values to hold in memory for each thread when computing medians or quantiles from a column-major matrix.
+     * Larger values reduce the number of passes over the columns, at the cost of greater memory usage.
+     * Only relevant if medians or quantiles are to be computed and `tatami::Matrix::prefer_rows()` is false.
+     */
+    std::size_t median_buffer_size = 100000000;
+
+    /**
+     * Maximum memory usage, in bytes, of the per-group partial statistics in each thread when aggregating a column-major matrix.
+     * If the partial statistics for all groups would exceed this limit, the groups are processed in tiles that fit within the limit,
+     * where each tile only extracts the cells in its own groups so that each value is still only extracted once.
+     * This is useful for reducing memory usage with many groups and threads, e.g., when aggregating by sample and cell type.
+     * By default, no limit is imposed and all groups are processed together.
+     * Only relevant if `tatami::Matrix::prefer_rows()` is false.
+     */
+    std::size_t column_buffer_memory = std::numeric_limits<std::size_t>::max();
+
+    /**
+     * Approximate size of the cache available to each thread, in bytes, when aggregating a column-major matrix.
+     * Each thread's rows are processed in blocks such that the per-group partial statistics for each block fit in the cache,
+     * so that the scattered updates from sparse columns do not need to go to main memory.
+     * Each block requires a separate pass over the columns, though each value is still only extracted once.
+     * Setting this to the maximum value will disable the blocking.
+     * Only relevant if `tatami::Matrix::prefer_rows()` is false.
+     */
+    std::size_t column_cache_size = 1048576;
+
+    /**
+     * Maximum number of per-group partial sums (and detected counts) to hold in memory for each thread,
+     * when computing sparse results with `aggregate_across_cells_sparse()` from a column-major matrix.
+     * Larger values reduce the number of passes over the columns, at the cost of greater memory usage.
+     */
+    std::size_t sparse_buffer_size = 10000000;
+
+    /**
+     * Maximum number of expression values to hold in memory for each thread when aggregating with multiple groupings in a single pass.
+     * Each block of rows is extracted once from the matrix and then aggregated for every grouping,
+     * so larger values reduce the per-block overhead at the cost of greater memory usage.
+     * Only relevant to the `aggregate_across_cells()` overloads that accept multiple groupings.
+     */
+    std::size_t multiple_buffer_size = 10000000;
+
+    /**
+     * Whether to permute cells into group-sorted order when computing sums and detected cells from a dense row-major matrix.
+     * Each row is gathered into a buffer where each group occupies a contiguous segment, and each segment is then reduced with vectorizable loops.
+     * This is typically faster than scattering each value into its group's accumulator when there are few groups,
+     * though the sums may differ from those of the default approach by floating-point round-off.
+     * No gathering is performed if the cells are already sorted by group.
+     * Only relevant if the matrix is dense and `tatami::Matrix::prefer_rows()` is true.
+     */
+    bool group_sorted_rows = false;
+
+    /**
+     * Whether to compute the sums and sums of squares with compensated (Neumaier) summation.
+     * All partial sums are held in at least double precision and are only converted to `Sum_` when storing the final results.
+     * This allows `Sum_` to be `float` to reduce the memory usage of the output buffers,
+     * without the loss of precision from naively accumulating single-precision values across many cells.
+     * Accumulation is slower than the default approach and `group_sorted_rows` is ignored.
+     * This requires strict floating-point semantics, i.e., the library should not be compiled with options like `-ffast-math`.
+     * Only relevant if `Sum_` is a floating-point type.
+     */
+    bool compensated_sums = false;
+
+    /**
+     * Pointer to an array of length equal to the number of columns, containing a weight for each cell, e.g., the inverse of its size factor.
+     * If provided, each expression value is multiplied by the weight of its cell before computing any statistics.
+     * This is equivalent to (but faster than) aggregating a `tatami::DelayedUnaryIsometricOperation` that scales each column of the matrix.
+     * `group_sorted_rows` is ignored when weights are provided.
+     * If NULL, all cells are unweighted.
+     */
+    const double* cell_weights = NULL;
+
+    /**
+     * Sorted and unique indices of the genes (i.e., rows) to be aggregated.
+     * If provided, only these genes are extracted from the matrix,
+     * and each array in `AggregateAcrossCellsBuffers` should have length equal to the size of the subset,
+     * where the statistic for the `i`-th gene in the subset is stored at position `i` (or `i * stride`).
+     * This is equivalent to (but faster than) aggregating a `tatami::DelayedSubset` of the rows of the matrix.
+     * If unset, all genes are aggregated.
+     */
+    std::optional<std::vector<std::size_t> > gene_subset;
+
+    /**
+     * Pointer to an array of length equal to the number of genes plus 1, containing the cumulative cost of processing each gene,
+     * i.e., the cost of gene `i` is `gene_costs[i + 1] - gene_costs[i]`.
+     * For example, the pointers of a compressed sparse row matrix can be used here, where the cost of each gene is its number of non-zero values.
+     * If provided, the genes are partitioned across threads so that each thread has roughly the same total cost.
+     * This improves load balancing when a few genes are much more expensive than the others, e.g., highly expressed mitochondrial and ribosomal genes in sparse data.
+     * If `gene_subset` is set, this array should still contain the cumulative costs for all genes.
+     * If NULL, each thread is assigned roughly the same number of genes.
+     */
+    const std::size_t* gene_costs = NULL;
+
     /**
      * Number of threads to use. 
      * The parallelization scheme is determined by `tatami::parallelize()`.
+     * If `tatami::Matrix::prefer_rows()` is true and there are fewer than 4 genes per thread,
+     * the cells are split across threads instead, and the partial statistics from each thread are combined at the end.
+     * This does not apply if medians or quantiles are requested.
      */
     int num_threads = 1;
+
+    /**
+     * Maximum memory usage, in bytes, of the scratch space for all threads, as predicted by `estimate_aggregate_across_cells_memory()`.
+     * If set, the execution path and the effective number of threads are chosen to fit within this budget.
+     * The preferred path for the matrix's layout is used with as many threads as possible (up to `num_threads`),
+     * shrinking `column_buffer_memory` if necessary for column-major matrices;
+     * if it does not fit with a single thread, the other paths are tried in the same manner.
+     * If no path fits, the path with the smallest predicted memory usage is used.
+     * Memory for the output buffers, the input matrix and its extractors is not counted.
+     * Only used by the `aggregate_across_cells()` overloads for a single grouping.
+     * By default, no limit is imposed.
+     */
+    std::size_t memory_budget = std::numeric_limits<std::size_t>::max();
+
+    /**
+     * Pointer to an `Instrumentation` instance to be filled with per-thread timings and counters.
+     * This is ignored unless the `SCRAN_AGGREGATE_INSTRUMENTATION` macro is defined, see `Instrumentation` for details.
+     * Only used by the `aggregate_across_cells()` overloads for a single grouping.
+     * If NULL, no instrumentation is performed.
+     */
+    Instrumentation* instrumentation = NULL;
 };
 
 /**
@@ -85,6 +249,51 @@ struct AggregateAcrossCellsBuffers {
      * If this is empty, the median for each group is not computed.
      */
     std::vector<Float_*> medians;
+
+    /**
+     * Vector of length equal to the number of groups.
+     * Each element is a pointer to an array of length equal to the number of genes,
+     * to be filled with the sum of squared expression values across all cells in the corresponding group for each gene.
+     *
+     * If this is empty, the sum of squares for each group is not computed.
+     */
+    std::vector<Sum_*> sums_of_squares;
+
+    /**
+     * Vector of length equal to the number of groups.
+     * Each element is a pointer to an array of length equal to the number of genes,
+     * to be filled with the minimum expression value across all cells in the corresponding group for each gene.
+     * This is set to NaN for groups with no cells.
+     *
+     * If this is empty, the minimum for each group is not computed.
+     */
+    std::vector<Float_*> minima;
+
+    /**
+     * Vector of length equal to the number of groups.
+     * Each element is a pointer to an array of length equal to the number of genes,
+     * to be filled with the maximum expression value across all cells in the corresponding group for each gene.
+     * This is set to NaN for groups with no cells.
+     *
+     * If this is empty, the maximum for each group is not computed.
+     */
+    std::vector<Float_*> maxima;
+
+    /**
+     * Vector of length equal to the number of probabilities in `AggregateAcrossCellsOptions::quantile_probabilities`.
+     * Each inner vector is of length equal to the number of groups,
+     * where each element is a pointer to an array of length equal to the number of genes.
+     * This is to be filled with the approximate quantile of expression values across all cells in the corresponding group for each gene.
+     *
+     * If this is empty, quantiles are not computed.
+     */
+    std::vector<std::vector<Float_*> > quantiles;
+
+    /**
+     * Stride between consecutive genes in each array, i.e., the statistic for gene `i` is stored at `sums[g][i * stride]` for group `g`, and likewise for all other statistics.
+     * Setting this to the number of groups allows the results to be written directly into a gene-major matrix, see `aggregate_across_cells_contiguous()`.
+     */
+    std::size_t stride = 1;
 };
 
 /**
@@ -123,52 +332,443 @@ struct AggregateAcrossCellsResults {
      * If `AggregateAcrossCellsOptions::compute_median = false`, this vector is empty.
      */
     std::vector<std::vector<Float_> > medians;
+
+    /**
+     * Vector of length equal to the number of groups.
+     * Each inner vector is of length equal to the number of genes.
+     * Each entry contains the sum of squared expression values across all cells in the corresponding group for each gene.
+     *
+     * If `AggregateAcrossCellsOptions::compute_sums_of_squares = false`, this vector is empty.
+     */
+    std::vector<std::vector<Sum_> > sums_of_squares;
+
+    /**
+     * Vector of length equal to the number of groups.
+     * Each inner vector is of length equal to the number of genes.
+     * Each entry contains the minimum expression value across all cells in the corresponding group for each gene.
+     *
+     * If `AggregateAcrossCellsOptions::compute_minima = false`, this vector is empty.
+     */
+    std::vector<std::vector<Float_> > minima;
+
+    /**
+     * Vector of length equal to the number of groups.
+     * Each inner vector is of length equal to the number of genes.
+     * Each entry contains the maximum expression value across all cells in the corresponding group for each gene.
+     *
+     * If `AggregateAcrossCellsOptions::compute_maxima = false`, this vector is empty.
+     */
+    std::vector<std::vector<Float_> > maxima;
+
+    /**
+     * Vector of length equal to the number of probabilities in `AggregateAcrossCellsOptions::quantile_probabilities`.
+     * Each middle vector is of length equal to the number of groups,
+     * and each inner vector is of length equal to the number of genes.
+     * Each entry contains the approximate quantile of expression values across all cells in the corresponding group for each gene.
+     *
+     * If `AggregateAcrossCellsOptions::quantile_probabilities` is empty, this vector is empty.
+     */
+    std::vector<std::vector<std::vector<Float_> > > quantiles;
+};
+
+/**
+ * @brief Results of `aggregate_across_cells_contiguous()`.
+ *
+ * Each statistic is stored in a single contiguous matrix where the rows are genes and the columns are groups.
+ * If a statistic is not computed, the corresponding matrix has no rows or columns.
+ *
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * If integer, this should be large enough to avoid integer overflow.
+ * @tparam Detected_ Type of the number of detected cells, usually integer.
+ * This should be large enough to avoid integer overflow.
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ */
+template <typename Sum_, typename Detected_, typename Float_>
+struct AggregateAcrossCellsContiguousResults {
+    /**
+     * Summed expression across all cells in each group, see `AggregateAcrossCellsResults::sums`.
+     */
+    ContiguousMatrix<Sum_> sums;
+
+    /**
+     * Number of cells with detected expression in each group, see `AggregateAcrossCellsResults::detected`.
+     */
+    ContiguousMatrix<Detected_> detected;
+
+    /**
+     * Median expression in each group, see `AggregateAcrossCellsResults::medians`.
+     */
+    ContiguousMatrix<Float_> medians;
+
+    /**
+     * Sum of squared expression values in each group, see `AggregateAcrossCellsResults::sums_of_squares`.
+     */
+    ContiguousMatrix<Sum_> sums_of_squares;
+
+    /**
+     * Minimum expression value in each group, see `AggregateAcrossCellsResults::minima`.
+     */
+    ContiguousMatrix<Float_> minima;
+
+    /**
+     * Maximum expression value in each group, see `AggregateAcrossCellsResults::maxima`.
+     */
+    ContiguousMatrix<Float_> maxima;
+
+    /**
+     * Vector of length equal to the number of probabilities in `AggregateAcrossCellsOptions::quantile_probabilities`,
+     * containing the approximate quantiles in each group, see `AggregateAcrossCellsResults::quantiles`.
+     */
+    std::vector<ContiguousMatrix<Float_> > quantiles;
 };
 
 /**
  * @cond
  */
-template<bool sparse_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
+template<typename Index_, typename Group_>
+std::vector<Index_> tabulate_group_sizes(const Group_* const group, const Index_ n, const std::size_t ngroups) {
+    auto group_sizes = sanisizer::create<std::vector<Index_> >(ngroups); // in case there are more buffers than observed groups.
+    for (Index_ c = 0; c < n; ++c) {
+        const auto g = group[c];
+        if (is_ignored_group(g)) {
+            continue;
+        }
+        if (static_cast<std::size_t>(g) >= group_sizes.size()) {
+            group_sizes.resize(sanisizer::sum<std::size_t>(g, 1));
+        }
+        ++group_sizes[g];
+    }
+    return group_sizes;
+}
+
+// For sparse data, implicit zeros are present if the number of structural
+// non-zeros is less than the group size. Empty groups are reported as NaN.
+template<bool sparse_, typename Float_, typename Index_, class Nonzeros_>
+Float_ finalize_minimum(const Float_ observed, const Index_ group_size, const Nonzeros_& nonzeros, const std::size_t i) {
+    if (group_size == 0) {
+        return std::numeric_limits<Float_>::quiet_NaN();
+    }
+    if constexpr(sparse_) {
+        if (nonzeros[i] < group_size) {
+            return std::min(observed, static_cast<Float_>(0));
+        }
+    }
+    return observed;
+}
+
+template<bool sparse_, typename Float_, typename Index_, class Nonzeros_>
+Float_ finalize_maximum(const Float_ observed, const Index_ group_size, const Nonzeros_& nonzeros, const std::size_t i) {
+    if (group_size == 0) {
+        return std::numeric_limits<Float_>::quiet_NaN();
+    }
+    if constexpr(sparse_) {
+        if (nonzeros[i] < group_size) {
+            return std::max(observed, static_cast<Float_>(0));
+        }
+    }
+    return observed;
+}
+
+// Transformations of the expression values are resolved at compile time, so
+// the default identity transformation is just as fast as the original loops.
+struct IdentityTransform {
+    template<typename Value_, typename Index_>
+    Value_ operator()(const Value_ val, const Index_) const {
+        return val;
+    }
+};
+
+struct CellWeightTransform {
+    const double* weights;
+
+    template<typename Value_, typename Index_>
+    double operator()(const Value_ val, const Index_ cell) const {
+        return val * weights[cell];
+    }
+};
+
+struct PositiveDetector {
+    template<typename Value_>
+    bool operator()(const Value_ val) const {
+        return val > 0;
+    }
+};
+
+template<class Transform_, class Detect_>
+constexpr bool is_default_transform = std::is_same<Transform_, IdentityTransform>::value && std::is_same<Detect_, PositiveDetector>::value;
+
+// Integer data can only be stored as-is for medians if it is not transformed.
+template<typename Data_, typename Float_, class Transform_>
+using TransformedMedianValue = typename std::conditional<std::is_same<Transform_, IdentityTransform>::value, MedianValue<Data_, Float_>, Float_>::type;
+
+// Genes and cells to be extracted from the matrix, where NULL indicates that
+// all genes or cells should be used. Cells are only subsetted if any of them
+// have negative group assignments, in which case they are never extracted.
+// If a plan is available, its precomputed layouts are used by the kernels.
+template<typename Index_, typename Group_>
+struct ExtractionSubset {
+    tatami::VectorPtr<Index_> genes;
+    tatami::VectorPtr<Index_> cells;
+    const AggregateAcrossCellsPlan<Index_, Group_>* plan = NULL;
+};
+
+template<typename Index_>
+Index_ count_aggregated_genes(const Index_ NR, const AggregateAcrossCellsOptions& options) {
+    if (options.gene_subset.has_value()) {
+        return sanisizer::cast<Index_>(options.gene_subset->size());
+    } else {
+        return NR;
+    }
+}
+
+template<typename Index_>
+tatami::VectorPtr<Index_> create_gene_subset(const Index_ NR, const AggregateAcrossCellsOptions& options) {
+    if (!options.gene_subset.has_value()) {
+        return NULL;
+    }
+
+    const auto& requested = *(options.gene_subset);
+    auto genes = std::make_shared<std::vector<Index_> >();
+    tatami::resize_container_to_Index_size(*genes, count_aggregated_genes(NR, options));
+    for (I<decltype(requested.size())> i = 0, end = requested.size(); i < end; ++i) {
+        const auto current = requested[i];
+        if (current >= static_cast<std::size_t>(NR)) {
+            throw std::runtime_error("gene subset indices are out of range");
+        }
+        if (i && current <= requested[i - 1]) {
+            throw std::runtime_error("gene subset indices should be sorted and unique");
+        }
+        (*genes)[i] = current;
+    }
+    return genes;
+}
+
+template<typename Data_, typename Index_, typename Group_>
+ExtractionSubset<Index_, Group_> create_extraction_subset(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsPlan<Index_, Group_>* const plan,
+    const AggregateAcrossCellsOptions& options
+) {
+    ExtractionSubset<Index_, Group_> subset;
+    subset.genes = create_gene_subset(input.nrow(), options);
+    if (plan) {
+        subset.cells = plan->kept_cells();
+        subset.plan = plan;
+        return subset;
+    }
+
+    if constexpr(std::is_signed<Group_>::value) {
+        const Index_ NC = input.ncol();
+        if (std::any_of(group, group + NC, [](const Group_ g) -> bool { return is_ignored_group(g); })) {
+            auto cells = std::make_shared<std::vector<Index_> >();
+            for (Index_ c = 0; c < NC; ++c) {
+                if (!is_ignored_group(group[c])) {
+                    cells->push_back(c);
+                }
+            }
+            subset.cells = std::move(cells);
+        }
+    }
+
+    return subset;
+}
+
+// Position of each gene in the subset, to convert the row indices of sparse columns.
+template<typename Index_>
+std::vector<Index_> invert_gene_subset(const std::vector<Index_>& genes, const Index_ NR) {
+    auto positions = tatami::create_container_of_Index_size<std::vector<Index_> >(NR);
+    for (I<decltype(genes.size())> i = 0, end = genes.size(); i < end; ++i) {
+        positions[genes[i]] = i;
+    }
+    return positions;
+}
+
+template<typename Index_, typename Group_, class Function_>
+void parallelize_over_genes(Function_ fun, const Index_ NR, const ExtractionSubset<Index_, Group_>& subset, const AggregateAcrossCellsOptions& options) {
+    const auto num_genes = count_aggregated_genes(NR, options);
+    if (options.gene_costs && subset.genes) {
+        // Converting the cumulative costs of all genes into those of the subset.
+        const auto costs = options.gene_costs;
+        auto cumulative = sanisizer::create<std::vector<std::size_t> >(sanisizer::sum<std::size_t>(num_genes, 1));
+        for (Index_ i = 0; i < num_genes; ++i) {
+            const auto g = (*(subset.genes))[i];
+            cumulative[i + 1] = cumulative[i] + (costs[g + 1] - costs[g]);
+        }
+        parallelize_by_cost(std::move(fun), num_genes, cumulative.data(), options.num_threads);
+    } else {
+        parallelize_by_cost(std::move(fun), num_genes, options.gene_costs, options.num_threads);
+    }
+}
+
+template<bool sparse_, typename Data_, typename Index_, typename Group_>
+auto create_subset_row_extractor(
+    const tatami::Matrix<Data_, Index_>& p,
+    const ExtractionSubset<Index_, Group_>& subset,
+    const Index_ start,
+    const Index_ length,
+    const tatami::Options& opt
+) {
+    if (subset.genes) {
+        auto oracle = std::make_shared<tatami::FixedViewOracle<Index_> >(subset.genes->data() + start, length);
+        if (subset.cells) {
+            return tatami::new_extractor<sparse_, true>(p, true, std::move(oracle), subset.cells, opt);
+        } else {
+            return tatami::new_extractor<sparse_, true>(p, true, std::move(oracle), opt);
+        }
+    } else {
+        if (subset.cells) {
+            return tatami::consecutive_extractor<sparse_>(p, true, start, length, subset.cells, opt);
+        } else {
+            return tatami::consecutive_extractor<sparse_>(p, true, start, length, opt);
+        }
+    }
+}
+
+// For dense rows, 'group' should be indexed by the position of each cell in
+// the extracted row, see aggregate_across_cells_dispatch_direction(). For
+// sparse rows, it is indexed by the column index in 'p' as usual.
+template<bool sparse_, bool sums_, bool detected_, bool compensated_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
 void aggregate_across_cells_by_row(
     const tatami::Matrix<Data_, Index_>& p,
     const Group_* const group,
     const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
-    const AggregateAcrossCellsOptions& options
+    const AggregateAcrossCellsOptions& options,
+    const ExtractionSubset<Index_, Group_>& subset,
+    const Transform_& transform,
+    const Detect_& detect
 ) {
     tatami::Options opt;
     opt.sparse_ordered_index = false;
 
     std::optional<std::vector<Index_> > group_sizes;
-    const auto NC = p.ncol();
-    if (!buffers.medians.empty()) {
-        group_sizes = tatami_stats::tabulate_groups(group, NC);
+    const Index_ NC = (!sparse_ && subset.cells ? static_cast<Index_>(subset.cells->size()) : p.ncol());
+
+    // For sparse rows, the group sizes should only count the extracted cells.
+    const Group_* kept_group = group;
+    Index_ num_kept = NC;
+    std::vector<Group_> sparse_kept_group;
+    if constexpr(sparse_) {
+        if (subset.cells) {
+            const auto& cells = *(subset.cells);
+            if (subset.plan) {
+                kept_group = subset.plan->compact_group();
+            } else {
+                sparse_kept_group.reserve(cells.size());
+                for (const auto c : cells) {
+                    sparse_kept_group.push_back(group[c]);
+                }
+                kept_group = sparse_kept_group.data();
+            }
+            num_kept = cells.size();
+        }
+    }
+
+    const auto nquantiles = buffers.quantiles.size();
+    const auto nqgroups = (nquantiles ? buffers.quantiles.front().size() : 0);
+    const auto nminima = buffers.minima.size();
+    const auto nmaxima = buffers.maxima.size();
+    if (nquantiles || nminima || nmaxima) {
+        if (subset.plan) {
+            group_sizes = subset.plan->group_sizes();
+        } else {
+            group_sizes = tabulate_group_sizes(kept_group, num_kept, std::max({ nqgroups, nminima, nmaxima }));
+        }
     }
 
-    tatami::parallelize([&](const int, const Index_ s, const Index_ l) -> void {
-        auto ext = tatami::consecutive_extractor<sparse_>(p, true, s, l, opt);
+    // For medians, we gather each row into a group-sorted buffer where each
+    // group occupies a contiguous segment. This avoids any allocations per row
+    // and allows us to run an in-place selection on each segment. The same
+    // layout is used for segmented reductions of the sums and detected cells.
+    const auto nmedians = buffers.medians.size();
+    const I<decltype(buffers.sums.size())> nsums = (sums_ ? buffers.sums.size() : 0);
+    const I<decltype(buffers.detected.size())> ndetected = (detected_ ? buffers.detected.size() : 0);
+    const bool segmented = !sparse_ && !compensated_ && is_default_transform<Transform_, Detect_> && options.group_sorted_rows && (sums_ || detected_);
+    std::optional<GroupLayout<Index_> > own_layout;
+    const GroupLayout<Index_>* layout = NULL;
+    if (nmedians || segmented) {
+        if (subset.plan) {
+            layout = &(subset.plan->compact_layout());
+        } else {
+            own_layout = create_group_layout(kept_group, num_kept, std::max({ nmedians, nsums, ndetected }));
+            layout = &(*own_layout);
+        }
+    }
+
+    const auto stride = buffers.stride;
 
-        std::vector<Sum_> tmp_sums;
-        const auto nsums = buffers.sums.size();
+    parallelize_over_genes([&](const int t, const Index_ s, const Index_ l) -> void {
+        auto ext = create_subset_row_extractor<sparse_>(p, subset, s, l, opt);
+
+        std::vector<SumAccumulator<compensated_, Sum_> > tmp_sums;
         if (nsums) {
             sanisizer::resize(tmp_sums, nsums);
         }
 
         std::vector<Detected_> tmp_detected;
-        const auto ndetected = buffers.detected.size();
         if (ndetected) {
             sanisizer::resize(tmp_detected, ndetected);
         }
 
-        std::vector<std::vector<Float_> > tmp_medians;
-        const auto nmedians = buffers.medians.size();
+        // For sparse data, the per-row cost should scale with the number of
+        // non-zero elements rather than the number of groups. So, we zero the
+        // outputs in bulk and only update the groups that are touched by each row.
+        std::vector<unsigned char> tmp_touched;
+        std::vector<std::size_t> touched;
+        if constexpr(sparse_ && (sums_ || detected_)) {
+            sanisizer::resize(tmp_touched, std::max(nsums, ndetected));
+            for (I<decltype(nsums)> g = 0; g < nsums; ++g) {
+                fill_strided<Sum_>(buffers.sums[g], s, l, stride, 0);
+            }
+            for (I<decltype(ndetected)> g = 0; g < ndetected; ++g) {
+                fill_strided<Detected_>(buffers.detected[g], s, l, stride, 0);
+            }
+        }
+
+        std::vector<Data_> tmp_sorted;
+        if (segmented && !layout->sorted) {
+            tatami::resize_container_to_Index_size(tmp_sorted, NC);
+        }
+
+        std::vector<TransformedMedianValue<Data_, Float_, Transform_> > tmp_medians;
+        std::vector<Index_> tmp_median_counts;
+        SegmentMedians<TransformedMedianValue<Data_, Float_, Transform_>, Index_> segment_medians;
         if (nmedians) {
-            sanisizer::resize(tmp_medians, nmedians);
-            for (I<decltype(nmedians)> l = 0; l < nmedians; ++l) {
-                sanisizer::reserve(tmp_medians[l], (*group_sizes)[l]);
+            tatami::resize_container_to_Index_size(tmp_medians, NC);
+            if constexpr(sparse_) {
+                sanisizer::resize(tmp_median_counts, nmedians);
+            }
+        }
+
+        std::vector<SumAccumulator<compensated_, Sum_> > tmp_sumsq;
+        const auto nsumsq = buffers.sums_of_squares.size();
+        if (nsumsq) {
+            sanisizer::resize(tmp_sumsq, nsumsq);
+        }
+
+        // For sparse data, we need to count the number of structural non-zeros
+        // in each group to determine whether there are any implicit zeros.
+        std::vector<Float_> tmp_minima, tmp_maxima;
+        std::vector<Index_> tmp_nonzeros;
+        if (nminima) {
+            sanisizer::resize(tmp_minima, nminima);
+        }
+        if (nmaxima) {
+            sanisizer::resize(tmp_maxima, nmaxima);
+        }
+        if constexpr(sparse_) {
+            if (nminima || nmaxima) {
+                sanisizer::resize(tmp_nonzeros, std::max(nminima, nmaxima));
             }
         }
 
-        const auto NC = p.ncol();
+        std::vector<QuantileSketch<Float_> > sketches;
+        std::vector<Float_> tmp_quantiles;
+        if (nquantiles) {
+            sketches.resize(nqgroups, QuantileSketch<Float_>(options.quantile_sketch_size));
+            sanisizer::resize(tmp_quantiles, nquantiles);
+        }
+
         auto vbuffer = tatami::create_container_of_Index_size<std::vector<Data_> >(NC);
         auto ibuffer = [&]{
             if constexpr(sparse_) {
@@ -178,6 +778,18 @@ void aggregate_across_cells_by_row(
             }
         }();
 
+        InstrumentationTimer timer(options.instrumentation, t);
+        timer.add(
+            &ThreadInstrumentation::scratch_bytes,
+            vector_bytes(tmp_sums) + vector_bytes(tmp_detected) + vector_bytes(tmp_touched) + vector_bytes(tmp_sorted) +
+                vector_bytes(tmp_medians) + vector_bytes(tmp_median_counts) + vector_bytes(tmp_sumsq) +
+                vector_bytes(tmp_minima) + vector_bytes(tmp_maxima) + vector_bytes(tmp_nonzeros) +
+                vector_bytes(sketches) + vector_bytes(tmp_quantiles) + vector_bytes(vbuffer)
+        );
+        if constexpr(sparse_) {
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(ibuffer));
+        }
+
         for (Index_ x = s, end = s + l; x < end; ++x) {
             const auto row = [&]{
                 if constexpr(sparse_) {
@@ -186,190 +798,2167 @@ void aggregate_across_cells_by_row(
                     return ext->fetch(vbuffer.data());
                 }
             }();
+            const std::size_t out = static_cast<std::size_t>(x) * stride;
+
+            timer.lap(&ThreadInstrumentation::extraction_time);
+            timer.add(&ThreadInstrumentation::rows_fetched, 1);
+            if constexpr(sparse_) {
+                timer.add(&ThreadInstrumentation::nonzeros_processed, row.number);
+            } else {
+                timer.add(&ThreadInstrumentation::nonzeros_processed, NC);
+            }
 
-            if (nsums) {
-                std::fill(tmp_sums.begin(), tmp_sums.end(), 0);
+            if constexpr(!sparse_) {
+                if (segmented) {
+                    const Data_* sorted = row;
+                    if (!layout->sorted) {
+                        const auto& perm = layout->permutation;
+                        for (Index_ k = 0; k < NC; ++k) {
+                            tmp_sorted[k] = row[perm[k]];
+                        }
+                        sorted = tmp_sorted.data();
+                    }
 
-                if constexpr(sparse_) {
-                    for (Index_ j = 0; j < row.number; ++j) {
-                        tmp_sums[group[row.index[j]]] += row.value[j];
+                    const auto& offsets = layout->offsets;
+                    const auto& sizes = layout->sizes;
+                    for (I<decltype(nsums)> l = 0; l < nsums; ++l) {
+                        buffers.sums[l][out] = segment_sum<Sum_>(sorted + offsets[l], sizes[l]);
                     }
-                } else {
-                    for (Index_ j = 0; j < NC; ++j) {
-                        tmp_sums[group[j]] += row[j];
+                    for (I<decltype(ndetected)> l = 0; l < ndetected; ++l) {
+                        buffers.detected[l][out] = segment_detected<Detected_>(sorted + offsets[l], sizes[l]);
                     }
                 }
-
-                // Computing before transferring for more cache-friendliness.
-                for (I<decltype(nsums)> l = 0; l < nsums; ++l) {
-                    buffers.sums[l][x] = tmp_sums[l];
-                }
             }
 
-            if (ndetected) {
-                std::fill(tmp_detected.begin(), tmp_detected.end(), 0);
-
-                if constexpr(sparse_) {
-                    for (Index_ j = 0; j < row.number; ++j) {
-                        tmp_detected[group[row.index[j]]] += (row.value[j] > 0);
+            if constexpr(sparse_ && (sums_ || detected_)) {
+                // Fusing the sums and detected cells into a single pass over the
+                // non-zero elements, only updating the groups that were touched.
+                for (Index_ j = 0; j < row.number; ++j) {
+                    const auto g = group[row.index[j]];
+                    const auto val = transform(row.value[j], row.index[j]);
+                    if (!tmp_touched[g]) {
+                        tmp_touched[g] = 1;
+                        touched.push_back(g);
                     }
-                } else {
-                    for (Index_ j = 0; j < NC; ++j) {
-                        tmp_detected[group[j]] += (row[j] > 0);
+                    if constexpr(sums_) {
+                        tmp_sums[g] += val;
+                    }
+                    if constexpr(detected_) {
+                        tmp_detected[g] += detect(val);
                     }
                 }
 
-                for (I<decltype(ndetected)> l = 0; l < ndetected; ++l) {
-                    buffers.detected[l][x] = tmp_detected[l];
+                for (const auto g : touched) {
+                    if constexpr(sums_) {
+                        buffers.sums[g][out] = static_cast<Sum_>(tmp_sums[g]);
+                        tmp_sums[g] = 0;
+                    }
+                    if constexpr(detected_) {
+                        buffers.detected[g][out] = tmp_detected[g];
+                        tmp_detected[g] = 0;
+                    }
+                    tmp_touched[g] = 0;
+                }
+                touched.clear();
+
+            } else if constexpr(sums_ || detected_) {
+                if (!segmented) {
+                    if constexpr(sums_) {
+                        std::fill(tmp_sums.begin(), tmp_sums.end(), 0);
+                    }
+                    if constexpr(detected_) {
+                        std::fill(tmp_detected.begin(), tmp_detected.end(), 0);
+                    }
+
+                    // Fusing the sums and detected cells into a single pass over the row.
+                    for (Index_ j = 0; j < NC; ++j) {
+                        const auto g = group[j];
+                        const auto val = transform(row[j], j);
+                        if constexpr(sums_) {
+                            tmp_sums[g] += val;
+                        }
+                        if constexpr(detected_) {
+                            tmp_detected[g] += detect(val);
+                        }
+                    }
+
+                    // Computing before transferring for more cache-friendliness.
+                    for (I<decltype(nsums)> l = 0; l < nsums; ++l) {
+                        buffers.sums[l][out] = static_cast<Sum_>(tmp_sums[l]);
+                    }
+                    for (I<decltype(ndetected)> l = 0; l < ndetected; ++l) {
+                        buffers.detected[l][out] = tmp_detected[l];
+                    }
+                }
+            }
+
+            if (nsumsq) {
+                std::fill(tmp_sumsq.begin(), tmp_sumsq.end(), 0);
+
+                if constexpr(sparse_) {
+                    for (Index_ j = 0; j < row.number; ++j) {
+                        const SumValue<compensated_, Sum_> val = transform(row.value[j], row.index[j]);
+                        tmp_sumsq[group[row.index[j]]] += val * val;
+                    }
+                } else {
+                    for (Index_ j = 0; j < NC; ++j) {
+                        const SumValue<compensated_, Sum_> val = transform(row[j], j);
+                        tmp_sumsq[group[j]] += val * val;
+                    }
+                }
+
+                for (I<decltype(nsumsq)> l = 0; l < nsumsq; ++l) {
+                    buffers.sums_of_squares[l][out] = static_cast<Sum_>(tmp_sumsq[l]);
+                }
+            }
+
+            if (nminima || nmaxima) {
+                std::fill(tmp_minima.begin(), tmp_minima.end(), std::numeric_limits<Float_>::infinity());
+                std::fill(tmp_maxima.begin(), tmp_maxima.end(), -std::numeric_limits<Float_>::infinity());
+
+                if constexpr(sparse_) {
+                    std::fill(tmp_nonzeros.begin(), tmp_nonzeros.end(), 0);
+                    for (Index_ j = 0; j < row.number; ++j) {
+                        const auto g = group[row.index[j]];
+                        const Float_ val = transform(row.value[j], row.index[j]);
+                        if (nminima) {
+                            tmp_minima[g] = std::min(tmp_minima[g], val);
+                        }
+                        if (nmaxima) {
+                            tmp_maxima[g] = std::max(tmp_maxima[g], val);
+                        }
+                        ++tmp_nonzeros[g];
+                    }
+                } else {
+                    for (Index_ j = 0; j < NC; ++j) {
+                        const auto g = group[j];
+                        const Float_ val = transform(row[j], j);
+                        if (nminima) {
+                            tmp_minima[g] = std::min(tmp_minima[g], val);
+                        }
+                        if (nmaxima) {
+                            tmp_maxima[g] = std::max(tmp_maxima[g], val);
+                        }
+                    }
+                }
+
+                for (I<decltype(nminima)> l = 0; l < nminima; ++l) {
+                    buffers.minima[l][out] = finalize_minimum<sparse_>(tmp_minima[l], (*group_sizes)[l], tmp_nonzeros, l);
+                }
+                for (I<decltype(nmaxima)> l = 0; l < nmaxima; ++l) {
+                    buffers.maxima[l][out] = finalize_maximum<sparse_>(tmp_maxima[l], (*group_sizes)[l], tmp_nonzeros, l);
+                }
+            }
+
+            timer.lap(&ThreadInstrumentation::accumulation_time);
+
+            if (nmedians) {
+                const auto& offsets = layout->offsets;
+                if constexpr(sparse_) {
+                    std::fill(tmp_median_counts.begin(), tmp_median_counts.end(), 0);
+                    for (Index_ j = 0; j < row.number; ++j) {
+                        const auto g = group[row.index[j]];
+                        tmp_medians[offsets[g] + tmp_median_counts[g]] = transform(row.value[j], row.index[j]);
+                        ++tmp_median_counts[g];
+                    }
+                    for (I<decltype(nmedians)> l = 0; l < nmedians; ++l) {
+                        buffers.medians[l][out] = tatami_stats::medians::direct<Float_>(tmp_medians.data() + offsets[l], tmp_median_counts[l], layout->sizes[l], false);
+                    }
+
+                } else {
+                    const auto& perm = layout->permutation;
+                    for (Index_ k = 0; k < NC; ++k) {
+                        tmp_medians[k] = transform(row[perm[k]], perm[k]);
+                    }
+                    for (I<decltype(nmedians)> l = 0; l < nmedians; ++l) {
+                        buffers.medians[l][out] = segment_medians.template compute<Float_>(tmp_medians.data() + offsets[l], layout->sizes[l]);
+                    }
+                }
+            }
+
+            if (nquantiles) {
+                if constexpr(sparse_) {
+                    for (Index_ j = 0; j < row.number; ++j) {
+                        sketches[group[row.index[j]]].add(transform(row.value[j], row.index[j]));
+                    }
+                } else {
+                    for (Index_ j = 0; j < NC; ++j) {
+                        sketches[group[j]].add(transform(row[j], j));
+                    }
+                }
+
+                for (I<decltype(nqgroups)> l = 0; l < nqgroups; ++l) {
+                    auto& sketch = sketches[l];
+                    if constexpr(sparse_) {
+                        sketch.add(0, (*group_sizes)[l] - sketch.count());
+                    }
+                    sketch.quantiles(nquantiles, options.quantile_probabilities.data(), tmp_quantiles.data());
+                    for (I<decltype(nquantiles)> q = 0; q < nquantiles; ++q) {
+                        buffers.quantiles[q][l][out] = tmp_quantiles[q];
+                    }
+                    sketch.clear();
+                }
+            }
+
+            timer.lap(&ThreadInstrumentation::median_time);
+        }
+    }, p.nrow(), subset, options);
+}
+
+// Number of arrays for each statistic, which determines the size of the
+// scratch space in each execution path.
+struct CellsStatisticCounts {
+    std::size_t sums = 0;
+    std::size_t detected = 0;
+    std::size_t sums_of_squares = 0;
+    std::size_t medians = 0;
+    std::size_t minima = 0;
+    std::size_t maxima = 0;
+    std::size_t quantiles = 0;
+    std::size_t quantile_groups = 0;
+
+    std::size_t groups() const {
+        return std::max({ sums, detected, sums_of_squares, medians, minima, maxima, quantile_groups });
+    }
+};
+
+template<typename Sum_, typename Detected_, typename Float_>
+CellsStatisticCounts count_cells_statistics(const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers) {
+    CellsStatisticCounts counts;
+    counts.sums = buffers.sums.size();
+    counts.detected = buffers.detected.size();
+    counts.sums_of_squares = buffers.sums_of_squares.size();
+    counts.medians = buffers.medians.size();
+    counts.minima = buffers.minima.size();
+    counts.maxima = buffers.maxima.size();
+    counts.quantiles = buffers.quantiles.size();
+    counts.quantile_groups = (counts.quantiles ? buffers.quantiles.front().size() : 0);
+    return counts;
+}
+
+template<typename Sum_>
+bool use_compensated_sums(const CellsStatisticCounts& counts, const AggregateAcrossCellsOptions& options) {
+    return std::is_floating_point<Sum_>::value && options.compensated_sums && (counts.sums || counts.sums_of_squares);
+}
+
+// Size of the accumulator for each (squared) sum, and of the partial sums
+// that are stored before the final reduction in the cell-parallel path.
+template<typename Sum_>
+std::size_t sum_accumulator_bytes(const bool compensated) {
+    return (compensated ? sizeof(SumAccumulator<true, Sum_>) : sizeof(Sum_));
+}
+
+template<typename Sum_>
+std::size_t sum_value_bytes(const bool compensated) {
+    return (compensated ? sizeof(SumValue<true, Sum_>) : sizeof(Sum_));
+}
+
+// Width of the per-group partial statistics for each gene in the column path,
+// where 'sum_bytes' is the size of the accumulator for the (squared) sums.
+// For sparse data, this includes the count of structural non-zeros for the extremes.
+template<typename Detected_, typename Float_, typename Index_>
+std::size_t column_bytes_per_gene(const CellsStatisticCounts& counts, const bool sparse, const std::size_t sum_bytes) {
+    std::size_t per_gene = 0;
+    if (counts.sums) {
+        per_gene += sum_bytes;
+    }
+    if (counts.detected) {
+        per_gene += sizeof(Detected_);
+    }
+    if (counts.sums_of_squares) {
+        per_gene += sum_bytes;
+    }
+    if (counts.minima) {
+        per_gene += sizeof(Float_);
+    }
+    if (counts.maxima) {
+        per_gene += sizeof(Float_);
+    }
+    if (sparse && (counts.minima || counts.maxima)) {
+        per_gene += sizeof(Index_);
+    }
+    return per_gene;
+}
+
+inline bool is_column_tileable(const std::size_t ngroups_total, const AggregateAcrossCellsOptions& options) {
+    return ngroups_total > 0 && options.column_buffer_memory != std::numeric_limits<std::size_t>::max();
+}
+
+// The partial results for each group require 'length' values per statistic,
+// so we split the groups into tiles that fit into the memory limit.
+inline std::size_t choose_column_tile_size(const std::size_t ngroups_total, const std::size_t per_gene, const std::size_t length, const AggregateAcrossCellsOptions& options) {
+    std::size_t tile_size = ngroups_total;
+    if (is_column_tileable(ngroups_total, options)) {
+        const auto per_group = sanisizer::product<std::size_t>(per_gene, length);
+        if (per_group) {
+            tile_size = std::min(tile_size, std::max(static_cast<std::size_t>(1), options.column_buffer_memory / per_group));
+        }
+    }
+    return tile_size;
+}
+
+// When computing medians or quantiles, we process the rows in blocks so that
+// the number of stored values is capped. Each block requires a separate pass
+// over the columns but each value is still only extracted once. Each sketch
+// stores roughly 3k values.
+//
+// We also cap the block size so that the partial statistics of all groups in
+// a tile stay in cache while we scatter each column's values. This is
+// effectively a tiling of the rows within each thread's range.
+template<typename Index_>
+Index_ choose_column_block_size(
+    const Index_ length,
+    const std::size_t num_kept,
+    const CellsStatisticCounts& counts,
+    const std::size_t per_gene,
+    const std::size_t tile_size,
+    const AggregateAcrossCellsOptions& options
+) {
+    Index_ block_size = length;
+    if (counts.medians || counts.quantiles) {
+        std::size_t per_row = 0;
+        if (counts.medians) {
+            per_row += num_kept;
+        }
+        if (counts.quantiles) {
+            per_row += sanisizer::product<std::size_t>(counts.quantile_groups, options.quantile_sketch_size, 3);
+        }
+        const std::size_t max_block = std::max(static_cast<std::size_t>(1), options.median_buffer_size / std::max(static_cast<std::size_t>(1), per_row));
+        if (static_cast<std::size_t>(block_size) > max_block) {
+            block_size = max_block;
+        }
+    }
+
+    if (per_gene && tile_size) {
+        const auto per_row = sanisizer::product<std::size_t>(per_gene, tile_size);
+        const std::size_t max_block = std::max(static_cast<std::size_t>(1), options.column_cache_size / per_row);
+        if (static_cast<std::size_t>(block_size) > max_block) {
+            block_size = max_block;
+        }
+    }
+
+    return block_size;
+}
+
+template<bool sparse_, bool sums_, bool detected_, bool compensated_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells_by_column(
+    const tatami::Matrix<Data_, Index_>& p,
+    const Group_* const group,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    const ExtractionSubset<Index_, Group_>& subset,
+    const Transform_& transform,
+    const Detect_& detect
+) {
+    tatami::Options opt;
+    opt.sparse_ordered_index = false;
+    const auto NC = p.ncol();
+    const Index_ num_kept = (subset.cells ? static_cast<Index_>(subset.cells->size()) : NC);
+
+    const I<decltype(buffers.sums.size())> num_sums = (sums_ ? buffers.sums.size() : 0);
+    const I<decltype(buffers.detected.size())> num_detected = (detected_ ? buffers.detected.size() : 0);
+    const auto num_sumsq = buffers.sums_of_squares.size();
+    const auto nmedians = buffers.medians.size();
+    const auto nquantiles = buffers.quantiles.size();
+    const auto nqgroups = (nquantiles ? buffers.quantiles.front().size() : 0);
+    const auto nminima = buffers.minima.size();
+    const auto nmaxima = buffers.maxima.size();
+    const auto ngroups_needed = std::max({ nmedians, nqgroups, nminima, nmaxima });
+    const auto ngroups_total = std::max({ ngroups_needed, num_sums, num_detected, num_sumsq });
+
+    // If we might need to process the groups in tiles, we need to know which
+    // cells belong to each tile, so we use the same group-sorted layout.
+    const bool tileable = is_column_tileable(ngroups_total, options);
+
+    // For medians, we need to hold all values for each gene in memory. We do
+    // so in a group-sorted buffer where each group occupies a contiguous
+    // segment, starting at 'group_offsets' for the corresponding group.
+    // Ignored cells are not in the layout, so we use it to skip them.
+    std::vector<Index_> group_sizes;
+    GroupLayout<Index_> own_layout;
+    const GroupLayout<Index_>* layout_ptr = &own_layout;
+    std::vector<std::size_t> dense_positions;
+
+    if (nmedians || tileable || (subset.cells && ngroups_total)) {
+        if (subset.plan) {
+            layout_ptr = &(subset.plan->layout());
+        } else {
+            own_layout = create_group_layout(group, NC, ngroups_total);
+        }
+        group_sizes = layout_ptr->sizes;
+        if constexpr(!sparse_) {
+            if (nmedians) {
+                dense_positions.resize(NC);
+                for (Index_ k = 0; k < num_kept; ++k) {
+                    dense_positions[layout_ptr->permutation[k]] = k;
+                }
+            }
+        }
+    } else if (ngroups_needed) {
+        if (subset.plan) {
+            group_sizes = subset.plan->group_sizes();
+        } else {
+            group_sizes = tabulate_group_sizes(group, NC, ngroups_needed);
+        }
+    }
+    const auto& layout = *layout_ptr;
+    const auto& group_offsets = layout.offsets;
+    const auto stride = buffers.stride;
+
+    std::vector<Index_> gene_positions;
+    if constexpr(sparse_) {
+        if (subset.genes) {
+            gene_positions = invert_gene_subset(*(subset.genes), p.nrow());
+        }
+    }
+
+    // For sparse data, we count the structural non-zeros for each gene in
+    // each group, to determine whether the extremes should include zero.
+    const auto num_nonzeros = (sparse_ ? std::max(nminima, nmaxima) : 0);
+    const auto counts = count_cells_statistics(buffers);
+    const auto per_gene = column_bytes_per_gene<Detected_, Float_, Index_>(counts, sparse_, sizeof(SumAccumulator<compensated_, Sum_>));
+
+    parallelize_over_genes([&](const int t, const Index_ start, const Index_ length) -> void {
+        // Each tile only extracts the cells in its groups.
+        const auto tile_size = choose_column_tile_size(ngroups_total, per_gene, length, options);
+        const Index_ block_size = choose_column_block_size(length, num_kept, counts, per_gene, tile_size, options);
+
+        std::vector<TransformedMedianValue<Data_, Float_, Transform_> > median_buffer;
+        std::vector<Index_> median_counts;
+        SegmentMedians<TransformedMedianValue<Data_, Float_, Transform_>, Index_> segment_medians;
+        std::vector<QuantileSketch<Float_> > sketches;
+        std::vector<Float_> tmp_quantiles;
+        if (nmedians) {
+            sanisizer::resize(median_buffer, sanisizer::product<std::size_t>(block_size, num_kept));
+            if constexpr(sparse_) {
+                sanisizer::resize(median_counts, sanisizer::product<std::size_t>(block_size, nmedians));
+            }
+        }
+        if (nquantiles) {
+            sketches.resize(sanisizer::product<std::size_t>(block_size, nqgroups), QuantileSketch<Float_>(options.quantile_sketch_size));
+            sanisizer::resize(tmp_quantiles, nquantiles);
+        }
+
+        auto vbuffer = tatami::create_container_of_Index_size<std::vector<Data_> >(block_size);
+        auto ibuffer = [&]{
+            if constexpr(sparse_) {
+                return tatami::create_container_of_Index_size<std::vector<Index_> >(block_size);
+            } else {
+                return false;
+            }
+        }();
+        std::vector<Index_> position_buffer;
+        if (!gene_positions.empty()) {
+            tatami::resize_container_to_Index_size(position_buffer, block_size);
+        }
+
+        InstrumentationTimer timer(options.instrumentation, t);
+        timer.add(
+            &ThreadInstrumentation::scratch_bytes,
+            vector_bytes(median_buffer) + vector_bytes(median_counts) + vector_bytes(sketches) + vector_bytes(tmp_quantiles) +
+                vector_bytes(vbuffer) + vector_bytes(position_buffer)
+        );
+        if constexpr(sparse_) {
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(ibuffer));
+        }
+
+        for (std::size_t tile_start = 0; tile_start < ngroups_total; tile_start += tile_size) {
+            const std::size_t tile_end = tile_start + std::min(tile_size, ngroups_total - tile_start);
+            const bool full_tile = (tile_start == 0 && tile_end == ngroups_total && !subset.cells);
+            auto in_tile = [&](const std::size_t n) -> std::size_t {
+                return (n > tile_start ? std::min(n, tile_end) - tile_start : 0);
+            };
+
+            auto get_sum = [&](Index_ i) -> Sum_* { return buffers.sums[tile_start + i]; };
+            StridedOutputBuffers<Sum_, I<decltype(get_sum)>, SumAccumulator<compensated_, Sum_> > local_sums(t, in_tile(num_sums), start, length, stride, std::move(get_sum));
+            auto get_detected = [&](Index_ i) -> Detected_* { return buffers.detected[tile_start + i]; };
+            StridedOutputBuffers<Detected_, I<decltype(get_detected)>> local_detected(t, in_tile(num_detected), start, length, stride, std::move(get_detected));
+            auto get_sumsq = [&](Index_ i) -> Sum_* { return buffers.sums_of_squares[tile_start + i]; };
+            StridedOutputBuffers<Sum_, I<decltype(get_sumsq)>, SumAccumulator<compensated_, Sum_> > local_sumsq(t, in_tile(num_sumsq), start, length, stride, std::move(get_sumsq));
+
+            const auto tile_minima = in_tile(nminima);
+            auto get_minima = [&](Index_ i) -> Float_* { return buffers.minima[tile_start + i]; };
+            StridedOutputBuffers<Float_, I<decltype(get_minima)>> local_minima(t, tile_minima, start, length, stride, std::move(get_minima), std::numeric_limits<Float_>::infinity());
+            const auto tile_maxima = in_tile(nmaxima);
+            auto get_maxima = [&](Index_ i) -> Float_* { return buffers.maxima[tile_start + i]; };
+            StridedOutputBuffers<Float_, I<decltype(get_maxima)>> local_maxima(t, tile_maxima, start, length, stride, std::move(get_maxima), -std::numeric_limits<Float_>::infinity());
+
+            std::vector<Index_> nonzero_counts;
+            const auto tile_nonzeros = in_tile(num_nonzeros);
+            if (tile_nonzeros) {
+                sanisizer::resize(nonzero_counts, sanisizer::product<std::size_t>(tile_nonzeros, length));
+            }
+
+            timer.add(
+                &ThreadInstrumentation::scratch_bytes,
+                local_sums.scratch_bytes() + local_detected.scratch_bytes() + local_sumsq.scratch_bytes() +
+                    local_minima.scratch_bytes() + local_maxima.scratch_bytes() + vector_bytes(nonzero_counts)
+            );
+            timer.lap(&ThreadInstrumentation::accumulation_time);
+
+            const auto tile_medians_end = std::min(tile_end, nmedians);
+            const auto tile_qgroups_end = std::min(tile_end, nqgroups);
+            const Index_ num_cells = (full_tile ? NC : static_cast<Index_>(group_offsets[tile_end] - group_offsets[tile_start]));
+            const Index_* const cells = (full_tile ? static_cast<const Index_*>(NULL) : layout.permutation.data() + group_offsets[tile_start]);
+
+            for (Index_ block_start = start, end = start + length; block_start < end; block_start += block_size) {
+                const Index_ block_length = std::min(block_size, static_cast<Index_>(end - block_start));
+                const Index_ block_offset = block_start - start;
+                auto ext = [&]{
+                    std::shared_ptr<const tatami::Oracle<Index_> > oracle;
+                    if (full_tile) {
+                        oracle = std::make_shared<tatami::ConsecutiveOracle<Index_> >(static_cast<Index_>(0), NC);
+                    } else {
+                        oracle = std::make_shared<tatami::FixedViewOracle<Index_> >(cells, num_cells);
+                    }
+                    if (subset.genes) {
+                        const auto first = subset.genes->begin() + block_start;
+                        auto rows = std::make_shared<std::vector<Index_> >(first, first + block_length);
+                        return tatami::new_extractor<sparse_, true>(p, false, std::move(oracle), std::move(rows), opt);
+                    } else {
+                        return tatami::new_extractor<sparse_, true>(p, false, std::move(oracle), block_start, block_length, opt);
+                    }
+                }();
+                if constexpr(sparse_) {
+                    std::fill(median_counts.begin(), median_counts.end(), 0);
+                }
+
+                for (Index_ k = 0; k < num_cells; ++k) {
+                    const Index_ x = (full_tile ? k : cells[k]);
+                    const std::size_t g = group[x];
+                    const std::size_t current = g - tile_start;
+
+                    const auto apply = [&](const Data_ val) {
+                        return transform(val, x);
+                    };
+
+                    if constexpr(sparse_) {
+                        auto col = ext->fetch(vbuffer.data(), ibuffer.data());
+                        timer.lap(&ThreadInstrumentation::extraction_time);
+                        timer.add(&ThreadInstrumentation::columns_fetched, 1);
+                        timer.add(&ThreadInstrumentation::nonzeros_processed, col.number);
+                        if (!gene_positions.empty()) {
+                            // Converting row indices to positions in the subset, so that everything below is unchanged.
+                            for (Index_ i = 0; i < col.number; ++i) {
+                                position_buffer[i] = gene_positions[col.index[i]];
+                            }
+                            col.index = position_buffer.data();
+                        }
+                        if constexpr(sums_ || detected_) {
+                            // Fusing the sums and detected cells into a single pass over the non-zero elements.
+                            const auto cursum = [&]{
+                                if constexpr(sums_) {
+                                    return local_sums.data(current) + block_offset;
+                                } else {
+                                    return false;
+                                }
+                            }();
+                            const auto curdetected = [&]{
+                                if constexpr(detected_) {
+                                    return local_detected.data(current) + block_offset;
+                                } else {
+                                    return false;
+                                }
+                            }();
+                            for (Index_ i = 0; i < col.number; ++i) {
+                                const Index_ r = col.index[i] - block_start;
+                                const auto val = apply(col.value[i]);
+                                if constexpr(sums_) {
+                                    cursum[r] += val;
+                                }
+                                if constexpr(detected_) {
+                                    curdetected[r] += detect(val);
+                                }
+                            }
+                        }
+                        if (num_sumsq) {
+                            const auto cursumsq = local_sumsq.data(current) + block_offset;
+                            for (Index_ i = 0; i < col.number; ++i) {
+                                const SumValue<compensated_, Sum_> val = apply(col.value[i]);
+                                cursumsq[col.index[i] - block_start] += val * val;
+                            }
+                        }
+                        if (nminima) {
+                            const auto curmin = local_minima.data(current) + block_offset;
+                            for (Index_ i = 0; i < col.number; ++i) {
+                                auto& target = curmin[col.index[i] - block_start];
+                                target = std::min(target, static_cast<Float_>(apply(col.value[i])));
+                            }
+                        }
+                        if (nmaxima) {
+                            const auto curmax = local_maxima.data(current) + block_offset;
+                            for (Index_ i = 0; i < col.number; ++i) {
+                                auto& target = curmax[col.index[i] - block_start];
+                                target = std::max(target, static_cast<Float_>(apply(col.value[i])));
+                            }
+                        }
+                        if (num_nonzeros) {
+                            const auto curnonzero = nonzero_counts.data() + current * length + block_offset;
+                            for (Index_ i = 0; i < col.number; ++i) {
+                                ++curnonzero[col.index[i] - block_start];
+                            }
+                        }
+                        if (nmedians) {
+                            for (Index_ i = 0; i < col.number; ++i) {
+                                const Index_ r = col.index[i] - block_start;
+                                auto& count = median_counts[static_cast<std::size_t>(r) * nmedians + g];
+                                median_buffer[static_cast<std::size_t>(r) * num_kept + group_offsets[g] + count] = apply(col.value[i]);
+                                ++count;
+                            }
+                        }
+                        if (nquantiles) {
+                            for (Index_ i = 0; i < col.number; ++i) {
+                                const Index_ r = col.index[i] - block_start;
+                                sketches[static_cast<std::size_t>(r) * nqgroups + g].add(apply(col.value[i]));
+                            }
+                        }
+
+                    } else {
+                        const auto col = ext->fetch(vbuffer.data());
+                        timer.lap(&ThreadInstrumentation::extraction_time);
+                        timer.add(&ThreadInstrumentation::columns_fetched, 1);
+                        timer.add(&ThreadInstrumentation::nonzeros_processed, block_length);
+                        if constexpr(sums_ && detected_) {
+                            // Fusing the two loops so that we only need a single pass over 'col'.
+                            if constexpr(is_default_transform<Transform_, Detect_>) {
+                                add_sums_and_detected(col, block_length, local_sums.data(current) + block_offset, local_detected.data(current) + block_offset);
+                            } else {
+                                const auto cursum = local_sums.data(current) + block_offset;
+                                const auto curdetected = local_detected.data(current) + block_offset;
+                                for (Index_ i = 0; i < block_length; ++i) {
+                                    const auto val = apply(col[i]);
+                                    cursum[i] += val;
+                                    curdetected[i] += detect(val);
+                                }
+                            }
+                        } else if constexpr(sums_) {
+                            const auto cursum = local_sums.data(current) + block_offset;
+                            for (Index_ i = 0; i < block_length; ++i) {
+                                cursum[i] += apply(col[i]);
+                            }
+                        } else if constexpr(detected_) {
+                            const auto curdetected = local_detected.data(current) + block_offset;
+                            for (Index_ i = 0; i < block_length; ++i) {
+                                curdetected[i] += detect(apply(col[i]));
+                            }
+                        }
+                        if (num_sumsq) {
+                            const auto cursumsq = local_sumsq.data(current) + block_offset;
+                            for (Index_ i = 0; i < block_length; ++i) {
+                                const SumValue<compensated_, Sum_> val = apply(col[i]);
+                                cursumsq[i] += val * val;
+                            }
+                        }
+                        if (nminima) {
+                            const auto curmin = local_minima.data(current) + block_offset;
+                            for (Index_ i = 0; i < block_length; ++i) {
+                                curmin[i] = std::min(curmin[i], static_cast<Float_>(apply(col[i])));
+                            }
+                        }
+                        if (nmaxima) {
+                            const auto curmax = local_maxima.data(current) + block_offset;
+                            for (Index_ i = 0; i < block_length; ++i) {
+                                curmax[i] = std::max(curmax[i], static_cast<Float_>(apply(col[i])));
+                            }
+                        }
+                        if (nmedians) {
+                            const auto outptr = median_buffer.data() + dense_positions[x];
+                            for (Index_ i = 0; i < block_length; ++i) {
+                                outptr[static_cast<std::size_t>(i) * num_kept] = apply(col[i]);
+                            }
+                        }
+                        if (nquantiles) {
+                            const auto sptr = sketches.data() + g;
+                            for (Index_ i = 0; i < block_length; ++i) {
+                                sptr[static_cast<std::size_t>(i) * nqgroups].add(apply(col[i]));
+                            }
+                        }
+                    }
+
+                    timer.lap(&ThreadInstrumentation::accumulation_time);
+                }
+
+                for (Index_ i = 0; i < block_length; ++i) {
+                    const std::size_t out = static_cast<std::size_t>(block_start + i) * stride;
+                    for (auto l = tile_start; l < tile_medians_end; ++l) {
+                        const auto segment = median_buffer.data() + static_cast<std::size_t>(i) * num_kept + group_offsets[l];
+                        if constexpr(sparse_) {
+                            const auto count = median_counts[static_cast<std::size_t>(i) * nmedians + l];
+                            buffers.medians[l][out] = tatami_stats::medians::direct<Float_>(segment, count, group_sizes[l], false);
+                        } else {
+                            buffers.medians[l][out] = segment_medians.template compute<Float_>(segment, group_sizes[l]);
+                        }
+                    }
+
+                    for (auto l = tile_start; l < tile_qgroups_end; ++l) {
+                        auto& sketch = sketches[static_cast<std::size_t>(i) * nqgroups + l];
+                        if constexpr(sparse_) {
+                            sketch.add(0, group_sizes[l] - sketch.count());
+                        }
+                        sketch.quantiles(nquantiles, options.quantile_probabilities.data(), tmp_quantiles.data());
+                        for (I<decltype(nquantiles)> q = 0; q < nquantiles; ++q) {
+                            buffers.quantiles[q][l][out] = tmp_quantiles[q];
+                        }
+                        sketch.clear();
+                    }
+                }
+
+                timer.lap(&ThreadInstrumentation::median_time);
+            }
+
+            for (I<decltype(tile_minima)> l = 0; l < tile_minima; ++l) {
+                const auto curmin = local_minima.data(l);
+                for (Index_ i = 0; i < length; ++i) {
+                    curmin[i] = finalize_minimum<sparse_>(curmin[i], group_sizes[tile_start + l], nonzero_counts, l * length + i);
+                }
+            }
+            for (I<decltype(tile_maxima)> l = 0; l < tile_maxima; ++l) {
+                const auto curmax = local_maxima.data(l);
+                for (Index_ i = 0; i < length; ++i) {
+                    curmax[i] = finalize_maximum<sparse_>(curmax[i], group_sizes[tile_start + l], nonzero_counts, l * length + i);
+                }
+            }
+
+            timer.lap(&ThreadInstrumentation::accumulation_time);
+
+            local_sums.transfer();
+            local_detected.transfer();
+            local_sumsq.transfer();
+            local_minima.transfer();
+            local_maxima.transfer();
+            timer.lap(&ThreadInstrumentation::reduction_time);
+        }
+    }, p.nrow(), subset, options);
+}
+
+// Dense rows only contain the extracted cells, so we index the groups and
+// transformation by the position of each cell in the row.
+template<bool sparse_, bool sums_, bool detected_, bool compensated_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells_by_row_subset(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    const ExtractionSubset<Index_, Group_>& subset,
+    const Transform_& transform,
+    const Detect_& detect
+) {
+    if constexpr(!sparse_) {
+        if (subset.cells) {
+            const auto& cells = *(subset.cells);
+            std::vector<Group_> own_kept_group;
+            const Group_* kept_group;
+            if (subset.plan) {
+                kept_group = subset.plan->compact_group();
+            } else {
+                sanisizer::resize(own_kept_group, cells.size());
+                for (I<decltype(cells.size())> k = 0, end = cells.size(); k < end; ++k) {
+                    own_kept_group[k] = group[cells[k]];
+                }
+                kept_group = own_kept_group.data();
+            }
+
+            if constexpr(std::is_same<Transform_, IdentityTransform>::value) {
+                aggregate_across_cells_by_row<sparse_, sums_, detected_, compensated_>(input, kept_group, buffers, options, subset, transform, detect);
+            } else {
+                const auto kept_transform = [&](const Data_ val, const Index_ k) {
+                    return transform(val, cells[k]);
+                };
+                aggregate_across_cells_by_row<sparse_, sums_, detected_, compensated_>(input, kept_group, buffers, options, subset, kept_transform, detect);
+            }
+            return;
+        }
+    }
+
+    aggregate_across_cells_by_row<sparse_, sums_, detected_, compensated_>(input, group, buffers, options, subset, transform, detect);
+}
+
+// For short and wide matrices (e.g., antibody-derived tags), there are not
+// enough genes to keep all threads busy. Instead, each thread processes a
+// range of cells for all genes, and the partial statistics from all threads
+// are combined at the end. This is only possible for statistics that can be
+// reduced across threads, so medians and quantiles are not supported.
+inline bool can_use_cell_parallelization(const CellsStatisticCounts& counts, const int num_threads) {
+    return num_threads > 1 && !counts.medians && !counts.quantiles;
+}
+
+template<typename Index_>
+bool use_cell_parallelization(const Index_ num_genes, const CellsStatisticCounts& counts, const AggregateAcrossCellsOptions& options) {
+    if (!can_use_cell_parallelization(counts, options.num_threads)) {
+        return false;
+    }
+    return static_cast<std::size_t>(num_genes) < sanisizer::product<std::size_t>(options.num_threads, 4);
+}
+
+template<typename Output_>
+void allocate_partial_statistic(const std::size_t ngroups, const std::size_t num_genes, std::vector<std::vector<Output_> >& partial, std::vector<Output_*>& pointers) {
+    sanisizer::resize(partial, ngroups);
+    sanisizer::resize(pointers, ngroups);
+    for (I<decltype(ngroups)> g = 0; g < ngroups; ++g) {
+        sanisizer::resize(partial[g], num_genes);
+        pointers[g] = partial[g].data();
+    }
+}
+
+// 'Reduce_' is the type used to combine the partial statistics across threads,
+// which is only converted to 'Output_' when storing the final result.
+template<typename Reduce_, typename Partial_, typename Output_, typename Index_, class Combine_>
+void reduce_partial_statistic(
+    const std::vector<std::vector<std::vector<Partial_> > >& partials,
+    const std::vector<Output_*>& output,
+    const Index_ num_genes,
+    const std::size_t stride,
+    const Reduce_ initial,
+    Combine_ combine
+) {
+    for (I<decltype(output.size())> g = 0, ngroups = output.size(); g < ngroups; ++g) {
+        const auto outptr = output[g];
+        for (Index_ i = 0; i < num_genes; ++i) {
+            auto current = initial;
+            for (const auto& partial : partials) {
+                if (!partial.empty()) { // skipping threads that were not used.
+                    current = combine(current, partial[g][i]);
+                }
+            }
+            outptr[static_cast<std::size_t>(i) * stride] = static_cast<Output_>(current);
+        }
+    }
+}
+
+template<bool sparse_, bool sums_, bool detected_, bool compensated_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells_by_row_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    const ExtractionSubset<Index_, Group_>& subset,
+    const Transform_& transform,
+    const Detect_& detect
+) {
+    const Index_ num_genes = count_aggregated_genes(input.nrow(), options);
+    const auto nthreads = options.num_threads;
+    typedef SumValue<compensated_, Sum_> PartialSum;
+    auto partial_sums = sanisizer::create<std::vector<std::vector<std::vector<PartialSum> > > >(nthreads);
+    auto partial_detected = sanisizer::create<std::vector<std::vector<std::vector<Detected_> > > >(nthreads);
+    auto partial_sumsq = sanisizer::create<std::vector<std::vector<std::vector<PartialSum> > > >(nthreads);
+    auto partial_minima = sanisizer::create<std::vector<std::vector<std::vector<Float_> > > >(nthreads);
+    auto partial_maxima = sanisizer::create<std::vector<std::vector<std::vector<Float_> > > >(nthreads);
+
+    auto local_options = options;
+    local_options.num_threads = 1;
+
+    tatami::parallelize([&](const int t, const Index_ start, const Index_ length) -> void {
+        AggregateAcrossCellsBuffers<PartialSum, Detected_, Float_> local_buffers;
+        allocate_partial_statistic(buffers.sums.size(), num_genes, partial_sums[t], local_buffers.sums);
+        allocate_partial_statistic(buffers.detected.size(), num_genes, partial_detected[t], local_buffers.detected);
+        allocate_partial_statistic(buffers.sums_of_squares.size(), num_genes, partial_sumsq[t], local_buffers.sums_of_squares);
+        allocate_partial_statistic(buffers.minima.size(), num_genes, partial_minima[t], local_buffers.minima);
+        allocate_partial_statistic(buffers.maxima.size(), num_genes, partial_maxima[t], local_buffers.maxima);
+
+        InstrumentationTimer timer(options.instrumentation, t);
+        for (const auto& partial : partial_sums[t]) {
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(partial));
+        }
+        for (const auto& partial : partial_detected[t]) {
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(partial));
+        }
+        for (const auto& partial : partial_sumsq[t]) {
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(partial));
+        }
+        for (const auto& partial : partial_minima[t]) {
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(partial));
+        }
+        for (const auto& partial : partial_maxima[t]) {
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(partial));
+        }
+
+        // The nested call only uses a single thread, so its instrumentation is
+        // collected separately and merged into the record for this thread.
+        auto thread_options = local_options;
+        Instrumentation thread_instrumentation;
+        if (options.instrumentation) {
+            prepare_instrumentation(&thread_instrumentation, 1);
+            thread_options.instrumentation = &thread_instrumentation;
+        }
+
+        // Only extracting the (non-ignored) cells in this thread's range.
+        ExtractionSubset<Index_, Group_> local_subset; // plan is not used as the layouts are specific to all cells.
+        local_subset.genes = subset.genes;
+        auto cells = std::make_shared<std::vector<Index_> >();
+        if (subset.cells) {
+            const auto& all_cells = *(subset.cells);
+            const auto first = std::lower_bound(all_cells.begin(), all_cells.end(), start);
+            const auto last = std::lower_bound(first, all_cells.end(), static_cast<Index_>(start + length));
+            cells->insert(cells->end(), first, last);
+        } else {
+            tatami::resize_container_to_Index_size(*cells, length);
+            std::iota(cells->begin(), cells->end(), start);
+        }
+        local_subset.cells = std::move(cells);
+
+        aggregate_across_cells_by_row_subset<sparse_, sums_, detected_, compensated_>(input, group, local_buffers, thread_options, local_subset, transform, detect);
+        merge_instrumentation(options.instrumentation, t, thread_instrumentation);
+    }, input.ncol(), nthreads);
+
+    InstrumentationTimer timer(options.instrumentation, 0);
+    const auto stride = buffers.stride;
+    typedef SumAccumulator<compensated_, Sum_> ReduceSum;
+    auto add_sums = [](ReduceSum l, PartialSum r) -> ReduceSum { l += r; return l; };
+    reduce_partial_statistic<ReduceSum>(partial_sums, buffers.sums, num_genes, stride, 0, add_sums);
+    reduce_partial_statistic<Detected_>(partial_detected, buffers.detected, num_genes, stride, 0, [](Detected_ l, Detected_ r) -> Detected_ { return l + r; });
+    reduce_partial_statistic<ReduceSum>(partial_sumsq, buffers.sums_of_squares, num_genes, stride, 0, add_sums);
+
+    // Threads without any cells in a group will report NaN for its extremes,
+    // which are ignored by std::fmin and std::fmax.
+    const Float_ nan = std::numeric_limits<Float_>::quiet_NaN();
+    reduce_partial_statistic<Float_>(partial_minima, buffers.minima, num_genes, stride, nan, [](Float_ l, Float_ r) -> Float_ { return std::fmin(l, r); });
+    reduce_partial_statistic<Float_>(partial_maxima, buffers.maxima, num_genes, stride, nan, [](Float_ l, Float_ r) -> Float_ { return std::fmax(l, r); });
+    timer.lap(&ThreadInstrumentation::reduction_time);
+}
+
+// The estimates below mirror the allocations in each kernel, assuming that
+// the jobs are split evenly across threads. They are upper bounds as we
+// assume that all threads use local buffers and that the cells are unsorted.
+inline std::size_t count_effective_threads(const std::size_t num_jobs, const int num_threads) {
+    return std::min(num_jobs, static_cast<std::size_t>(std::max(1, num_threads)));
+}
+
+inline std::size_t count_jobs_per_thread(const std::size_t num_jobs, const std::size_t num_threads) {
+    return (num_threads ? num_jobs / num_threads + (num_jobs % num_threads > 0) : 0);
+}
+
+template<typename Index_>
+std::size_t estimate_group_layout_memory(const std::size_t num_cells, const std::size_t num_groups) {
+    return num_cells * sizeof(Index_) + num_groups * sizeof(Index_) + (num_groups + 1) * sizeof(std::size_t);
+}
+
+template<typename Float_>
+std::size_t estimate_sketch_memory(const std::size_t sketch_size) {
+    return sizeof(QuantileSketch<Float_>) + sanisizer::product<std::size_t>(sketch_size, 3, sizeof(Float_));
+}
+
+// 'num_extracted' is the length of each extracted row, while 'num_kept' is the
+// number of non-ignored cells. These only differ for sparse rows.
+template<typename Sum_, typename Detected_, typename Float_, typename Data_, typename Index_>
+std::size_t estimate_cells_row_memory(
+    const std::size_t num_genes,
+    const std::size_t num_extracted,
+    const std::size_t num_kept,
+    const bool sparse,
+    const CellsStatisticCounts& counts,
+    const AggregateAcrossCellsOptions& options,
+    const int num_threads
+) {
+    const auto ngroups = counts.groups();
+    const bool compensated = use_compensated_sums<Sum_>(counts, options);
+    const bool segmented = !sparse && !compensated && options.group_sorted_rows && options.cell_weights == NULL && (counts.sums || counts.detected);
+
+    std::size_t shared = 0;
+    if (counts.quantiles || counts.minima || counts.maxima) {
+        shared += ngroups * sizeof(Index_);
+    }
+    if (counts.medians || segmented) {
+        shared += estimate_group_layout_memory<Index_>(num_kept, ngroups);
+    }
+
+    std::size_t per_thread = num_extracted * sizeof(Data_);
+    if (sparse) {
+        per_thread += num_extracted * sizeof(Index_);
+    }
+    per_thread += (counts.sums + counts.sums_of_squares) * sum_accumulator_bytes<Sum_>(compensated) + counts.detected * sizeof(Detected_);
+    per_thread += (counts.minima + counts.maxima + counts.quantiles) * sizeof(Float_);
+    if (sparse && (counts.sums || counts.detected)) {
+        per_thread += std::max(counts.sums, counts.detected) * (sizeof(unsigned char) + sizeof(std::size_t));
+    }
+    if (sparse && (counts.minima || counts.maxima)) {
+        per_thread += std::max(counts.minima, counts.maxima) * sizeof(Index_);
+    }
+    if (segmented) {
+        per_thread += num_extracted * sizeof(Data_);
+    }
+    if (counts.medians) {
+        per_thread += num_extracted * std::max(sizeof(MedianValue<Data_, Float_>), sizeof(Float_));
+        if (sparse) {
+            per_thread += counts.medians * sizeof(Index_);
+        }
+    }
+    per_thread += counts.quantile_groups * estimate_sketch_memory<Float_>(options.quantile_sketch_size);
+
+    return shared + per_thread * count_effective_threads(num_genes, num_threads);
+}
+
+template<typename Sum_, typename Detected_, typename Float_, typename Data_, typename Index_>
+std::size_t estimate_cells_row_cells_memory(
+    const std::size_t num_genes,
+    const std::size_t num_cells,
+    const std::size_t num_kept,
+    const bool sparse,
+    const CellsStatisticCounts& counts,
+    const AggregateAcrossCellsOptions& options,
+    const int num_threads
+) {
+    const auto nthreads = count_effective_threads(num_cells, num_threads);
+    const auto local_kept = count_jobs_per_thread(num_kept, nthreads);
+    const auto partial = num_genes * (
+        (counts.sums + counts.sums_of_squares) * sum_value_bytes<Sum_>(use_compensated_sums<Sum_>(counts, options)) +
+        counts.detected * sizeof(Detected_) + (counts.minima + counts.maxima) * sizeof(Float_)
+    );
+    const auto nested = estimate_cells_row_memory<Sum_, Detected_, Float_, Data_, Index_>(
+        num_genes,
+        (sparse ? num_cells : local_kept),
+        local_kept,
+        sparse,
+        counts,
+        options,
+        1
+    );
+    return nthreads * (partial + local_kept * sizeof(Index_) + nested);
+}
+
+template<typename Sum_, typename Detected_, typename Float_, typename Data_, typename Index_>
+std::size_t estimate_cells_column_memory(
+    const std::size_t num_rows,
+    const std::size_t num_genes,
+    const std::size_t num_cells,
+    const std::size_t num_kept,
+    const bool sparse,
+    const bool gene_subset,
+    const CellsStatisticCounts& counts,
+    const AggregateAcrossCellsOptions& options,
+    const int num_threads
+) {
+    const auto ngroups = counts.groups();
+    const auto ngroups_needed = std::max({ counts.medians, counts.quantile_groups, counts.minima, counts.maxima });
+
+    std::size_t shared = 0;
+    if (counts.medians || is_column_tileable(ngroups, options) || (num_kept != num_cells && ngroups)) {
+        shared += estimate_group_layout_memory<Index_>(num_kept, ngroups) + ngroups * sizeof(Index_);
+        if (!sparse && counts.medians) {
+            shared += num_cells * sizeof(std::size_t);
+        }
+    } else if (ngroups_needed) {
+        shared += ngroups_needed * sizeof(Index_);
+    }
+    if (sparse && gene_subset) {
+        shared += num_rows * sizeof(Index_);
+    }
+
+    const auto nthreads = count_effective_threads(num_genes, num_threads);
+    const auto length = count_jobs_per_thread(num_genes, nthreads);
+    const auto per_gene = column_bytes_per_gene<Detected_, Float_, Index_>(counts, sparse, sum_accumulator_bytes<Sum_>(use_compensated_sums<Sum_>(counts, options)));
+    const auto tile_size = choose_column_tile_size(ngroups, per_gene, length, options);
+    const auto block_size = choose_column_block_size(length, num_kept, counts, per_gene, tile_size, options);
+
+    std::size_t per_thread = per_gene * tile_size * length + block_size * sizeof(Data_);
+    if (sparse) {
+        per_thread += block_size * sizeof(Index_);
+        if (gene_subset) {
+            per_thread += block_size * sizeof(Index_);
+        }
+    }
+    if (counts.medians) {
+        per_thread += block_size * num_kept * std::max(sizeof(MedianValue<Data_, Float_>), sizeof(Float_));
+        if (sparse) {
+            per_thread += block_size * counts.medians * sizeof(Index_);
+        }
+    }
+    if (counts.quantiles) {
+        per_thread += block_size * counts.quantile_groups * estimate_sketch_memory<Float_>(options.quantile_sketch_size) + counts.quantiles * sizeof(Float_);
+    }
+
+    return shared + per_thread * nthreads;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * @brief Predicted memory usage of each execution path of `aggregate_across_cells()`.
+ *
+ * All values are in bytes and refer to the scratch space allocated across all threads.
+ * This does not include the output buffers, the input matrix or its extractors.
+ */
+struct AggregateAcrossCellsMemoryEstimate {
+    /**
+     * Memory usage when each thread processes a range of genes by extracting rows from the matrix.
+     * This is the default path for row-major matrices.
+     */
+    std::size_t by_row = 0;
+
+    /**
+     * Memory usage when each thread processes a range of cells by extracting rows from the matrix.
+     * This is the default path for row-major matrices with fewer than 4 genes per thread.
+     * Set to the maximum value of `std::size_t` if this path is not applicable, i.e., with only one thread or if medians or quantiles are requested.
+     */
+    std::size_t by_row_cells = 0;
+
+    /**
+     * Memory usage when each thread processes a range of genes by extracting columns from the matrix.
+     * This is the default path for column-major matrices.
+     */
+    std::size_t by_column = 0;
+};
+
+/**
+ * @cond
+ */
+template<typename Sum_, typename Detected_, typename Float_, typename Data_, typename Index_>
+AggregateAcrossCellsMemoryEstimate estimate_cells_memory(
+    const std::size_t num_rows,
+    const std::size_t num_cells,
+    const std::size_t num_kept,
+    const bool sparse,
+    const CellsStatisticCounts& counts,
+    const AggregateAcrossCellsOptions& options
+) {
+    const std::size_t num_genes = (options.gene_subset.has_value() ? options.gene_subset->size() : num_rows);
+    const auto nthreads = options.num_threads;
+
+    AggregateAcrossCellsMemoryEstimate output;
+    output.by_row = estimate_cells_row_memory<Sum_, Detected_, Float_, Data_, Index_>(num_genes, (sparse ? num_cells : num_kept), num_kept, sparse, counts, options, nthreads);
+    if (can_use_cell_parallelization(counts, nthreads)) {
+        output.by_row_cells = estimate_cells_row_cells_memory<Sum_, Detected_, Float_, Data_, Index_>(num_genes, num_cells, num_kept, sparse, counts, options, nthreads);
+    } else {
+        output.by_row_cells = std::numeric_limits<std::size_t>::max();
+    }
+    output.by_column = estimate_cells_column_memory<Sum_, Detected_, Float_, Data_, Index_>(
+        num_rows,
+        num_genes,
+        num_cells,
+        num_kept,
+        sparse,
+        options.gene_subset.has_value(),
+        counts,
+        options,
+        nthreads
+    );
+    return output;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Predict the peak memory usage of the scratch space for each execution path of `aggregate_across_cells()`.
+ * This can be used to choose the number of threads or `AggregateAcrossCellsOptions::column_buffer_memory` before aggregating a large matrix.
+ * Alternatively, `AggregateAcrossCellsOptions::memory_budget` can be set to choose the path and number of threads automatically.
+ *
+ * The prediction assumes that the genes (or cells) are split evenly across threads and that no cells are ignored.
+ * It is an upper bound as all threads are assumed to use their own buffers.
+ *
+ * @tparam Sum_ Numeric type of the sum, see `AggregateAcrossCellsBuffers`.
+ * @tparam Detected_ Type of the number of detected cells, see `AggregateAcrossCellsBuffers`.
+ * @tparam Float_ Floating-point type of the other statistics, see `AggregateAcrossCellsBuffers`.
+ * @tparam Data_ Type of data in the input matrix.
+ * @tparam Index_ Integer type of index in the input matrix.
+ *
+ * @param num_genes Number of genes, i.e., rows of the input matrix.
+ * If `AggregateAcrossCellsOptions::gene_subset` is set, only the genes in the subset are considered.
+ * @param num_cells Number of cells, i.e., columns of the input matrix.
+ * @param sparse Whether the input matrix is sparse.
+ * @param num_groups Number of groups.
+ * @param options Further options.
+ * The statistics to be computed are determined from `AggregateAcrossCellsOptions::compute_sums`, `AggregateAcrossCellsOptions::compute_detected`, etc.
+ * as in the `aggregate_across_cells()` overload that returns an `AggregateAcrossCellsResults` object.
+ *
+ * @return Predicted memory usage for each execution path.
+ */
+template<typename Sum_ = double, typename Detected_ = int, typename Float_ = double, typename Data_ = double, typename Index_>
+AggregateAcrossCellsMemoryEstimate estimate_aggregate_across_cells_memory(
+    const Index_ num_genes,
+    const Index_ num_cells,
+    const bool sparse,
+    const std::size_t num_groups,
+    const AggregateAcrossCellsOptions& options
+) {
+    CellsStatisticCounts counts;
+    counts.sums = (options.compute_sums ? num_groups : 0);
+    counts.detected = (options.compute_detected ? num_groups : 0);
+    counts.medians = (options.compute_medians ? num_groups : 0);
+    counts.sums_of_squares = (options.compute_sums_of_squares ? num_groups : 0);
+    counts.minima = (options.compute_minima ? num_groups : 0);
+    counts.maxima = (options.compute_maxima ? num_groups : 0);
+    counts.quantiles = options.quantile_probabilities.size();
+    counts.quantile_groups = (counts.quantiles ? num_groups : 0);
+    return estimate_cells_memory<Sum_, Detected_, Float_, Data_, Index_>(num_genes, num_cells, num_cells, sparse, counts, options);
+}
+
+/**
+ * @cond
+ */
+enum class CellsPath : char { BY_ROW, BY_ROW_CELLS, BY_COLUMN };
+
+template<typename Index_>
+CellsPath choose_cells_path(const bool prefer_rows, const Index_ num_genes, const CellsStatisticCounts& counts, const AggregateAcrossCellsOptions& options) {
+    if (!prefer_rows) {
+        return CellsPath::BY_COLUMN;
+    } else if (use_cell_parallelization(num_genes, counts, options)) {
+        return CellsPath::BY_ROW_CELLS;
+    } else {
+        return CellsPath::BY_ROW;
+    }
+}
+
+// Trying the default path with decreasing numbers of threads, followed by
+// the other paths. For the column path, we shrink the tiles so that the
+// partial statistics fit in whatever remains of the budget. 'options' is
+// modified in place with the chosen number of threads and tile memory.
+template<typename Sum_, typename Detected_, typename Float_, typename Data_, typename Index_>
+CellsPath fit_cells_memory_budget(
+    const Index_ num_rows,
+    const Index_ num_cells,
+    const Index_ num_kept,
+    const bool prefer_rows,
+    const bool sparse,
+    const CellsStatisticCounts& counts,
+    AggregateAcrossCellsOptions& options
+) {
+    const auto budget = options.memory_budget;
+    const int max_threads = std::max(1, options.num_threads);
+    const auto original_column_memory = options.column_buffer_memory;
+    const Index_ num_genes = count_aggregated_genes(num_rows, options);
+
+    std::vector<CellsPath> order;
+    if (!prefer_rows) {
+        order = { CellsPath::BY_COLUMN, CellsPath::BY_ROW, CellsPath::BY_ROW_CELLS };
+    } else if (choose_cells_path(prefer_rows, num_genes, counts, options) == CellsPath::BY_ROW_CELLS) {
+        order = { CellsPath::BY_ROW_CELLS, CellsPath::BY_ROW, CellsPath::BY_COLUMN };
+    } else {
+        order = { CellsPath::BY_ROW, CellsPath::BY_ROW_CELLS, CellsPath::BY_COLUMN };
+    }
+
+    auto estimate = [&](const CellsPath path) -> std::size_t {
+        const auto current = estimate_cells_memory<Sum_, Detected_, Float_, Data_, Index_>(num_rows, num_cells, num_kept, sparse, counts, options);
+        switch (path) {
+            case CellsPath::BY_ROW:
+                return current.by_row;
+            case CellsPath::BY_ROW_CELLS:
+                return current.by_row_cells;
+            default:
+                return current.by_column;
+        }
+    };
+
+    CellsPath best_path = order.front();
+    int best_threads = 1;
+    std::size_t best_column_memory = original_column_memory;
+    std::size_t best_usage = std::numeric_limits<std::size_t>::max();
+
+    for (const auto path : order) {
+        for (int t = max_threads; t > 0; --t) {
+            if (path == CellsPath::BY_ROW_CELLS && !can_use_cell_parallelization(counts, t)) {
+                continue;
+            }
+
+            options.num_threads = t;
+            options.column_buffer_memory = original_column_memory;
+            auto usage = estimate(path);
+
+            if (path == CellsPath::BY_COLUMN && usage > budget) {
+                options.column_buffer_memory = 0; // i.e., one group per tile.
+                const auto minimal = estimate(path);
+                if (minimal <= budget) {
+                    const auto length = count_jobs_per_thread(num_genes, count_effective_threads(num_genes, t));
+                    const auto sum_bytes = sum_accumulator_bytes<Sum_>(use_compensated_sums<Sum_>(counts, options));
+                    const auto per_group = column_bytes_per_gene<Detected_, Float_, Index_>(counts, sparse, sum_bytes) * length;
+                    options.column_buffer_memory = std::min(original_column_memory, per_group + (budget - minimal) / static_cast<std::size_t>(t));
+                    usage = estimate(path);
+                } else {
+                    usage = minimal;
+                }
+            }
+
+            if (usage <= budget) {
+                return path;
+            }
+            if (usage < best_usage) {
+                best_usage = usage;
+                best_path = path;
+                best_threads = t;
+                best_column_memory = options.column_buffer_memory;
+            }
+        }
+    }
+
+    options.num_threads = best_threads;
+    options.column_buffer_memory = best_column_memory;
+    return best_path;
+}
+
+// The kernels are specialized on the most commonly requested statistics so
+// that each combination is computed in a single loop without any branching.
+template<bool sparse_, bool sums_, bool detected_, bool compensated_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells_dispatch_direction(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    const ExtractionSubset<Index_, Group_>& subset,
+    const CellsPath path,
+    const Transform_& transform,
+    const Detect_& detect
+) {
+    switch (path) {
+        case CellsPath::BY_COLUMN:
+            aggregate_across_cells_by_column<sparse_, sums_, detected_, compensated_>(input, group, buffers, options, subset, transform, detect);
+            break;
+        case CellsPath::BY_ROW_CELLS:
+            aggregate_across_cells_by_row_cells<sparse_, sums_, detected_, compensated_>(input, group, buffers, options, subset, transform, detect);
+            break;
+        default:
+            aggregate_across_cells_by_row_subset<sparse_, sums_, detected_, compensated_>(input, group, buffers, options, subset, transform, detect);
+    }
+}
+
+template<bool sparse_, bool compensated_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells_dispatch_statistics(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    const ExtractionSubset<Index_, Group_>& subset,
+    const CellsPath path,
+    const Transform_& transform,
+    const Detect_& detect
+) {
+    if (buffers.sums.empty()) {
+        if (buffers.detected.empty()) {
+            aggregate_across_cells_dispatch_direction<sparse_, false, false, compensated_>(input, group, buffers, options, subset, path, transform, detect);
+        } else {
+            aggregate_across_cells_dispatch_direction<sparse_, false, true, compensated_>(input, group, buffers, options, subset, path, transform, detect);
+        }
+    } else {
+        if (buffers.detected.empty()) {
+            aggregate_across_cells_dispatch_direction<sparse_, true, false, compensated_>(input, group, buffers, options, subset, path, transform, detect);
+        } else {
+            aggregate_across_cells_dispatch_direction<sparse_, true, true, compensated_>(input, group, buffers, options, subset, path, transform, detect);
+        }
+    }
+}
+
+// Structural zeros can only be skipped if they are still zero and undetected
+// after the transformation. Otherwise, we treat the matrix as dense.
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells_dispatch_sparsity(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsPlan<Index_, Group_>* const plan,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    const Transform_& transform,
+    const Detect_& detect
+) {
+    bool sparse = input.sparse();
+    if constexpr(!is_default_transform<Transform_, Detect_>) {
+        if (sparse) {
+            const Index_ NC = input.ncol();
+            for (Index_ c = 0; c < NC; ++c) {
+                const auto zero = transform(static_cast<Data_>(0), c);
+                if (zero != 0 || detect(zero)) {
+                    sparse = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    const auto subset = create_extraction_subset(input, group, plan, options);
+    const auto counts = count_cells_statistics(buffers);
+    auto run = [&](const AggregateAcrossCellsOptions& current, const CellsPath path) -> void {
+        prepare_instrumentation(current.instrumentation, current.num_threads);
+        if constexpr(std::is_floating_point<Sum_>::value) {
+            if (use_compensated_sums<Sum_>(counts, current)) {
+                if (sparse) {
+                    aggregate_across_cells_dispatch_statistics<true, true>(input, group, buffers, current, subset, path, transform, detect);
+                } else {
+                    aggregate_across_cells_dispatch_statistics<false, true>(input, group, buffers, current, subset, path, transform, detect);
+                }
+                return;
+            }
+        }
+        if (sparse) {
+            aggregate_across_cells_dispatch_statistics<true, false>(input, group, buffers, current, subset, path, transform, detect);
+        } else {
+            aggregate_across_cells_dispatch_statistics<false, false>(input, group, buffers, current, subset, path, transform, detect);
+        }
+    };
+
+    if (options.memory_budget == std::numeric_limits<std::size_t>::max()) {
+        run(options, choose_cells_path(input.prefer_rows(), count_aggregated_genes(input.nrow(), options), counts, options));
+    } else {
+        auto budget_options = options;
+        const Index_ NC = input.ncol();
+        const Index_ num_kept = (subset.cells ? static_cast<Index_>(subset.cells->size()) : NC);
+        const auto path = fit_cells_memory_budget<Sum_, Detected_, Float_, Data_>(input.nrow(), NC, num_kept, input.prefer_rows(), sparse, counts, budget_options);
+        run(budget_options, path);
+    }
+}
+
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
+void aggregate_across_cells_dispatch_weights(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsPlan<Index_, Group_>* const plan,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options
+) {
+    if (options.cell_weights) {
+        aggregate_across_cells_dispatch_sparsity(input, group, plan, buffers, options, CellWeightTransform{ options.cell_weights }, PositiveDetector());
+    } else {
+        aggregate_across_cells_dispatch_sparsity(input, group, plan, buffers, options, IdentityTransform(), PositiveDetector());
+    }
+}
+
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells_dispatch_weights(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsPlan<Index_, Group_>* const plan,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    const Transform_& transform,
+    const Detect_& detect
+) {
+    if (options.cell_weights) {
+        const auto weights = options.cell_weights;
+        const auto weighted = [&](const Data_ val, const Index_ cell) {
+            return transform(val * weights[cell], cell);
+        };
+        aggregate_across_cells_dispatch_sparsity(input, group, plan, buffers, options, weighted, detect);
+    } else {
+        aggregate_across_cells_dispatch_sparsity(input, group, plan, buffers, options, transform, detect);
+    }
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Aggregate expression values across groups of cells for each gene.
+ * We report the sum of expression values, the number of cells with detected (i.e., positive) expression values, and the median of expression values in each group.
+ * We can also report the sum of squares, minimum, maximum and approximate quantiles in each group.
+ * All requested statistics are computed in a single pass over the matrix.
+ * This is typically used to create pseudo-bulk expression profiles for cluster/sample combinations.
+ * Expression values are generally expected to be counts so that the sums can be used as if they were counts from bulk data, e.g., for differential analyses with **edgeR**.
+ *
+ * @tparam Data_ Numeric type of data in the input matrix.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * If integer, it should be large enough to avoid overflow.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * This should be large enough to avoid integer overflow, so setting it to be the same as `Index_` is a safe choice.
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param[in] group Pointer to an array of length equal to the number of columns of `input`, containing the assigned group for each cell.
+ * All entries should be integers in \f$[0, N)\f$ where \f$N\f$ is the number of unique groups.
+ * For signed `Group_`, cells with negative entries are ignored and never extracted from `input`.
+ * @param[out] buffers Pre-allocated buffers in which to store the computed statistics. 
+ * @param options Further options.
+ */
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
+void aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options
+) {
+    aggregate_across_cells_dispatch_weights(input, group, static_cast<const AggregateAcrossCellsPlan<Index_, Group_>*>(NULL), buffers, options);
+} 
+
+/**
+ * Overload of `aggregate_across_cells()` that applies a transformation to each expression value and uses a custom definition of detection.
+ * This is equivalent to (but faster than) aggregating a delayed transformation of `input`, as the transformation is inlined into the aggregation loops.
+ * For example, we could compute the sums of log-normalized values, or count the number of cells with expression values above a threshold.
+ *
+ * If `input` is sparse, structural zeros are still skipped if the transformation of zero is zero and not detected for all cells.
+ * Otherwise, `input` is processed as if it were dense.
+ * If `AggregateAcrossCellsOptions::cell_weights` is provided, each expression value is multiplied by the weight of its cell before applying `transform`.
+ * `AggregateAcrossCellsOptions::group_sorted_rows` is ignored.
+ *
+ * @tparam Data_ Numeric type of data in the input matrix.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ * @tparam Transform_ Class of the transformation function.
+ * @tparam Detect_ Class of the detection predicate.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param[in] group Pointer to an array of length equal to the number of columns of `input`, containing the assigned group for each cell.
+ * All entries should be integers in \f$[0, N)\f$ where \f$N\f$ is the number of unique groups.
+ * For signed `Group_`, cells with negative entries are ignored and never extracted from `input`.
+ * @param[out] buffers Pre-allocated buffers in which to store the computed statistics. 
+ * @param options Further options.
+ * @param transform Function that accepts an expression value (of type `Data_`) and the index of its cell (of type `Index_`), and returns the transformed value.
+ * All statistics are computed from the transformed values.
+ * @param detect Function that accepts a transformed value and returns a boolean indicating whether it should be considered as detected.
+ */
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    Transform_ transform,
+    Detect_ detect
+) {
+    aggregate_across_cells_dispatch_weights(input, group, static_cast<const AggregateAcrossCellsPlan<Index_, Group_>*>(NULL), buffers, options, transform, detect);
+}
+
+/**
+ * @cond
+ */
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
+void check_plan(
+    const tatami::Matrix<Data_, Index_>& input,
+    const AggregateAcrossCellsPlan<Index_, Group_>& plan,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers
+) {
+    if (plan.num_cells() != input.ncol()) {
+        throw std::runtime_error("number of cells in the plan should be equal to the number of columns of 'input'");
+    }
+
+    const auto ngroups = plan.num_groups();
+    const auto check = [&](const std::size_t n) -> void {
+        if (n && n != ngroups) {
+            throw std::runtime_error("number of groups in 'buffers' should be equal to that in the plan");
+        }
+    };
+    check(buffers.sums.size());
+    check(buffers.detected.size());
+    check(buffers.medians.size());
+    check(buffers.sums_of_squares.size());
+    check(buffers.minima.size());
+    check(buffers.maxima.size());
+    for (const auto& quant : buffers.quantiles) {
+        check(quant.size());
+    }
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Overload of `aggregate_across_cells()` that uses a precomputed plan for the grouping.
+ * This avoids repeated scans of the group assignments when the same grouping is used for multiple calls,
+ * e.g., for different matrices or subsets of genes.
+ *
+ * @tparam Data_ Numeric type of data in the input matrix.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param plan Plan for the grouping of cells, where `AggregateAcrossCellsPlan::num_cells()` should be equal to the number of columns of `input`.
+ * @param[out] buffers Pre-allocated buffers in which to store the computed statistics. 
+ * The number of groups for each statistic should be equal to `AggregateAcrossCellsPlan::num_groups()`.
+ * @param options Further options.
+ */
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
+void aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const AggregateAcrossCellsPlan<Index_, Group_>& plan,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options
+) {
+    check_plan(input, plan, buffers);
+    aggregate_across_cells_dispatch_weights(input, plan.group(), &plan, buffers, options);
+}
+
+/**
+ * Overload of `aggregate_across_cells()` that uses a precomputed plan for the grouping, along with a custom transformation and detection predicate.
+ *
+ * @tparam Data_ Numeric type of data in the input matrix.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ * @tparam Transform_ Class of the transformation function.
+ * @tparam Detect_ Class of the detection predicate.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param plan Plan for the grouping of cells, where `AggregateAcrossCellsPlan::num_cells()` should be equal to the number of columns of `input`.
+ * @param[out] buffers Pre-allocated buffers in which to store the computed statistics. 
+ * The number of groups for each statistic should be equal to `AggregateAcrossCellsPlan::num_groups()`.
+ * @param options Further options.
+ * @param transform Function that accepts an expression value and the index of its cell, see the other `aggregate_across_cells()` overloads.
+ * @param detect Function that accepts a transformed value and returns a boolean indicating whether it should be considered as detected.
+ */
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_, class Transform_, class Detect_>
+void aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const AggregateAcrossCellsPlan<Index_, Group_>& plan,
+    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const AggregateAcrossCellsOptions& options,
+    Transform_ transform,
+    Detect_ detect
+) {
+    check_plan(input, plan, buffers);
+    aggregate_across_cells_dispatch_weights(input, plan.group(), &plan, buffers, options, transform, detect);
+}
+
+/**
+ * @cond
+ */
+template<typename Sum_, typename Detected_, typename Float_>
+AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> offset_cells_buffers(const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers, const std::size_t gene) {
+    auto output = buffers;
+    const std::size_t offset = gene * buffers.stride;
+    const auto shift = [&](auto& pointers) -> void {
+        for (auto& ptr : pointers) {
+            ptr += offset;
+        }
+    };
+
+    shift(output.sums);
+    shift(output.detected);
+    shift(output.medians);
+    shift(output.sums_of_squares);
+    shift(output.minima);
+    shift(output.maxima);
+    for (auto& quant : output.quantiles) {
+        shift(quant);
+    }
+    return output;
+}
+
+template<bool sparse_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
+void aggregate_across_cells_multiple(
+    const tatami::Matrix<Data_, Index_>& input,
+    const std::vector<const Group_*>& groups,
+    const std::vector<AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> >& buffers,
+    const AggregateAcrossCellsOptions& options
+) {
+    const bool row = input.prefer_rows();
+    const Index_ NC = input.ncol();
+    const auto ngroupings = groups.size();
+
+    tatami::Options opt;
+    auto block_options = options;
+    block_options.num_threads = 1;
+    block_options.gene_subset.reset(); // each block only contains the subsetted genes.
+    block_options.gene_costs = NULL;
+    block_options.instrumentation = NULL;
+    block_options.memory_budget = std::numeric_limits<std::size_t>::max();
+
+    // Cells are not subsetted as they might be ignored in some groupings but not others.
+    ExtractionSubset<Index_, Group_> subset;
+    subset.genes = create_gene_subset(input.nrow(), options);
+    std::vector<Index_> gene_positions;
+    if constexpr(sparse_) {
+        if (subset.genes && !row) {
+            gene_positions = invert_gene_subset(*(subset.genes), input.nrow());
+        }
+    }
+
+    // Each thread processes its rows in blocks. Each block is extracted once
+    // from 'input' into an in-memory matrix, which is then aggregated for each
+    // grouping with the usual kernels. This avoids repeated extraction from
+    // 'input', which is the main cost for file-backed or delayed matrices.
+    parallelize_over_genes([&](const int, const Index_ start, const Index_ length) -> void {
+        Index_ block_size = length;
+        const std::size_t max_block = std::max(static_cast<std::size_t>(1), options.multiple_buffer_size / std::max(static_cast<std::size_t>(1), static_cast<std::size_t>(NC)));
+        if (static_cast<std::size_t>(block_size) > max_block) {
+            block_size = max_block;
+        }
+
+        std::vector<Data_> block_values;
+        std::vector<Index_> block_indices;
+        std::vector<std::size_t> block_pointers;
+        if constexpr(!sparse_) {
+            sanisizer::resize(block_values, sanisizer::product<std::size_t>(block_size, NC));
+        }
+
+        auto vbuffer = [&]{
+            if constexpr(sparse_) {
+                return tatami::create_container_of_Index_size<std::vector<Data_> >(row ? NC : block_size);
+            } else {
+                return false;
+            }
+        }();
+        auto ibuffer = [&]{
+            if constexpr(sparse_) {
+                return tatami::create_container_of_Index_size<std::vector<Index_> >(row ? NC : block_size);
+            } else {
+                return false;
+            }
+        }();
+
+        // For row-major matrices, the same extractor is used across all blocks.
+        decltype(create_subset_row_extractor<sparse_>(input, subset, start, length, opt)) row_ext;
+        if (row) {
+            row_ext = create_subset_row_extractor<sparse_>(input, subset, start, length, opt);
+        }
+
+        for (Index_ block_start = start, end = start + length; block_start < end; block_start += block_size) {
+            const Index_ block_length = std::min(block_size, static_cast<Index_>(end - block_start));
+            if constexpr(sparse_) {
+                block_values.clear();
+                block_indices.clear();
+                block_pointers.clear();
+                block_pointers.push_back(0);
+            }
+
+            if (row) {
+                for (Index_ r = 0; r < block_length; ++r) {
+                    if constexpr(sparse_) {
+                        const auto range = row_ext->fetch(vbuffer.data(), ibuffer.data());
+                        block_values.insert(block_values.end(), range.value, range.value + range.number);
+                        block_indices.insert(block_indices.end(), range.index, range.index + range.number);
+                        block_pointers.push_back(block_values.size());
+                    } else {
+                        const auto dest = block_values.data() + static_cast<std::size_t>(r) * NC;
+                        const auto ptr = row_ext->fetch(dest);
+                        if (ptr != dest) {
+                            std::copy_n(ptr, NC, dest);
+                        }
+                    }
+                }
+
+            } else {
+                auto ext = [&]{
+                    if (subset.genes) {
+                        const auto first = subset.genes->begin() + block_start;
+                        auto rows = std::make_shared<std::vector<Index_> >(first, first + block_length);
+                        return tatami::consecutive_extractor<sparse_>(input, false, static_cast<Index_>(0), NC, std::move(rows), opt);
+                    } else {
+                        return tatami::consecutive_extractor<sparse_>(input, false, static_cast<Index_>(0), NC, block_start, block_length, opt);
+                    }
+                }();
+                for (Index_ c = 0; c < NC; ++c) {
+                    if constexpr(sparse_) {
+                        const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                        block_values.insert(block_values.end(), range.value, range.value + range.number);
+                        for (Index_ i = 0; i < range.number; ++i) {
+                            const Index_ position = (gene_positions.empty() ? range.index[i] : gene_positions[range.index[i]]);
+                            block_indices.push_back(position - block_start);
+                        }
+                        block_pointers.push_back(block_values.size());
+                    } else {
+                        const auto dest = block_values.data() + static_cast<std::size_t>(c) * block_length;
+                        const auto ptr = ext->fetch(dest);
+                        if (ptr != dest) {
+                            std::copy_n(ptr, block_length, dest);
+                        }
+                    }
+                }
+            }
+
+            const auto aggregate_block = [&](const tatami::Matrix<Data_, Index_>& block) -> void {
+                for (I<decltype(ngroupings)> i = 0; i < ngroupings; ++i) {
+                    aggregate_across_cells(block, groups[i], offset_cells_buffers(buffers[i], block_start), block_options);
                 }
+            };
+
+            if constexpr(sparse_) {
+                tatami::CompressedSparseMatrix<Data_, Index_, tatami::ArrayView<Data_>, tatami::ArrayView<Index_>, tatami::ArrayView<std::size_t> > block(
+                    block_length,
+                    NC,
+                    tatami::ArrayView<Data_>(block_values.data(), block_values.size()),
+                    tatami::ArrayView<Index_>(block_indices.data(), block_indices.size()),
+                    tatami::ArrayView<std::size_t>(block_pointers.data(), block_pointers.size()),
+                    row,
+                    /* check = */ false
+                );
+                aggregate_block(block);
+            } else {
+                tatami::DenseMatrix<Data_, Index_, tatami::ArrayView<Data_> > block(
+                    block_length,
+                    NC,
+                    tatami::ArrayView<Data_>(block_values.data(), static_cast<std::size_t>(block_length) * static_cast<std::size_t>(NC)),
+                    row
+                );
+                aggregate_block(block);
             }
+        }
+    }, input.nrow(), subset, options);
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Aggregate expression values across cells for multiple groupings, e.g., by cluster, by sample, and by cluster/sample combination.
+ * This is equivalent to calling `aggregate_across_cells()` separately for each grouping,
+ * but each expression value is only extracted once from `input` regardless of the number of groupings.
+ * This is much faster than separate calls when extraction is expensive, e.g., for file-backed or delayed matrices.
+ *
+ * @tparam Data_ Numeric type of data in the input matrix.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * If integer, it should be large enough to avoid overflow.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * This should be large enough to avoid integer overflow, so setting it to be the same as `Index_` is a safe choice.
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param[in] groups Vector of pointers to arrays of length equal to the number of columns of `input`.
+ * Each array contains the assigned group for each cell in a grouping, see the `group` argument in the other `aggregate_across_cells()` overloads.
+ * @param[out] buffers Vector of length equal to `groups`, containing pre-allocated buffers in which to store the computed statistics for each grouping.
+ * Different groupings may request different statistics.
+ * @param options Further options.
+ */
+template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
+void aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const std::vector<const Group_*>& groups,
+    const std::vector<AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> >& buffers,
+    const AggregateAcrossCellsOptions& options
+) {
+    if (groups.size() != buffers.size()) {
+        throw std::runtime_error("number of groupings and buffers should be the same");
+    }
+
+    if (groups.size() == 1) {
+        aggregate_across_cells(input, groups.front(), buffers.front(), options);
+    } else if (groups.size() > 1) {
+        if (input.sparse()) {
+            aggregate_across_cells_multiple<true>(input, groups, buffers, options);
+        } else {
+            aggregate_across_cells_multiple<false>(input, groups, buffers, options);
+        }
+    }
+}
+
+/**
+ * @cond
+ */
+template<typename Sum_, typename Detected_, typename Float_, typename Index_>
+void allocate_cells_results(
+    const Index_ NR,
+    const std::size_t ngroups,
+    const AggregateAcrossCellsOptions& options,
+    AggregateAcrossCellsResults<Sum_, Detected_, Float_>& output,
+    AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers
+) {
+    if (options.compute_sums) {
+        sanisizer::resize(output.sums, ngroups);
+        sanisizer::resize(buffers.sums, ngroups);
+        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
+            auto& cursum = output.sums[l];
+            tatami::resize_container_to_Index_size<I<decltype(cursum)>>(cursum, NR
+#ifdef SCRAN_AGGREGATE_TEST_INIT
+                , SCRAN_AGGREGATE_TEST_INIT
+#endif
+            );
+            buffers.sums[l] = cursum.data();
+        }
+    }
+
+    if (options.compute_detected) {
+        sanisizer::resize(output.detected, ngroups);
+        sanisizer::resize(buffers.detected, ngroups);
+        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
+            auto& curdet = output.detected[l];
+            tatami::resize_container_to_Index_size<I<decltype(curdet)>>(curdet, NR
+#ifdef SCRAN_AGGREGATE_TEST_INIT
+                , SCRAN_AGGREGATE_TEST_INIT
+#endif
+            );
+            buffers.detected[l] = curdet.data();
+        }
+    }
+
+    if (options.compute_medians) {
+        sanisizer::resize(output.medians, ngroups);
+        sanisizer::resize(buffers.medians, ngroups);
+        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
+            auto& curdet = output.medians[l];
+            tatami::resize_container_to_Index_size<I<decltype(curdet)>>(curdet, NR
+#ifdef SCRAN_AGGREGATE_TEST_INIT
+                , SCRAN_AGGREGATE_TEST_INIT
+#endif
+            );
+            buffers.medians[l] = curdet.data();
+        }
+    }
+
+    if (options.compute_sums_of_squares) {
+        sanisizer::resize(output.sums_of_squares, ngroups);
+        sanisizer::resize(buffers.sums_of_squares, ngroups);
+        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
+            auto& cursumsq = output.sums_of_squares[l];
+            tatami::resize_container_to_Index_size<I<decltype(cursumsq)>>(cursumsq, NR
+#ifdef SCRAN_AGGREGATE_TEST_INIT
+                , SCRAN_AGGREGATE_TEST_INIT
+#endif
+            );
+            buffers.sums_of_squares[l] = cursumsq.data();
+        }
+    }
 
-            if (nmedians) {
-                if constexpr(sparse_) {
-                    for (Index_ j = 0; j < row.number; ++j) {
-                        tmp_medians[group[row.index[j]]].push_back(row.value[j]);
-                    }
-                    for (I<decltype(ndetected)> l = 0; l < nmedians; ++l) {
-                        auto& current = tmp_medians[l];
-                        buffers.medians[l][x] = tatami_stats::medians::direct<Float_>(current.data(), static_cast<Index_>(current.size()), (*group_sizes)[l], false);
-                        current.clear();
-                    }
+    if (options.compute_minima) {
+        sanisizer::resize(output.minima, ngroups);
+        sanisizer::resize(buffers.minima, ngroups);
+        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
+            auto& curmin = output.minima[l];
+            tatami::resize_container_to_Index_size<I<decltype(curmin)>>(curmin, NR
+#ifdef SCRAN_AGGREGATE_TEST_INIT
+                , SCRAN_AGGREGATE_TEST_INIT
+#endif
+            );
+            buffers.minima[l] = curmin.data();
+        }
+    }
 
-                } else {
-                    for (Index_ j = 0; j < NC; ++j) {
-                        tmp_medians[group[j]].push_back(row[j]);
-                    }
-                    for (I<decltype(ndetected)> l = 0; l < nmedians; ++l) {
-                        auto& current = tmp_medians[l];
-                        buffers.medians[l][x] = tatami_stats::medians::direct(current.data(), current.size(), false);
-                        current.clear();
-                    }
-                }
+    if (options.compute_maxima) {
+        sanisizer::resize(output.maxima, ngroups);
+        sanisizer::resize(buffers.maxima, ngroups);
+        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
+            auto& curmax = output.maxima[l];
+            tatami::resize_container_to_Index_size<I<decltype(curmax)>>(curmax, NR
+#ifdef SCRAN_AGGREGATE_TEST_INIT
+                , SCRAN_AGGREGATE_TEST_INIT
+#endif
+            );
+            buffers.maxima[l] = curmax.data();
+        }
+    }
+
+    const auto nquantiles = options.quantile_probabilities.size();
+    if (nquantiles) {
+        sanisizer::resize(output.quantiles, nquantiles);
+        sanisizer::resize(buffers.quantiles, nquantiles);
+        for (I<decltype(nquantiles)> q = 0; q < nquantiles; ++q) {
+            sanisizer::resize(output.quantiles[q], ngroups);
+            sanisizer::resize(buffers.quantiles[q], ngroups);
+            for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
+                auto& curquant = output.quantiles[q][l];
+                tatami::resize_container_to_Index_size<I<decltype(curquant)>>(curquant, NR
+#ifdef SCRAN_AGGREGATE_TEST_INIT
+                    , SCRAN_AGGREGATE_TEST_INIT
+#endif
+                );
+                buffers.quantiles[q][l] = curquant.data();
             }
         }
-    }, p.nrow(), options.num_threads);
+    }
 }
 
-template<bool sparse_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
-void aggregate_across_cells_by_column(
-    const tatami::Matrix<Data_, Index_>& p,
+template<typename Index_, typename Group_>
+std::size_t count_groups(const Group_* const group, const Index_ n) {
+    if (n) {
+        const auto largest = *std::max_element(group, group + n);
+        if (!is_ignored_group(largest)) {
+            return sanisizer::sum<std::size_t>(largest, 1);
+        }
+    }
+    return 0;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Overload of `aggregate_across_cells()` that allocates memory for the results.
+ *
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * If integer, it should be large enough to avoid overflow.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * This should be large enough to avoid integer overflow, so setting it to be the same as `Index_` is a safe choice.
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ * @tparam Data_ Type of data in the input matrix, should be numeric.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param[in] group Pointer to an array of length equal to the number of columns of `input`, containing the assigned group for each cell.
+ * All entries should be integers in \f$[0, N)\f$ where \f$N\f$ is the number of unique groups.
+ * For signed `Group_`, cells with negative entries are ignored and never extracted from `input`.
+ * @param options Further options.
+ *
+ * @return Results of the aggregation, where the available statistics depend on `AggregateAcrossCellsOptions`.
+ */
+template<typename Sum_ = double, typename Detected_ = int, typename Float_ = double, typename Data_, typename Index_, typename Group_>
+AggregateAcrossCellsResults<Sum_, Detected_, Float_> aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
     const Group_* const group,
-    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
     const AggregateAcrossCellsOptions& options
 ) {
-    tatami::Options opt;
-    opt.sparse_ordered_index = false;
-    assert(buffers.medians.empty());
-
-    tatami::parallelize([&](const int t, const Index_ start, const Index_ length) -> void {
-        const auto NC = p.ncol();
-        auto ext = tatami::consecutive_extractor<sparse_>(p, false, static_cast<Index_>(0), NC, start, length, opt);
-        auto vbuffer = tatami::create_container_of_Index_size<std::vector<Data_> >(length);
-        auto ibuffer = [&]{
-            if constexpr(sparse_) {
-                return tatami::create_container_of_Index_size<std::vector<Index_> >(length);
-            } else {
-                return false;
-            }
-        }();
-
-        const auto num_sums = buffers.sums.size();
-        auto get_sum = [&](Index_ i) -> Sum_* { return buffers.sums[i]; };
-        tatami_stats::LocalOutputBuffers<Sum_, I<decltype(get_sum)>> local_sums(t, num_sums, start, length, std::move(get_sum));
-
-        const auto num_detected = buffers.detected.size();
-        auto get_detected = [&](Index_ i) -> Detected_* { return buffers.detected[i]; };
-        tatami_stats::LocalOutputBuffers<Detected_, I<decltype(get_detected)>> local_detected(t, num_detected, start, length, std::move(get_detected));
-
-        for (Index_ x = 0; x < NC; ++x) {
-            const auto current = group[x];
+    const Index_ NR = count_aggregated_genes(input.nrow(), options);
+    const Index_ NC = input.ncol();
+    const std::size_t ngroups = count_groups(group, NC);
 
-            if constexpr(sparse_) {
-                const auto col = ext->fetch(vbuffer.data(), ibuffer.data());
-                if (num_sums) {
-                    const auto cursum = local_sums.data(current);
-                    for (Index_ i = 0; i < col.number; ++i) {
-                        cursum[col.index[i] - start] += col.value[i];
-                    }
-                }
-                if (num_detected) {
-                    const auto curdetected = local_detected.data(current);
-                    for (Index_ i = 0; i < col.number; ++i) {
-                        curdetected[col.index[i] - start] += (col.value[i] > 0);
-                    }
-                }
+    AggregateAcrossCellsResults<Sum_, Detected_, Float_> output;
+    AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> buffers;
 
-            } else {
-                const auto col = ext->fetch(vbuffer.data());
-                if (num_sums) {
-                    const auto cursum = local_sums.data(current);
-                    for (Index_ i = 0; i < length; ++i) {
-                        cursum[i] += col[i];
-                    }
-                }
-                if (num_detected) {
-                    const auto curdetected = local_detected.data(current);
-                    for (Index_ i = 0; i < length; ++i) {
-                        curdetected[i] += (col[i] > 0);
-                    }
-                }
-            }
-        }
+    allocate_cells_results(NR, ngroups, options, output, buffers);
+    aggregate_across_cells(input, group, buffers, options);
+    return output;
+} 
 
-        local_sums.transfer();
-        local_detected.transfer();
-    }, p.nrow(), options.num_threads);
+/**
+ * Overload of `aggregate_across_cells()` with a custom transformation and detection predicate, which allocates memory for the results.
+ *
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ * @tparam Data_ Type of data in the input matrix, should be numeric.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ * @tparam Transform_ Class of the transformation function.
+ * @tparam Detect_ Class of the detection predicate.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param[in] group Pointer to an array of length equal to the number of columns of `input`, containing the assigned group for each cell.
+ * All entries should be integers in \f$[0, N)\f$ where \f$N\f$ is the number of unique groups.
+ * For signed `Group_`, cells with negative entries are ignored and never extracted from `input`.
+ * @param options Further options.
+ * @param transform Function to transform each expression value, see the other `aggregate_across_cells()` overload with a `transform` argument.
+ * @param detect Predicate to define detection from each transformed value, see the other `aggregate_across_cells()` overload with a `detect` argument.
+ *
+ * @return Results of the aggregation, where the available statistics depend on `AggregateAcrossCellsOptions`.
+ */
+template<typename Sum_ = double, typename Detected_ = int, typename Float_ = double, typename Data_, typename Index_, typename Group_, class Transform_, class Detect_>
+AggregateAcrossCellsResults<Sum_, Detected_, Float_> aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsOptions& options,
+    Transform_ transform,
+    Detect_ detect
+) {
+    AggregateAcrossCellsResults<Sum_, Detected_, Float_> output;
+    AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> buffers;
+    allocate_cells_results(count_aggregated_genes(input.nrow(), options), count_groups(group, input.ncol()), options, output, buffers);
+    aggregate_across_cells(input, group, buffers, options, std::move(transform), std::move(detect));
+    return output;
 }
+
 /**
- * @endcond
+ * Overload of `aggregate_across_cells()` with a precomputed plan, which allocates memory for the results.
+ *
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ * @tparam Data_ Type of data in the input matrix, should be numeric.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param plan Plan for the grouping of cells, where `AggregateAcrossCellsPlan::num_cells()` should be equal to the number of columns of `input`.
+ * @param options Further options.
+ *
+ * @return Results of the aggregation, where the available statistics depend on `AggregateAcrossCellsOptions`.
  */
+template<typename Sum_ = double, typename Detected_ = int, typename Float_ = double, typename Data_, typename Index_, typename Group_>
+AggregateAcrossCellsResults<Sum_, Detected_, Float_> aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const AggregateAcrossCellsPlan<Index_, Group_>& plan,
+    const AggregateAcrossCellsOptions& options
+) {
+    AggregateAcrossCellsResults<Sum_, Detected_, Float_> output;
+    AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> buffers;
+    allocate_cells_results(count_aggregated_genes(input.nrow(), options), plan.num_groups(), options, output, buffers);
+    aggregate_across_cells(input, plan, buffers, options);
+    return output;
+}
 
 /**
- * Aggregate expression values across groups of cells for each gene.
- * We report the sum of expression values, the number of cells with detected (i.e., positive) expression values, and the median of expression values in each group.
- * This is typically used to create pseudo-bulk expression profiles for cluster/sample combinations.
- * Expression values are generally expected to be counts so that the sums can be used as if they were counts from bulk data, e.g., for differential analyses with **edgeR**.
+ * Overload of `aggregate_across_cells()` with a precomputed plan and a custom transformation and detection predicate, which allocates memory for the results.
  *
- * @tparam Data_ Numeric type of data in the input matrix.
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
+ * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ * @tparam Data_ Type of data in the input matrix, should be numeric.
  * @tparam Index_ Integer type of index in the input matrix.
  * @tparam Group_ Integer type of the group assignments.
+ * @tparam Transform_ Class of the transformation function.
+ * @tparam Detect_ Class of the detection predicate.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param plan Plan for the grouping of cells, where `AggregateAcrossCellsPlan::num_cells()` should be equal to the number of columns of `input`.
+ * @param options Further options.
+ * @param transform Function that accepts an expression value and the index of its cell, see the other `aggregate_across_cells()` overloads.
+ * @param detect Function that accepts a transformed value and returns a boolean indicating whether it should be considered as detected.
+ *
+ * @return Results of the aggregation, where the available statistics depend on `AggregateAcrossCellsOptions`.
+ */
+template<typename Sum_ = double, typename Detected_ = int, typename Float_ = double, typename Data_, typename Index_, typename Group_, class Transform_, class Detect_>
+AggregateAcrossCellsResults<Sum_, Detected_, Float_> aggregate_across_cells(
+    const tatami::Matrix<Data_, Index_>& input,
+    const AggregateAcrossCellsPlan<Index_, Group_>& plan,
+    const AggregateAcrossCellsOptions& options,
+    Transform_ transform,
+    Detect_ detect
+) {
+    AggregateAcrossCellsResults<Sum_, Detected_, Float_> output;
+    AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> buffers;
+    allocate_cells_results(count_aggregated_genes(input.nrow(), options), plan.num_groups(), options, output, buffers);
+    aggregate_across_cells(input, plan, buffers, options, std::move(transform), std::move(detect));
+    return output;
+}
+
+/**
+ * Overload of `aggregate_across_cells()` for multiple groupings that allocates memory for the results.
+ *
  * @tparam Sum_ Numeric type of the sum, typically floating-point.
  * If integer, it should be large enough to avoid overflow.
  * @tparam Detected_ Numeric type (usually integer) of the number of detected cells. 
  * This should be large enough to avoid integer overflow, so setting it to be the same as `Index_` is a safe choice.
  * @tparam Float_ Floating-point type to be used for other statistics, e.g., median.
+ * @tparam Data_ Type of data in the input matrix, should be numeric.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
  *
  * @param input The input matrix, usually containing non-negative counts.
  * Rows are features and columns are cells.
- * @param[in] group Pointer to an array of length equal to the number of columns of `input`, containing the assigned group for each cell.
- * All entries should be integers in \f$[0, N)\f$ where \f$N\f$ is the number of unique groups.
- * @param[out] buffers Pre-allocated buffers in which to store the computed statistics. 
+ * @param[in] groups Vector of pointers to arrays of length equal to the number of columns of `input`.
+ * Each array contains the assigned group for each cell in a grouping, see the `group` argument in the other `aggregate_across_cells()` overloads.
  * @param options Further options.
+ *
+ * @return Vector of length equal to `groups`, containing the results of the aggregation for each grouping.
  */
-template<typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_, typename Float_>
-void aggregate_across_cells(
+template<typename Sum_ = double, typename Detected_ = int, typename Float_ = double, typename Data_, typename Index_, typename Group_>
+std::vector<AggregateAcrossCellsResults<Sum_, Detected_, Float_> > aggregate_across_cells(
     const tatami::Matrix<Data_, Index_>& input,
-    const Group_* const group,
-    const AggregateAcrossCellsBuffers<Sum_, Detected_, Float_>& buffers,
+    const std::vector<const Group_*>& groups,
     const AggregateAcrossCellsOptions& options
 ) {
-    if (input.prefer_rows() || !buffers.medians.empty()) {
-        if (input.sparse()) {
-            aggregate_across_cells_by_row<true>(input, group, buffers, options);
-        } else {
-            aggregate_across_cells_by_row<false>(input, group, buffers, options);
-        }
-    } else {
-        if (input.sparse()) {
-            aggregate_across_cells_by_column<true>(input, group, buffers, options);
-        } else {
-            aggregate_across_cells_by_column<false>(input, group, buffers, options);
-        }
+    const Index_ NR = count_aggregated_genes(input.nrow(), options);
+    const Index_ NC = input.ncol();
+    const auto ngroupings = groups.size();
+
+    auto output = sanisizer::create<std::vector<AggregateAcrossCellsResults<Sum_, Detected_, Float_> > >(ngroupings);
+    auto buffers = sanisizer::create<std::vector<AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> > >(ngroupings);
+    for (I<decltype(ngroupings)> i = 0; i < ngroupings; ++i) {
+        allocate_cells_results(NR, count_groups(groups[i], NC), options, output[i], buffers[i]);
     }
-} 
+
+    aggregate_across_cells(input, groups, buffers, options);
+    return output;
+}
 
 /**
- * Overload of `aggregate_across_cells()` that allocates memory for the results.
+ * @cond
+ */
+template<typename Value_>
+std::vector<Value_*> allocate_contiguous_cells_output(ContiguousMatrix<Value_>& matrix, const std::size_t num_genes, const std::size_t num_groups, const bool gene_major) {
+    allocate_contiguous_matrix(matrix, num_genes, num_groups, gene_major);
+    return contiguous_column_pointers(matrix).first;
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Overload of `aggregate_across_cells()` that stores each statistic in a single contiguous matrix.
+ * This avoids a separate allocation for each group, and the results can be used directly as a matrix by other frameworks or via `contiguous_matrix_to_tatami()`.
  *
  * @tparam Sum_ Numeric type of the sum, typically floating-point.
  * If integer, it should be large enough to avoid overflow.
@@ -384,75 +2973,90 @@ void aggregate_across_cells(
  * Rows are features and columns are cells.
  * @param[in] group Pointer to an array of length equal to the number of columns of `input`, containing the assigned group for each cell.
  * All entries should be integers in \f$[0, N)\f$ where \f$N\f$ is the number of unique groups.
+ * For signed `Group_`, cells with negative entries are ignored and never extracted from `input`.
+ * @param gene_major Whether to store each matrix in gene-major (i.e., row-major) order, where the statistics for all groups are contiguous for each gene.
+ * If false, the matrices are stored in group-major (i.e., column-major) order, where the statistics for all genes are contiguous for each group.
  * @param options Further options.
  *
  * @return Results of the aggregation, where the available statistics depend on `AggregateAcrossCellsOptions`.
  */
 template<typename Sum_ = double, typename Detected_ = int, typename Float_ = double, typename Data_, typename Index_, typename Group_>
-AggregateAcrossCellsResults<Sum_, Detected_, Float_> aggregate_across_cells(
+AggregateAcrossCellsContiguousResults<Sum_, Detected_, Float_> aggregate_across_cells_contiguous(
     const tatami::Matrix<Data_, Index_>& input,
     const Group_* const group,
+    const bool gene_major,
     const AggregateAcrossCellsOptions& options
 ) {
-    const Index_ NR = input.nrow();
+    const Index_ NR = count_aggregated_genes(input.nrow(), options);
     const Index_ NC = input.ncol();
-    const std::size_t ngroups = [&]{
-        if (NC) {
-            return sanisizer::sum<std::size_t>(*std::max_element(group, group + NC), 1);
-        } else {
-            return static_cast<std::size_t>(0);
-        }
-    }();
+    const std::size_t ngroups = count_groups(group, NC);
 
-    AggregateAcrossCellsResults<Sum_, Detected_, Float_> output;
+    AggregateAcrossCellsContiguousResults<Sum_, Detected_, Float_> output;
     AggregateAcrossCellsBuffers<Sum_, Detected_, Float_> buffers;
+    buffers.stride = (gene_major ? ngroups : 1);
 
     if (options.compute_sums) {
-        sanisizer::resize(output.sums, ngroups);
-        sanisizer::resize(buffers.sums, ngroups);
-        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
-            auto& cursum = output.sums[l];
-            tatami::resize_container_to_Index_size<I<decltype(cursum)>>(cursum, NR
-#ifdef SCRAN_AGGREGATE_TEST_INIT
-                , SCRAN_AGGREGATE_TEST_INIT
-#endif
-            );
-            buffers.sums[l] = cursum.data();
-        }
+        buffers.sums = allocate_contiguous_cells_output(output.sums, NR, ngroups, gene_major);
     }
-
     if (options.compute_detected) {
-        sanisizer::resize(output.detected, ngroups);
-        sanisizer::resize(buffers.detected, ngroups);
-        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
-            auto& curdet = output.detected[l];
-            tatami::resize_container_to_Index_size<I<decltype(curdet)>>(curdet, NR
-#ifdef SCRAN_AGGREGATE_TEST_INIT
-                , SCRAN_AGGREGATE_TEST_INIT
-#endif
-            );
-            buffers.detected[l] = curdet.data();
-        }
+        buffers.detected = allocate_contiguous_cells_output(output.detected, NR, ngroups, gene_major);
     }
-
     if (options.compute_medians) {
-        sanisizer::resize(output.medians, ngroups);
-        sanisizer::resize(buffers.medians, ngroups);
-        for (I<decltype(ngroups)> l = 0; l < ngroups; ++l) {
-            auto& curdet = output.medians[l];
-            tatami::resize_container_to_Index_size<I<decltype(curdet)>>(curdet, NR
-#ifdef SCRAN_AGGREGATE_TEST_INIT
-                , SCRAN_AGGREGATE_TEST_INIT
-#endif
-            );
-            buffers.medians[l] = curdet.data();
-        }
+        buffers.medians = allocate_contiguous_cells_output(output.medians, NR, ngroups, gene_major);
+    }
+    if (options.compute_sums_of_squares) {
+        buffers.sums_of_squares = allocate_contiguous_cells_output(output.sums_of_squares, NR, ngroups, gene_major);
+    }
+    if (options.compute_minima) {
+        buffers.minima = allocate_contiguous_cells_output(output.minima, NR, ngroups, gene_major);
+    }
+    if (options.compute_maxima) {
+        buffers.maxima = allocate_contiguous_cells_output(output.maxima, NR, ngroups, gene_major);
     }
 
+    const auto nquantiles = options.quantile_probabilities.size();
+    if (nquantiles) {
+        sanisizer::resize(output.quantiles, nquantiles);
+        sanisizer::resize(buffers.quantiles, nquantiles);
+        for (I<decltype(nquantiles)> q = 0; q < nquantiles; ++q) {
+            buffers.quantiles[q] = allocate_contiguous_cells_output(output.quantiles[q], NR, ngroups, gene_major);
+        }
+    }
 
     aggregate_across_cells(input, group, buffers, options);
     return output;
-} 
+}
+
+/**
+ * Compute the variance of expression values in a group from the sum and sum of squares reported by `aggregate_across_cells()`.
+ * This uses the usual denominator of \f$n - 1\f$ for a group of size \f$n\f$.
+ *
+ * @tparam Index_ Integer type of the number of genes.
+ * @tparam Size_ Integer type of the group size.
+ * @tparam Sum_ Numeric type of the sum.
+ * @tparam Float_ Floating-point type of the variance.
+ *
+ * @param num_genes Number of genes.
+ * @param group_size Number of cells in the group.
+ * @param[in] sums Pointer to an array of length `num_genes`, containing the sum of expression values in the group for each gene.
+ * @param[in] sums_of_squares Pointer to an array of length `num_genes`, containing the sum of squared expression values in the group for each gene.
+ * @param[out] variances Pointer to an array of length `num_genes`, to be filled with the variance of expression values in the group for each gene.
+ * Values are set to NaN if `group_size` is less than 2.
+ */
+template<typename Index_, typename Size_, typename Sum_, typename Float_>
+void compute_variances(const Index_ num_genes, const Size_ group_size, const Sum_* const sums, const Sum_* const sums_of_squares, Float_* const variances) {
+    if (group_size < 2) {
+        std::fill_n(variances, num_genes, std::numeric_limits<Float_>::quiet_NaN());
+        return;
+    }
+
+    const Float_ n = group_size;
+    for (Index_ g = 0; g < num_genes; ++g) {
+        const Float_ mean = sums[g] / n;
+        const Float_ var = (static_cast<Float_>(sums_of_squares[g]) - mean * static_cast<Float_>(sums[g])) / (n - 1);
+        variances[g] = std::max(var, static_cast<Float_>(0)); // protect against negative values from round-off.
+    }
+}
 
 }
 
@@ -0,0 +1,292 @@
+#ifndef SCRAN_AGGREGATE_AGGREGATE_ACROSS_CELLS_ACCUMULATOR_HPP
+#define SCRAN_AGGREGATE_AGGREGATE_ACROSS_CELLS_ACCUMULATOR_HPP
+
+#include <vector>
+#include <limits>
+#include <stdexcept>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+
+#include "tatami/tatami.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "aggregate_across_cells.hpp"
+#include "utils.hpp"
+
+/**
+ * @file aggregate_across_cells_accumulator.hpp
+ * @brief Aggregate expression values across cells in successive chunks.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @brief Accumulate aggregated expression values across chunks of cells.
+ *
+ * This computes the same sums and numbers of detected cells as `aggregate_across_cells()`,
+ * but the cells are supplied in successive column chunks, e.g., one chunk per sample when ingesting a large dataset.
+ * Each chunk is represented by its own `tatami::Matrix` with its own slice of the group assignments,
+ * so the full matrix never needs to be assembled in memory.
+ * Separate accumulators can also process different chunks in parallel and be combined at the end with `merge()`.
+ *
+ * Medians and quantiles cannot be accumulated in this manner, so `AggregateAcrossCellsOptions::compute_medians` and `AggregateAcrossCellsOptions::quantile_probabilities` are ignored.
+ *
+ * @tparam Index_ Integer type of index in the input matrices.
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * If integer, it should be large enough to avoid overflow.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells.
+ * This should be large enough to avoid integer overflow across all chunks.
+ */
+template<typename Index_, typename Sum_ = double, typename Detected_ = int>
+class AggregateAcrossCellsAccumulator {
+public:
+    /**
+     * @param num_genes Number of genes, i.e., rows in each chunk.
+     * @param num_groups Number of groups.
+     * All group assignments in subsequent calls to `add()` should be integers in \f$[0, N)\f$ where \f$N\f$ is `num_groups`.
+     * @param options Further options.
+     * Only `AggregateAcrossCellsOptions::compute_sums`, `AggregateAcrossCellsOptions::compute_detected` and `AggregateAcrossCellsOptions::num_threads` are used.
+     */
+    AggregateAcrossCellsAccumulator(const Index_ num_genes, const std::size_t num_groups, const AggregateAcrossCellsOptions& options) :
+        my_num_genes(num_genes),
+        my_num_groups(num_groups),
+        my_options(options)
+    {
+        my_options.compute_medians = false;
+        my_options.quantile_probabilities.clear();
+        my_options.cell_weights = NULL; // weights are indexed by the columns of the full matrix, not of each chunk.
+        my_options.gene_subset.reset(); // the running statistics are allocated for all genes.
+        sanisizer::resize(my_touched, my_num_groups);
+
+        if (my_options.compute_sums) {
+            sanisizer::resize(my_sums, my_num_groups);
+            for (auto& cursum : my_sums) {
+                tatami::resize_container_to_Index_size<I<decltype(cursum)>>(cursum, my_num_genes);
+            }
+        }
+
+        if (my_options.compute_detected) {
+            sanisizer::resize(my_detected, my_num_groups);
+            for (auto& curdet : my_detected) {
+                tatami::resize_container_to_Index_size<I<decltype(curdet)>>(curdet, my_num_genes);
+            }
+        }
+    }
+
+private:
+    Index_ my_num_genes;
+    std::size_t my_num_groups;
+    AggregateAcrossCellsOptions my_options;
+
+    std::vector<std::vector<Sum_> > my_sums;
+    std::vector<std::vector<Detected_> > my_detected;
+    std::vector<unsigned char> my_touched;
+
+    // Scratch space for groups that were already touched by a previous chunk.
+    std::vector<std::vector<Sum_> > my_scratch_sums;
+    std::vector<std::vector<Detected_> > my_scratch_detected;
+
+public:
+    /**
+     * Add a chunk of cells to the running statistics.
+     *
+     * @tparam Data_ Numeric type of data in the input matrix.
+     * @tparam Group_ Integer type of the group assignments.
+     *
+     * @param chunk Matrix containing a chunk of cells.
+     * Rows are features and columns are cells, where the number of rows should be equal to `num_genes()`.
+     * @param[in] group Pointer to an array of length equal to the number of columns of `chunk`, containing the assigned group for each cell in the chunk.
+     */
+    template<typename Data_, typename Group_>
+    void add(const tatami::Matrix<Data_, Index_>& chunk, const Group_* const group) {
+        if (chunk.nrow() != my_num_genes) {
+            throw std::runtime_error("number of rows in the chunk should be equal to the number of genes");
+        }
+
+        // Only groups that are present in this chunk need to be aggregated.
+        // Groups that we haven't seen before can be written directly into the running statistics,
+        // otherwise we write to scratch and add it to the running statistics afterwards.
+        constexpr std::size_t missing = std::numeric_limits<std::size_t>::max();
+        auto remapping = sanisizer::create<std::vector<std::size_t> >(my_num_groups, missing);
+        std::vector<std::size_t> present;
+
+        const Index_ NC = chunk.ncol();
+        auto compact = tatami::create_container_of_Index_size<std::vector<std::size_t> >(NC);
+        for (Index_ c = 0; c < NC; ++c) {
+            const auto g = group[c];
+            if constexpr(std::is_signed<Group_>::value) {
+                if (g < 0) {
+                    throw std::runtime_error("group assignments are out of range");
+                }
+            }
+            if (static_cast<std::size_t>(g) >= my_num_groups) {
+                throw std::runtime_error("group assignments are out of range");
+            }
+            auto& remapped = remapping[g];
+            if (remapped == missing) {
+                remapped = present.size();
+                present.push_back(g);
+            }
+            compact[c] = remapped;
+        }
+
+        const auto npresent = present.size();
+        AggregateAcrossCellsBuffers<Sum_, Detected_, double> buffers;
+        std::vector<std::pair<std::size_t, std::size_t> > pending; // (group, scratch index)
+        if (my_options.compute_sums) {
+            sanisizer::resize(buffers.sums, npresent);
+        }
+        if (my_options.compute_detected) {
+            sanisizer::resize(buffers.detected, npresent);
+        }
+
+        for (I<decltype(npresent)> p = 0; p < npresent; ++p) {
+            const auto g = present[p];
+            if (!my_touched[g]) {
+                if (my_options.compute_sums) {
+                    buffers.sums[p] = my_sums[g].data();
+                }
+                if (my_options.compute_detected) {
+                    buffers.detected[p] = my_detected[g].data();
+                }
+                my_touched[g] = 1;
+                continue;
+            }
+
+            const auto s = pending.size();
+            if (my_options.compute_sums) {
+                if (s == my_scratch_sums.size()) {
+                    my_scratch_sums.emplace_back();
+                    tatami::resize_container_to_Index_size<I<decltype(my_scratch_sums.back())>>(my_scratch_sums.back(), my_num_genes);
+                }
+                buffers.sums[p] = my_scratch_sums[s].data();
+            }
+            if (my_options.compute_detected) {
+                if (s == my_scratch_detected.size()) {
+                    my_scratch_detected.emplace_back();
+                    tatami::resize_container_to_Index_size<I<decltype(my_scratch_detected.back())>>(my_scratch_detected.back(), my_num_genes);
+                }
+                buffers.detected[p] = my_scratch_detected[s].data();
+            }
+            pending.emplace_back(g, s);
+        }
+
+        aggregate_across_cells(chunk, compact.data(), buffers, my_options);
+
+        if (!pending.empty()) {
+            tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
+                for (const auto& pp : pending) {
+                    if (my_options.compute_sums) {
+                        const auto src = my_scratch_sums[pp.second].data();
+                        const auto dest = my_sums[pp.first].data();
+                        for (Index_ i = start, end = start + length; i < end; ++i) {
+                            dest[i] += src[i];
+                        }
+                    }
+                    if (my_options.compute_detected) {
+                        const auto src = my_scratch_detected[pp.second].data();
+                        const auto dest = my_detected[pp.first].data();
+                        for (Index_ i = start, end = start + length; i < end; ++i) {
+                            dest[i] += src[i];
+                        }
+                    }
+                }
+            }, my_num_genes, my_options.num_threads);
+        }
+    }
+
+    /**
+     * Merge the running statistics from another accumulator into this one.
+     * This is typically used to combine accumulators that processed different chunks in parallel.
+     *
+     * @param other Another accumulator with the same number of genes and groups, and the same choice of statistics.
+     */
+    void merge(const AggregateAcrossCellsAccumulator& other) {
+        if (other.my_num_genes != my_num_genes || other.my_num_groups != my_num_groups) {
+            throw std::runtime_error("accumulators should have the same number of genes and groups");
+        }
+        if (other.my_options.compute_sums != my_options.compute_sums || other.my_options.compute_detected != my_options.compute_detected) {
+            throw std::runtime_error("accumulators should compute the same statistics");
+        }
+
+        tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
+            for (I<decltype(my_num_groups)> g = 0; g < my_num_groups; ++g) {
+                if (!other.my_touched[g]) {
+                    continue;
+                }
+                if (my_options.compute_sums) {
+                    const auto src = other.my_sums[g].data();
+                    const auto dest = my_sums[g].data();
+                    for (Index_ i = start, end = start + length; i < end; ++i) {
+                        dest[i] += src[i];
+                    }
+                }
+                if (my_options.compute_detected) {
+                    const auto src = other.my_detected[g].data();
+                    const auto dest = my_detected[g].data();
+                    for (Index_ i = start, end = start + length; i < end; ++i) {
+                        dest[i] += src[i];
+                    }
+                }
+            }
+        }, my_num_genes, my_options.num_threads);
+
+        for (I<decltype(my_num_groups)> g = 0; g < my_num_groups; ++g) {
+            my_touched[g] |= other.my_touched[g];
+        }
+    }
+
+public:
+    /**
+     * @return Number of genes.
+     */
+    Index_ num_genes() const {
+        return my_num_genes;
+    }
+
+    /**
+     * @return Number of groups.
+     */
+    std::size_t num_groups() const {
+        return my_num_groups;
+    }
+
+    /**
+     * @return Vector of length equal to the number of groups.
+     * Each inner vector is of length equal to the number of genes and contains the running sum of expression values for the corresponding group.
+     * This is empty if `AggregateAcrossCellsOptions::compute_sums = false`.
+     */
+    const std::vector<std::vector<Sum_> >& get_sums() const {
+        return my_sums;
+    }
+
+    /**
+     * @return Vector of length equal to the number of groups.
+     * Each inner vector is of length equal to the number of genes and contains the running number of cells with detected expression for the corresponding group.
+     * This is empty if `AggregateAcrossCellsOptions::compute_detected = false`.
+     */
+    const std::vector<std::vector<Detected_> >& get_detected() const {
+        return my_detected;
+    }
+
+    /**
+     * Move the running statistics into an `AggregateAcrossCellsResults` object.
+     * The accumulator should not be used after calling this method.
+     *
+     * @tparam Float_ Floating-point type for the results, only used for consistency with `aggregate_across_cells()`.
+     * @return Results of the aggregation across all chunks that were supplied to `add()` or `merge()`.
+     * `AggregateAcrossCellsResults::medians` is always empty.
+     */
+    template<typename Float_ = double>
+    AggregateAcrossCellsResults<Sum_, Detected_, Float_> finish() {
+        AggregateAcrossCellsResults<Sum_, Detected_, Float_> output;
+        output.sums.swap(my_sums);
+        output.detected.swap(my_detected);
+        return output;
+    }
+};
+
+}
+
+#endif
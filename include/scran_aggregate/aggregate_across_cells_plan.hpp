@@ -0,0 +1,169 @@
+#ifndef SCRAN_AGGREGATE_AGGREGATE_ACROSS_CELLS_PLAN_HPP
+#define SCRAN_AGGREGATE_AGGREGATE_ACROSS_CELLS_PLAN_HPP
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "group_layout.hpp"
+
+/**
+ * @file aggregate_across_cells_plan.hpp
+ * @brief Precomputed grouping metadata for `aggregate_across_cells()`.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @brief Precomputed metadata for a grouping of cells.
+ *
+ * Each call to `aggregate_across_cells()` scans the group assignments to count the number of groups,
+ * identify the ignored cells, and (for some statistics) create a group-sorted ordering of the cells.
+ * This class performs these computations once so that they can be re-used across multiple calls with the same grouping,
+ * e.g., for different modalities, feature subsets or bootstrap iterations.
+ *
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Group_ Integer type of the group assignments.
+ */
+template<typename Index_, typename Group_>
+class AggregateAcrossCellsPlan {
+public:
+    /**
+     * @param num_cells Number of cells, i.e., columns of the matrices to be aggregated.
+     * @param[in] group Pointer to an array of length `num_cells`, containing the assigned group for each cell.
+     * All entries should be integers in \f$[0, N)\f$ where \f$N\f$ is the number of unique groups.
+     * For signed `Group_`, cells with negative entries are ignored.
+     * The contents of this array are copied so it does not need to outlive the plan.
+     */
+    AggregateAcrossCellsPlan(const Index_ num_cells, const Group_* const group) :
+        my_num_cells(num_cells),
+        my_group(group, group + num_cells)
+    {
+        bool any_ignored = false;
+        for (Index_ c = 0; c < num_cells; ++c) {
+            const auto g = group[c];
+            if (is_ignored_group(g)) {
+                any_ignored = true;
+            } else if (static_cast<std::size_t>(g) >= my_num_groups) {
+                my_num_groups = sanisizer::sum<std::size_t>(g, 1);
+            }
+        }
+
+        my_layout = create_group_layout(group, num_cells, my_num_groups);
+
+        if (any_ignored) {
+            auto kept = std::make_shared<std::vector<Index_> >();
+            tatami::resize_container_to_Index_size(my_kept_group, my_layout.permutation.size());
+            kept->reserve(my_layout.permutation.size());
+            for (Index_ c = 0; c < num_cells; ++c) {
+                if (!is_ignored_group(group[c])) {
+                    my_kept_group[kept->size()] = group[c];
+                    kept->push_back(c);
+                }
+            }
+            my_kept_layout = create_group_layout(my_kept_group.data(), static_cast<Index_>(kept->size()), my_num_groups);
+            my_kept_cells = std::move(kept);
+        }
+    }
+
+private:
+    Index_ my_num_cells;
+    std::size_t my_num_groups = 0;
+    std::vector<Group_> my_group;
+    GroupLayout<Index_> my_layout;
+
+    tatami::VectorPtr<Index_> my_kept_cells;
+    std::vector<Group_> my_kept_group;
+    GroupLayout<Index_> my_kept_layout;
+
+public:
+    /**
+     * @return Number of cells.
+     */
+    Index_ num_cells() const {
+        return my_num_cells;
+    }
+
+    /**
+     * @return Number of groups, i.e., one plus the largest group assignment.
+     * This is zero if all cells are ignored.
+     */
+    std::size_t num_groups() const {
+        return my_num_groups;
+    }
+
+    /**
+     * @return Vector of length equal to `num_groups()`, containing the number of (non-ignored) cells in each group.
+     */
+    const std::vector<Index_>& group_sizes() const {
+        return my_layout.sizes;
+    }
+
+    /**
+     * @return Vector containing the indices of all non-ignored cells, ordered by group and then by increasing index within each group.
+     */
+    const std::vector<Index_>& permutation() const {
+        return my_layout.permutation;
+    }
+
+    /**
+     * @return Vector of length equal to `num_groups()` plus one, containing the start of each group's segment in `permutation()`.
+     */
+    const std::vector<std::size_t>& offsets() const {
+        return my_layout.offsets;
+    }
+
+    /**
+     * @return Pointer to an array of length `num_cells()`, containing the group assignment for each cell.
+     */
+    const Group_* group() const {
+        return my_group.data();
+    }
+
+    /**
+     * @return Pointer to an array containing the group assignments of the non-ignored cells in order of increasing index.
+     * This has length equal to the sum of `group_sizes()`.
+     */
+    const Group_* compact_group() const {
+        if (my_kept_cells) {
+            return my_kept_group.data();
+        } else {
+            return my_group.data();
+        }
+    }
+
+    /**
+     * @return Pointer to a vector of the indices of the non-ignored cells, sorted in increasing order.
+     * This is NULL if no cells are ignored.
+     */
+    const tatami::VectorPtr<Index_>& kept_cells() const {
+        return my_kept_cells;
+    }
+
+    /**
+     * @cond
+     */
+    // Layout of all cells, where the permutation contains the original cell indices.
+    const GroupLayout<Index_>& layout() const {
+        return my_layout;
+    }
+
+    // Layout of the non-ignored cells, where the permutation contains positions in kept_cells().
+    const GroupLayout<Index_>& compact_layout() const {
+        if (my_kept_cells) {
+            return my_kept_layout;
+        } else {
+            return my_layout;
+        }
+    }
+    /**
+     * @endcond
+     */
+};
+
+}
+
+#endif
@@ -0,0 +1,475 @@
+#ifndef SCRAN_AGGREGATE_AGGREGATE_ACROSS_CELLS_SPARSE_HPP
+#define SCRAN_AGGREGATE_AGGREGATE_ACROSS_CELLS_SPARSE_HPP
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "aggregate_across_cells.hpp"
+#include "fused_kernels.hpp"
+#include "utils.hpp"
+
+/**
+ * @file aggregate_across_cells_sparse.hpp
+ * @brief Aggregate expression values across cells into sparse results.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @brief Sparse matrix of aggregated statistics in compressed sparse row format.
+ *
+ * Rows are genes and columns are groups, where only the non-zero statistics are stored.
+ * This can be converted to a `tatami::CompressedSparseMatrix` without any copies via `compressed_sparse_rows_to_tatami()`.
+ *
+ * @tparam Value_ Type of the statistic.
+ * @tparam Index_ Integer type of the column indices.
+ */
+template<typename Value_, typename Index_>
+struct CompressedSparseRows {
+    /**
+     * Number of rows, i.e., genes.
+     */
+    std::size_t num_rows = 0;
+
+    /**
+     * Number of columns, i.e., groups.
+     */
+    std::size_t num_columns = 0;
+
+    /**
+     * Values of the non-zero statistics for all rows.
+     */
+    std::vector<Value_> values;
+
+    /**
+     * Column indices of the non-zero statistics, of the same length as `values`.
+     * Indices are sorted in increasing order within each row.
+     */
+    std::vector<Index_> indices;
+
+    /**
+     * Vector of length equal to `num_rows` plus 1.
+     * The non-zero statistics for row `r` are stored in `values` and `indices` from `pointers[r]` to `pointers[r + 1]`.
+     */
+    std::vector<std::size_t> pointers;
+};
+
+/**
+ * Convert a `CompressedSparseRows` into a `tatami::CompressedSparseMatrix` without copying its contents.
+ *
+ * @tparam Value_ Type of the statistic.
+ * @tparam Index_ Integer type of the column indices.
+ *
+ * @param matrix Sparse matrix of statistics, typically produced by `aggregate_across_cells_sparse()`.
+ * This is moved into the output object.
+ *
+ * @return Pointer to a `tatami::CompressedSparseMatrix` that holds the contents of `matrix`.
+ */
+template<typename Value_, typename Index_>
+std::shared_ptr<tatami::Matrix<Value_, Index_> > compressed_sparse_rows_to_tatami(CompressedSparseRows<Value_, Index_> matrix) {
+    const auto nrow = sanisizer::cast<Index_>(matrix.num_rows);
+    const auto ncol = sanisizer::cast<Index_>(matrix.num_columns);
+    return std::make_shared<tatami::CompressedSparseMatrix<Value_, Index_, std::vector<Value_>, std::vector<Index_>, std::vector<std::size_t> > >(
+        nrow,
+        ncol,
+        std::move(matrix.values),
+        std::move(matrix.indices),
+        std::move(matrix.pointers),
+        true
+    );
+}
+
+/**
+ * @brief Sparse results of `aggregate_across_cells_sparse()`.
+ *
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * @tparam Detected_ Type of the number of detected cells, usually integer.
+ * @tparam Index_ Integer type of the group indices.
+ */
+template<typename Sum_, typename Detected_, typename Index_>
+struct AggregateAcrossCellsSparseResults {
+    /**
+     * Sparse matrix of the summed expression across all cells in each group (column) for each gene (row).
+     * This has no rows or columns if `AggregateAcrossCellsOptions::compute_sums = false`.
+     */
+    CompressedSparseRows<Sum_, Index_> sums;
+
+    /**
+     * Sparse matrix of the number of cells with detected expression in each group (column) for each gene (row).
+     * This has no rows or columns if `AggregateAcrossCellsOptions::compute_detected = false`.
+     */
+    CompressedSparseRows<Detected_, Index_> detected;
+};
+
+/**
+ * @cond
+ */
+// Non-zero statistics for a contiguous range of rows, to be assembled into the final matrix.
+template<typename Value_, typename Index_>
+struct SparseRowFragment {
+    std::vector<Value_> values;
+    std::vector<Index_> indices;
+};
+
+template<typename Value_, typename Index_>
+void add_sparse_entry(SparseRowFragment<Value_, Index_>& fragment, std::vector<std::size_t>& counts, const Index_ r, const Index_ g, const Value_ val) {
+    if (val != 0) {
+        fragment.values.push_back(val);
+        fragment.indices.push_back(g);
+        ++counts[r];
+    }
+}
+
+template<typename Value_, typename Index_>
+void assemble_sparse_rows(
+    CompressedSparseRows<Value_, Index_>& output,
+    const Index_ nrow,
+    const std::size_t ncol,
+    const std::vector<std::size_t>& counts,
+    const std::vector<SparseRowFragment<Value_, Index_> >& fragments,
+    const std::vector<Index_>& fragment_starts,
+    const int num_threads
+) {
+    output.num_rows = nrow;
+    output.num_columns = ncol;
+    sanisizer::resize(output.pointers, sanisizer::sum<std::size_t>(nrow, 1));
+    for (Index_ r = 0; r < nrow; ++r) {
+        output.pointers[r + 1] = output.pointers[r] + counts[r];
+    }
+
+    const auto total = output.pointers.back();
+    sanisizer::resize(output.values, total);
+    sanisizer::resize(output.indices, total);
+    const auto nfragments = fragments.size();
+    tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+        for (std::size_t f = start, end = start + length; f < end; ++f) {
+            const auto& frag = fragments[f];
+            const auto offset = output.pointers[fragment_starts[f]];
+            std::copy(frag.values.begin(), frag.values.end(), output.values.begin() + offset);
+            std::copy(frag.indices.begin(), frag.indices.end(), output.indices.begin() + offset);
+        }
+    }, nfragments, num_threads);
+}
+
+template<bool sparse_, bool sums_, bool detected_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_>
+void aggregate_across_cells_sparse_by_row(
+    const tatami::Matrix<Data_, Index_>& p,
+    const Group_* const group,
+    const Index_ ngroups,
+    std::vector<std::size_t>& sum_counts,
+    std::vector<SparseRowFragment<Sum_, Index_> >& sum_fragments,
+    std::vector<std::size_t>& detected_counts,
+    std::vector<SparseRowFragment<Detected_, Index_> >& detected_fragments,
+    std::vector<Index_>& fragment_starts,
+    const AggregateAcrossCellsOptions& options
+) {
+    tatami::Options opt;
+    opt.sparse_ordered_index = false;
+    const Index_ NC = p.ncol();
+
+    tatami::parallelize([&](const int t, const Index_ s, const Index_ l) -> void {
+        auto ext = tatami::consecutive_extractor<sparse_>(p, true, s, l, opt);
+        fragment_starts[t] = s;
+
+        std::vector<Sum_> tmp_sums;
+        if constexpr(sums_) {
+            tatami::resize_container_to_Index_size(tmp_sums, ngroups);
+        }
+        std::vector<Detected_> tmp_detected;
+        if constexpr(detected_) {
+            tatami::resize_container_to_Index_size(tmp_detected, ngroups);
+        }
+
+        // For sparse rows, we only visit the groups that were touched by each row.
+        std::vector<unsigned char> tmp_touched;
+        std::vector<Index_> touched;
+        if constexpr(sparse_) {
+            tatami::resize_container_to_Index_size(tmp_touched, ngroups);
+        }
+
+        auto vbuffer = tatami::create_container_of_Index_size<std::vector<Data_> >(NC);
+        auto ibuffer = [&]{
+            if constexpr(sparse_) {
+                return tatami::create_container_of_Index_size<std::vector<Index_> >(NC);
+            } else {
+                return false;
+            }
+        }();
+
+        for (Index_ x = s, end = s + l; x < end; ++x) {
+            if constexpr(sparse_) {
+                const auto row = ext->fetch(vbuffer.data(), ibuffer.data());
+                for (Index_ j = 0; j < row.number; ++j) {
+                    const Index_ g = group[row.index[j]];
+                    const auto val = row.value[j];
+                    if (!tmp_touched[g]) {
+                        tmp_touched[g] = 1;
+                        touched.push_back(g);
+                    }
+                    if constexpr(sums_) {
+                        tmp_sums[g] += val;
+                    }
+                    if constexpr(detected_) {
+                        tmp_detected[g] += (val > 0);
+                    }
+                }
+
+                // Indices should be sorted within each row of the output.
+                std::sort(touched.begin(), touched.end());
+                for (const auto g : touched) {
+                    if constexpr(sums_) {
+                        add_sparse_entry(sum_fragments[t], sum_counts, x, g, tmp_sums[g]);
+                        tmp_sums[g] = 0;
+                    }
+                    if constexpr(detected_) {
+                        add_sparse_entry(detected_fragments[t], detected_counts, x, g, tmp_detected[g]);
+                        tmp_detected[g] = 0;
+                    }
+                    tmp_touched[g] = 0;
+                }
+                touched.clear();
+
+            } else {
+                const auto row = ext->fetch(vbuffer.data());
+                for (Index_ j = 0; j < NC; ++j) {
+                    const auto g = group[j];
+                    const auto val = row[j];
+                    if constexpr(sums_) {
+                        tmp_sums[g] += val;
+                    }
+                    if constexpr(detected_) {
+                        tmp_detected[g] += (val > 0);
+                    }
+                }
+
+                for (Index_ g = 0; g < ngroups; ++g) {
+                    if constexpr(sums_) {
+                        add_sparse_entry(sum_fragments[t], sum_counts, x, g, tmp_sums[g]);
+                        tmp_sums[g] = 0;
+                    }
+                    if constexpr(detected_) {
+                        add_sparse_entry(detected_fragments[t], detected_counts, x, g, tmp_detected[g]);
+                        tmp_detected[g] = 0;
+                    }
+                }
+            }
+        }
+    }, p.nrow(), options.num_threads);
+}
+
+template<bool sparse_, bool sums_, bool detected_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_>
+void aggregate_across_cells_sparse_by_column(
+    const tatami::Matrix<Data_, Index_>& p,
+    const Group_* const group,
+    const Index_ ngroups,
+    std::vector<std::size_t>& sum_counts,
+    std::vector<SparseRowFragment<Sum_, Index_> >& sum_fragments,
+    std::vector<std::size_t>& detected_counts,
+    std::vector<SparseRowFragment<Detected_, Index_> >& detected_fragments,
+    std::vector<Index_>& fragment_starts,
+    const AggregateAcrossCellsOptions& options
+) {
+    tatami::Options opt;
+    opt.sparse_ordered_index = false;
+    const Index_ NC = p.ncol();
+
+    tatami::parallelize([&](const int t, const Index_ start, const Index_ length) -> void {
+        fragment_starts[t] = start;
+
+        // We process the rows in blocks so that the dense partial statistics
+        // for each block are capped. Each block requires a separate pass over
+        // the columns but each value is still only extracted once.
+        Index_ block_size = length;
+        const std::size_t max_block = std::max(static_cast<std::size_t>(1), options.sparse_buffer_size / std::max(static_cast<std::size_t>(1), static_cast<std::size_t>(ngroups)));
+        if (static_cast<std::size_t>(block_size) > max_block) {
+            block_size = max_block;
+        }
+
+        // Partial statistics are stored as [group * block_size + row].
+        std::vector<Sum_> block_sums;
+        if constexpr(sums_) {
+            sanisizer::resize(block_sums, sanisizer::product<std::size_t>(block_size, ngroups));
+        }
+        std::vector<Detected_> block_detected;
+        if constexpr(detected_) {
+            sanisizer::resize(block_detected, sanisizer::product<std::size_t>(block_size, ngroups));
+        }
+
+        auto vbuffer = tatami::create_container_of_Index_size<std::vector<Data_> >(block_size);
+        auto ibuffer = [&]{
+            if constexpr(sparse_) {
+                return tatami::create_container_of_Index_size<std::vector<Index_> >(block_size);
+            } else {
+                return false;
+            }
+        }();
+
+        for (Index_ block_start = start, end = start + length; block_start < end; block_start += block_size) {
+            const Index_ block_length = std::min(block_size, static_cast<Index_>(end - block_start));
+            auto ext = tatami::consecutive_extractor<sparse_>(p, false, static_cast<Index_>(0), NC, block_start, block_length, opt);
+
+            for (Index_ x = 0; x < NC; ++x) {
+                const std::size_t offset = static_cast<std::size_t>(group[x]) * block_size;
+
+                if constexpr(sparse_) {
+                    const auto col = ext->fetch(vbuffer.data(), ibuffer.data());
+                    for (Index_ i = 0; i < col.number; ++i) {
+                        const auto r = offset + (col.index[i] - block_start);
+                        const auto val = col.value[i];
+                        if constexpr(sums_) {
+                            block_sums[r] += val;
+                        }
+                        if constexpr(detected_) {
+                            block_detected[r] += (val > 0);
+                        }
+                    }
+
+                } else {
+                    const auto col = ext->fetch(vbuffer.data());
+                    if constexpr(sums_ && detected_) {
+                        add_sums_and_detected(col, block_length, block_sums.data() + offset, block_detected.data() + offset);
+                    } else if constexpr(sums_) {
+                        const auto cursum = block_sums.data() + offset;
+                        for (Index_ i = 0; i < block_length; ++i) {
+                            cursum[i] += col[i];
+                        }
+                    } else if constexpr(detected_) {
+                        const auto curdetected = block_detected.data() + offset;
+                        for (Index_ i = 0; i < block_length; ++i) {
+                            curdetected[i] += (col[i] > 0);
+                        }
+                    }
+                }
+            }
+
+            for (Index_ i = 0; i < block_length; ++i) {
+                for (Index_ g = 0; g < ngroups; ++g) {
+                    const auto r = static_cast<std::size_t>(g) * block_size + i;
+                    if constexpr(sums_) {
+                        add_sparse_entry(sum_fragments[t], sum_counts, static_cast<Index_>(block_start + i), g, block_sums[r]);
+                        block_sums[r] = 0;
+                    }
+                    if constexpr(detected_) {
+                        add_sparse_entry(detected_fragments[t], detected_counts, static_cast<Index_>(block_start + i), g, block_detected[r]);
+                        block_detected[r] = 0;
+                    }
+                }
+            }
+        }
+    }, p.nrow(), options.num_threads);
+}
+
+template<bool sums_, bool detected_, typename Data_, typename Index_, typename Group_, typename Sum_, typename Detected_>
+void aggregate_across_cells_sparse_dispatch(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const Index_ ngroups,
+    std::vector<std::size_t>& sum_counts,
+    std::vector<SparseRowFragment<Sum_, Index_> >& sum_fragments,
+    std::vector<std::size_t>& detected_counts,
+    std::vector<SparseRowFragment<Detected_, Index_> >& detected_fragments,
+    std::vector<Index_>& fragment_starts,
+    const AggregateAcrossCellsOptions& options
+) {
+    if (input.prefer_rows()) {
+        if (input.sparse()) {
+            aggregate_across_cells_sparse_by_row<true, sums_, detected_>(input, group, ngroups, sum_counts, sum_fragments, detected_counts, detected_fragments, fragment_starts, options);
+        } else {
+            aggregate_across_cells_sparse_by_row<false, sums_, detected_>(input, group, ngroups, sum_counts, sum_fragments, detected_counts, detected_fragments, fragment_starts, options);
+        }
+    } else {
+        if (input.sparse()) {
+            aggregate_across_cells_sparse_by_column<true, sums_, detected_>(input, group, ngroups, sum_counts, sum_fragments, detected_counts, detected_fragments, fragment_starts, options);
+        } else {
+            aggregate_across_cells_sparse_by_column<false, sums_, detected_>(input, group, ngroups, sum_counts, sum_fragments, detected_counts, detected_fragments, fragment_starts, options);
+        }
+    }
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Aggregate expression values across groups of cells for each gene, storing the sums and numbers of detected cells in sparse form.
+ * This is more memory-efficient than `aggregate_across_cells()` when there are many small groups such that most statistics are zero, e.g., for pseudo-bulk profiles of many samples.
+ * The results are written directly into compressed sparse row matrices without ever creating the dense form.
+ *
+ * Only `AggregateAcrossCellsOptions::compute_sums`, `AggregateAcrossCellsOptions::compute_detected`, `AggregateAcrossCellsOptions::sparse_buffer_size` and `AggregateAcrossCellsOptions::num_threads` are used here.
+ *
+ * @tparam Sum_ Numeric type of the sum, typically floating-point.
+ * If integer, it should be large enough to avoid overflow.
+ * @tparam Detected_ Numeric type (usually integer) of the number of detected cells.
+ * This should be large enough to avoid integer overflow, so setting it to be the same as `Index_` is a safe choice.
+ * @tparam Data_ Type of data in the input matrix, should be numeric.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * This is also used for the group indices in the output, so it should be large enough to hold the number of groups.
+ * @tparam Group_ Integer type of the group assignments.
+ *
+ * @param input The input matrix, usually containing non-negative counts.
+ * Rows are features and columns are cells.
+ * @param[in] group Pointer to an array of length equal to the number of columns of `input`, containing the assigned group for each cell.
+ * All entries should be integers in \f$[0, N)\f$ where \f$N\f$ is the number of unique groups.
+ * @param options Further options.
+ *
+ * @return Sparse results of the aggregation.
+ */
+template<typename Sum_ = double, typename Detected_ = int, typename Data_, typename Index_, typename Group_>
+AggregateAcrossCellsSparseResults<Sum_, Detected_, Index_> aggregate_across_cells_sparse(
+    const tatami::Matrix<Data_, Index_>& input,
+    const Group_* const group,
+    const AggregateAcrossCellsOptions& options
+) {
+    const Index_ NR = input.nrow();
+    const Index_ NC = input.ncol();
+    const Index_ ngroups = [&]{
+        if (NC) {
+            return sanisizer::sum<Index_>(*std::max_element(group, group + NC), 1);
+        } else {
+            return static_cast<Index_>(0);
+        }
+    }();
+
+    // Each thread stores the non-zero statistics for its range of rows,
+    // which are then assembled into the final matrix.
+    const auto nthreads = std::max(1, options.num_threads);
+    std::vector<std::size_t> sum_counts, detected_counts;
+    std::vector<SparseRowFragment<Sum_, Index_> > sum_fragments;
+    std::vector<SparseRowFragment<Detected_, Index_> > detected_fragments;
+    if (options.compute_sums) {
+        tatami::resize_container_to_Index_size(sum_counts, NR);
+        sanisizer::resize(sum_fragments, nthreads);
+    }
+    if (options.compute_detected) {
+        tatami::resize_container_to_Index_size(detected_counts, NR);
+        sanisizer::resize(detected_fragments, nthreads);
+    }
+    auto fragment_starts = sanisizer::create<std::vector<Index_> >(nthreads, NR);
+
+    if (options.compute_sums) {
+        if (options.compute_detected) {
+            aggregate_across_cells_sparse_dispatch<true, true>(input, group, ngroups, sum_counts, sum_fragments, detected_counts, detected_fragments, fragment_starts, options);
+        } else {
+            aggregate_across_cells_sparse_dispatch<true, false>(input, group, ngroups, sum_counts, sum_fragments, detected_counts, detected_fragments, fragment_starts, options);
+        }
+    } else if (options.compute_detected) {
+        aggregate_across_cells_sparse_dispatch<false, true>(input, group, ngroups, sum_counts, sum_fragments, detected_counts, detected_fragments, fragment_starts, options);
+    }
+
+    AggregateAcrossCellsSparseResults<Sum_, Detected_, Index_> output;
+    if (options.compute_sums) {
+        assemble_sparse_rows(output.sums, NR, ngroups, sum_counts, sum_fragments, fragment_starts, options.num_threads);
+    }
+    if (options.compute_detected) {
+        assemble_sparse_rows(output.detected, NR, ngroups, detected_counts, detected_fragments, fragment_starts, options.num_threads);
+    }
+    return output;
+}
+
+}
+
+#endif
@@ -6,12 +6,19 @@
 #include <unordered_set>
 #include <stdexcept>
 #include <cstddef>
+#include <limits>
+#include <numeric>
+#include <type_traits>
 
 #include "tatami/tatami.hpp"
 #include "tatami_stats/tatami_stats.hpp"
 #include "sanisizer/sanisizer.hpp"
 
 #include "utils.hpp"
+#include "contiguous_matrix.hpp"
+#include "compensated_sum.hpp"
+#include "parallelize_by_cost.hpp"
+#include "instrumentation.hpp"
 
 /**
  * @file aggregate_across_genes.hpp
@@ -35,6 +42,41 @@ struct AggregateAcrossGenesOptions {
      * If the gene set contains weights, a weighted average is computed.
      */
     bool average = false;
+
+    /**
+     * Pointer to an array of length equal to the number of cells plus 1, containing the cumulative cost of processing each cell,
+     * i.e., the cost of cell `i` is `cell_costs[i + 1] - cell_costs[i]`.
+     * For example, the pointers of a compressed sparse column matrix can be used here, where the cost of each cell is its number of non-zero values.
+     * If provided, the cells are partitioned across threads so that each thread has roughly the same total cost.
+     * If NULL, each thread is assigned roughly the same number of cells.
+     */
+    const std::size_t* cell_costs = NULL;
+
+    /**
+     * Maximum memory usage, in bytes, of the scratch space for all threads, as predicted by `estimate_aggregate_across_genes_memory()`.
+     * If set, the execution path and the effective number of threads are chosen to fit within this budget.
+     * The preferred path for the matrix's layout is used with as many threads as possible (up to `num_threads`);
+     * if it does not fit with a single thread, the other path is tried in the same manner.
+     * If neither path fits, the path with the smallest predicted memory usage is used.
+     * By default, no limit is imposed.
+     */
+    std::size_t memory_budget = std::numeric_limits<std::size_t>::max();
+
+    /**
+     * Whether to compute the sums with compensated (Neumaier) summation.
+     * The partial sums are held in at least double precision and are only converted to `Sum_` when storing the final results.
+     * This allows `Sum_` to be `float` without the loss of precision from naively accumulating single-precision values across large gene sets.
+     * This requires strict floating-point semantics, i.e., the library should not be compiled with options like `-ffast-math`.
+     * Only relevant if `Sum_` is a floating-point type.
+     */
+    bool compensated_sums = false;
+
+    /**
+     * Pointer to an `Instrumentation` instance to be filled with per-thread timings and counters.
+     * This is ignored unless the `SCRAN_AGGREGATE_INSTRUMENTATION` macro is defined, see `Instrumentation` for details.
+     * If NULL, no instrumentation is performed.
+     */
+    Instrumentation* instrumentation = NULL;
 };
 
 /**
@@ -49,6 +91,12 @@ struct AggregateAcrossGenesBuffers {
      * to be filled with the (weighted) sum/mean of expression values for each gene set.
      */
     std::vector<Sum_*> sum;
+
+    /**
+     * Stride between consecutive cells in each array, i.e., the sum/mean for cell `c` is stored at `sum[s][c * stride]` for gene set `s`.
+     * Setting this to the number of gene sets allows the results to be written directly into a cell-major matrix, see `aggregate_across_genes_contiguous()`.
+     */
+    std::size_t stride = 1;
 };
 
 /**
@@ -65,6 +113,19 @@ struct AggregateAcrossGenesResults {
     std::vector<std::vector<Sum_> > sum;
 };
 
+/**
+ * @brief Results of `aggregate_across_genes_contiguous()`.
+ * @tparam Sum_ Floating-point type of the sum/mean.
+ */
+template <typename Sum_>
+struct AggregateAcrossGenesContiguousResults {
+    /**
+     * Matrix where the rows are gene sets and the columns are cells.
+     * Each entry contains the (weighted) sum/mean of expression values across all genes in the corresponding gene set.
+     */
+    ContiguousMatrix<Sum_> sum;
+};
+
 /**
  * @cond
  */
@@ -100,7 +161,7 @@ std::pair<std::vector<Index_>, Index_> create_subset_mapping(const std::vector<I
     return std::make_pair(std::move(mapping), offset);
 }
 
-template<typename Data_, typename Index_, typename Gene_, typename Weight_, typename Sum_>
+template<bool compensated_, typename Data_, typename Index_, typename Gene_, typename Weight_, typename Sum_>
 void aggregate_across_genes_by_column(
     const tatami::Matrix<Data_, Index_>& p,
     const std::vector<std::tuple<std::size_t, const Gene_*, const Weight_*> >& gene_sets,
@@ -134,18 +195,24 @@ void aggregate_across_genes_by_column(
         }
     }
 
-    tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
+    parallelize_by_cost([&](const int t, const Index_ start, const Index_ length) -> void {
         // We extract as sparse even if it is dense, as it's just
         // easier to index from a dense vector.
         auto ext = tatami::consecutive_extractor<false>(p, false, start, length, subset_of_interest);
         auto vbuffer = tatami::create_container_of_Index_size<std::vector<Data_> >(nsubs);
 
+        InstrumentationTimer timer(options.instrumentation, t);
+        timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(vbuffer));
+
         for (Index_ x = start, end = start + length; x < end; ++x) {
             const auto ptr = ext->fetch(vbuffer.data());
+            timer.lap(&ThreadInstrumentation::extraction_time);
+            timer.add(&ThreadInstrumentation::columns_fetched, 1);
+            timer.add(&ThreadInstrumentation::nonzeros_processed, nsubs);
             for (I<decltype(num_sets)> s = 0; s < num_sets; ++s) {
                 const auto& set = remapping[s];
 
-                Sum_ value = 0;
+                SumAccumulator<compensated_, Sum_> value = 0;
                 if (set.second) {
                     for (I<decltype(set.first.size())> i = 0, send = set.first.size(); i < send; ++i) {
                         value += ptr[set.first[i]] * set.second[i];
@@ -156,14 +223,15 @@ void aggregate_across_genes_by_column(
                     }
                 }
 
-                buffers.sum[s][x] = value;
+                buffers.sum[s][static_cast<std::size_t>(x) * buffers.stride] = static_cast<Sum_>(value);
             }
+            timer.lap(&ThreadInstrumentation::accumulation_time);
         }
 
-    }, p.ncol(), options.num_threads);
+    }, p.ncol(), options.cell_costs, options.num_threads);
 }
 
-template<typename Data_, typename Index_, typename Gene_, typename Weight_, typename Sum_>
+template<bool compensated_, typename Data_, typename Index_, typename Gene_, typename Weight_, typename Sum_>
 void aggregate_across_genes_by_row(
     const tatami::Matrix<Data_, Index_>& p,
     const std::vector<std::tuple<std::size_t, const Gene_*, const Weight_*> >& gene_sets,
@@ -200,17 +268,23 @@ void aggregate_across_genes_by_row(
         }
     }
 
-    tatami::parallelize([&](const int t, const Index_ start, const Index_ length) -> void {
+    parallelize_by_cost([&](const int t, const Index_ start, const Index_ length) -> void {
         auto get_sum = [&](Index_ i) -> Sum_* { return buffers.sum[i]; };
-        tatami_stats::LocalOutputBuffers<Sum_, I<decltype(get_sum)>> local_sums(t, num_sets, start, length, std::move(get_sum));
+        StridedOutputBuffers<Sum_, I<decltype(get_sum)>, SumAccumulator<compensated_, Sum_> > local_sums(t, num_sets, start, length, buffers.stride, std::move(get_sum));
+        InstrumentationTimer timer(options.instrumentation, t);
+        timer.add(&ThreadInstrumentation::scratch_bytes, local_sums.scratch_bytes());
 
         if (p.sparse()) {
             auto ext = tatami::new_extractor<true, true>(p, true, sub_oracle, start, length);
             auto vbuffer = tatami::create_container_of_Index_size<std::vector<Data_> >(length);
             auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(length);
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(vbuffer) + vector_bytes(ibuffer));
 
             for (Index_ sub = 0; sub < nsubs; ++sub) {
                 const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                timer.lap(&ThreadInstrumentation::extraction_time);
+                timer.add(&ThreadInstrumentation::rows_fetched, 1);
+                timer.add(&ThreadInstrumentation::nonzeros_processed, range.number);
 
                 for (const auto& sw : remapping[sub]) {
                     const auto outptr = local_sums.data(sw.first);
@@ -219,14 +293,19 @@ void aggregate_across_genes_by_row(
                         outptr[range.index[c] - start] += range.value[c] * wt;
                     }
                 }
+                timer.lap(&ThreadInstrumentation::accumulation_time);
             }
 
         } else {
             auto ext = tatami::new_extractor<false, true>(&p, true, sub_oracle, start, length);
             auto vbuffer = tatami::create_container_of_Index_size<std::vector<Data_> >(length);
+            timer.add(&ThreadInstrumentation::scratch_bytes, vector_bytes(vbuffer));
 
             for (Index_ sub = 0; sub < nsubs; ++sub) {
                 const auto ptr = ext->fetch(vbuffer.data());
+                timer.lap(&ThreadInstrumentation::extraction_time);
+                timer.add(&ThreadInstrumentation::rows_fetched, 1);
+                timer.add(&ThreadInstrumentation::nonzeros_processed, length);
                 for (const auto& sw : remapping[sub]) {
                     const auto outptr = local_sums.data(sw.first);
                     const auto wt = sw.second;
@@ -234,49 +313,181 @@ void aggregate_across_genes_by_row(
                         outptr[cell] += ptr[cell] * wt;
                     }
                 }
+                timer.lap(&ThreadInstrumentation::accumulation_time);
             }
         }
 
         local_sums.transfer();
-    }, p.ncol(), options.num_threads);
+        timer.lap(&ThreadInstrumentation::reduction_time);
+    }, p.ncol(), options.cell_costs, options.num_threads);
+}
+
+// The estimates below mirror the allocations in each kernel, assuming that the
+// cells are split evenly across threads and that all threads use local buffers.
+// 'num_unique' is the number of unique genes across all sets, while 'total_size'
+// is the sum of the set sizes.
+template<typename Sum_, typename Data_, typename Index_, typename Weight_>
+std::size_t estimate_genes_row_memory(
+    const std::size_t num_cells,
+    const bool sparse,
+    const std::size_t num_sets,
+    const std::size_t num_unique,
+    const std::size_t total_size,
+    const bool compensated,
+    const int num_threads
+) {
+    const std::size_t shared = num_unique * (sizeof(Index_) + sizeof(std::vector<std::pair<std::size_t, Weight_> >)) + total_size * sizeof(std::pair<std::size_t, Weight_>);
+    const auto nthreads = std::min(num_cells, static_cast<std::size_t>(std::max(1, num_threads)));
+    const auto length = (nthreads ? num_cells / nthreads + (num_cells % nthreads > 0) : 0);
+    const std::size_t sum_bytes = (compensated ? sizeof(SumAccumulator<true, Sum_>) : sizeof(Sum_));
+    std::size_t per_thread = length * (num_sets * sum_bytes + sizeof(Data_));
+    if (sparse) {
+        per_thread += length * sizeof(Index_);
+    }
+    return shared + per_thread * nthreads;
+}
+
+template<typename Sum_, typename Data_, typename Index_, typename Weight_>
+std::size_t estimate_genes_column_memory(
+    const std::size_t num_cells,
+    const std::size_t num_sets,
+    const std::size_t num_unique,
+    const std::size_t total_size,
+    const int num_threads
+) {
+    const std::size_t shared = num_unique * sizeof(Index_) + total_size * sizeof(Index_) + num_sets * sizeof(std::pair<std::vector<Index_>, const Weight_*>);
+    const auto nthreads = std::min(num_cells, static_cast<std::size_t>(std::max(1, num_threads)));
+    return shared + num_unique * sizeof(Data_) * nthreads;
 }
 /**
  * @endcond
  */
 
 /**
- * Aggregate expression values across gene sets for each cell.
- * This involves computing the sum/mean of expression values for any number of gene sets.
- * The aim is to quantify the activity of signatures, pathways or regulons in each cell.
- * Each gene in each set can also be weighted based on any _a priori_ assumptions of their importance to the corresponding pathway.
+ * @brief Predicted memory usage of each execution path of `aggregate_across_genes()`.
+ *
+ * All values are in bytes and refer to the scratch space allocated across all threads.
+ * This does not include the output buffers, the input matrix or its extractors.
+ */
+struct AggregateAcrossGenesMemoryEstimate {
+    /**
+     * Memory usage when rows are extracted from the matrix, where each thread holds the partial sums for its range of cells.
+     * This is the default path for row-major matrices.
+     */
+    std::size_t by_row = 0;
+
+    /**
+     * Memory usage when columns are extracted from the matrix.
+     * This is the default path for column-major matrices.
+     */
+    std::size_t by_column = 0;
+};
+
+/**
+ * Predict the peak memory usage of the scratch space for each execution path of `aggregate_across_genes()`.
+ * The prediction assumes that the cells are split evenly across threads and that the gene sets do not overlap.
+ * It is an upper bound as all threads are assumed to use their own buffers.
  *
- * @tparam Data_ Type of data in the input matrix, should be numeric.
- * @tparam Index_ Integer type of index in the input matrix.
- * @tparam Gene_ Integer type of the indices of genes in each set.
- * @tparam Weight_ Floating-point type of the weights of genes in each set.
  * @tparam Sum_ Floating-point type of the sum.
+ * @tparam Data_ Type of data in the input matrix.
+ * @tparam Weight_ Floating-point type of the weights of genes in each set.
+ * @tparam Index_ Integer type of index in the input matrix.
  *
- * @param input Matrix of expression values where rows are features and columns are cells.
- * This is usually normalized and possibly log-transformed, but the exact nature of the values depends on the application.
- * @param gene_sets Vector of gene sets.
- * Each tuple corresponds to a set and contains (i) the number of genes in the set,
- * (ii) a pointer to the row indices of the genes in the set, and
- * (iii) a pointer to the weights of the genes in the set.
- * The weight pointer may be `NULL`, in which case all weights are set to 1.
- * @param[out] buffers Collection of buffers in which to store the sum/mean for each gene set and cell.
+ * @param num_genes Number of genes, i.e., rows of the input matrix.
+ * @param num_cells Number of cells, i.e., columns of the input matrix.
+ * @param sparse Whether the input matrix is sparse.
+ * @param set_sizes Number of genes in each set.
  * @param options Further options.
+ *
+ * @return Predicted memory usage for each execution path.
+ */
+template<typename Sum_ = double, typename Data_ = double, typename Weight_ = double, typename Index_>
+AggregateAcrossGenesMemoryEstimate estimate_aggregate_across_genes_memory(
+    const Index_ num_genes,
+    const Index_ num_cells,
+    const bool sparse,
+    const std::vector<std::size_t>& set_sizes,
+    const AggregateAcrossGenesOptions& options
+) {
+    const auto total_size = std::accumulate(set_sizes.begin(), set_sizes.end(), static_cast<std::size_t>(0));
+    const auto num_unique = std::min(total_size, static_cast<std::size_t>(num_genes));
+    AggregateAcrossGenesMemoryEstimate output;
+    const bool compensated = std::is_floating_point<Sum_>::value && options.compensated_sums;
+    output.by_row = estimate_genes_row_memory<Sum_, Data_, Index_, Weight_>(num_cells, sparse, set_sizes.size(), num_unique, total_size, compensated, options.num_threads);
+    output.by_column = estimate_genes_column_memory<Sum_, Data_, Index_, Weight_>(num_cells, set_sizes.size(), num_unique, total_size, options.num_threads);
+    return output;
+}
+
+/**
+ * @cond
  */
+// Trying the default path with decreasing numbers of threads, followed by the
+// other path. 'options' is modified in place with the chosen number of threads.
+// Returns whether the rows should be extracted.
+template<typename Sum_, typename Data_, typename Index_, typename Gene_, typename Weight_>
+bool fit_genes_memory_budget(
+    const tatami::Matrix<Data_, Index_>& input,
+    const std::vector<std::tuple<std::size_t, const Gene_*, const Weight_*> >& gene_sets,
+    AggregateAcrossGenesOptions& options
+) {
+    std::vector<std::size_t> set_sizes;
+    set_sizes.reserve(gene_sets.size());
+    for (const auto& set : gene_sets) {
+        set_sizes.push_back(std::get<0>(set));
+    }
+
+    const int max_threads = std::max(1, options.num_threads);
+    const bool prefer_rows = input.prefer_rows();
+    bool best_row = prefer_rows;
+    int best_threads = 1;
+    std::size_t best_usage = std::numeric_limits<std::size_t>::max();
+
+    for (const bool row : { prefer_rows, !prefer_rows }) {
+        for (int t = max_threads; t > 0; --t) {
+            options.num_threads = t;
+            const auto estimate = estimate_aggregate_across_genes_memory<Sum_, Data_, Weight_>(input.nrow(), input.ncol(), input.sparse(), set_sizes, options);
+            const auto usage = (row ? estimate.by_row : estimate.by_column);
+            if (usage <= options.memory_budget) {
+                return row;
+            }
+            if (usage < best_usage) {
+                best_usage = usage;
+                best_row = row;
+                best_threads = t;
+            }
+        }
+    }
+
+    options.num_threads = best_threads;
+    return best_row;
+}
+
 template<typename Data_, typename Index_, typename Gene_, typename Weight_, typename Sum_>
-void aggregate_across_genes(
+void aggregate_across_genes_dispatch(
     const tatami::Matrix<Data_, Index_>& input,
     const std::vector<std::tuple<std::size_t, const Gene_*, const Weight_*> >& gene_sets,
     const AggregateAcrossGenesBuffers<Sum_>& buffers,
-    const AggregateAcrossGenesOptions& options)
+    const AggregateAcrossGenesOptions& options,
+    const bool row)
 {
-    if (input.prefer_rows()) {
-        aggregate_across_genes_by_row(input, gene_sets, buffers, options);
+    prepare_instrumentation(options.instrumentation, options.num_threads);
+    bool compensated = false;
+    if constexpr(std::is_floating_point<Sum_>::value) {
+        compensated = options.compensated_sums;
+    }
+
+    if (compensated) {
+        if (row) {
+            aggregate_across_genes_by_row<true>(input, gene_sets, buffers, options);
+        } else {
+            aggregate_across_genes_by_column<true>(input, gene_sets, buffers, options);
+        }
     } else {
-        aggregate_across_genes_by_column(input, gene_sets, buffers, options);
+        if (row) {
+            aggregate_across_genes_by_row<false>(input, gene_sets, buffers, options);
+        } else {
+            aggregate_across_genes_by_column<false>(input, gene_sets, buffers, options);
+        }
     }
 
     if (options.average) {
@@ -297,11 +508,52 @@ void aggregate_across_genes(
 
                 const auto current = buffers.sum[s];
                 for (Index_ c = 0; c < NC; ++c) {
-                    current[c] /= denom;
+                    current[static_cast<std::size_t>(c) * buffers.stride] /= denom;
                 }
             }
         }, nsets, options.num_threads);
     }
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Aggregate expression values across gene sets for each cell.
+ * This involves computing the sum/mean of expression values for any number of gene sets.
+ * The aim is to quantify the activity of signatures, pathways or regulons in each cell.
+ * Each gene in each set can also be weighted based on any _a priori_ assumptions of their importance to the corresponding pathway.
+ *
+ * @tparam Data_ Type of data in the input matrix, should be numeric.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Gene_ Integer type of the indices of genes in each set.
+ * @tparam Weight_ Floating-point type of the weights of genes in each set.
+ * @tparam Sum_ Floating-point type of the sum.
+ *
+ * @param input Matrix of expression values where rows are features and columns are cells.
+ * This is usually normalized and possibly log-transformed, but the exact nature of the values depends on the application.
+ * @param gene_sets Vector of gene sets.
+ * Each tuple corresponds to a set and contains (i) the number of genes in the set,
+ * (ii) a pointer to the row indices of the genes in the set, and
+ * (iii) a pointer to the weights of the genes in the set.
+ * The weight pointer may be `NULL`, in which case all weights are set to 1.
+ * @param[out] buffers Collection of buffers in which to store the sum/mean for each gene set and cell.
+ * @param options Further options.
+ */
+template<typename Data_, typename Index_, typename Gene_, typename Weight_, typename Sum_>
+void aggregate_across_genes(
+    const tatami::Matrix<Data_, Index_>& input,
+    const std::vector<std::tuple<std::size_t, const Gene_*, const Weight_*> >& gene_sets,
+    const AggregateAcrossGenesBuffers<Sum_>& buffers,
+    const AggregateAcrossGenesOptions& options)
+{
+    if (options.memory_budget == std::numeric_limits<std::size_t>::max()) {
+        aggregate_across_genes_dispatch(input, gene_sets, buffers, options, input.prefer_rows());
+    } else {
+        auto budget_options = options;
+        const bool row = fit_genes_memory_budget<Sum_>(input, gene_sets, budget_options);
+        aggregate_across_genes_dispatch(input, gene_sets, buffers, budget_options, row);
+    }
 } 
 
 /**
@@ -352,6 +604,44 @@ AggregateAcrossGenesResults<Sum_> aggregate_across_genes(
     return output;
 } 
 
+
+/**
+ * Overload of `aggregate_across_genes()` that stores the results in a single contiguous matrix.
+ * This avoids a separate allocation for each gene set, and the results can be used directly as a matrix by other frameworks or via `contiguous_matrix_to_tatami()`.
+ *
+ * @tparam Sum_ Floating-point type of the sum.
+ * @tparam Data_ Type of data in the input matrix, should be numeric.
+ * @tparam Index_ Integer type of index in the input matrix.
+ * @tparam Gene_ Integer type of the indices of genes in each set.
+ * @tparam Weight_ Floating-point type of the weights of genes in each set.
+ *
+ * @param input Matrix of expression values where rows are features and columns are cells.
+ * @param gene_sets Vector of gene sets, see `aggregate_across_genes()` for details.
+ * @param set_major Whether to store the matrix in set-major (i.e., row-major) order, where the values for all cells are contiguous for each gene set.
+ * If false, the matrix is stored in cell-major (i.e., column-major) order, where the values for all gene sets are contiguous for each cell.
+ * @param options Further options.
+ *
+ * @return Results of the aggregation.
+ */
+template<typename Sum_ = double, typename Data_, typename Index_, typename Gene_, typename Weight_>
+AggregateAcrossGenesContiguousResults<Sum_> aggregate_across_genes_contiguous(
+    const tatami::Matrix<Data_, Index_>& input,
+    const std::vector<std::tuple<std::size_t, const Gene_*, const Weight_*> >& gene_sets,
+    const bool set_major,
+    const AggregateAcrossGenesOptions& options)
+{
+    AggregateAcrossGenesContiguousResults<Sum_> output;
+    allocate_contiguous_matrix(output.sum, gene_sets.size(), input.ncol(), set_major);
+
+    AggregateAcrossGenesBuffers<Sum_> buffers;
+    auto pointers = contiguous_row_pointers(output.sum);
+    buffers.sum.swap(pointers.first);
+    buffers.stride = pointers.second;
+
+    aggregate_across_genes(input, gene_sets, buffers, options);
+    return output;
+}
+
 }
 
 #endif
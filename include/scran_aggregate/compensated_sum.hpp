@@ -0,0 +1,68 @@
+#ifndef SCRAN_AGGREGATE_COMPENSATED_SUM_HPP
+#define SCRAN_AGGREGATE_COMPENSATED_SUM_HPP
+
+#include <cmath>
+#include <type_traits>
+
+/**
+ * @file compensated_sum.hpp
+ * @brief Compensated summation of floating-point values.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @cond
+ */
+// Neumaier's variant of Kahan summation, which also handles the case where the
+// added value is larger in magnitude than the running sum. The error of the
+// result does not grow with the number of values, unlike naive summation.
+// Note that this relies on strict IEEE semantics, so it will not work with
+// options like -ffast-math that allow the compiler to reassociate additions.
+template<typename Float_>
+class CompensatedSum {
+public:
+    CompensatedSum(const Float_ value = 0) : my_sum(value) {}
+
+    CompensatedSum& operator+=(const Float_ value) {
+        const Float_ total = my_sum + value;
+        if (std::abs(my_sum) >= std::abs(value)) {
+            my_compensation += (my_sum - total) + value;
+        } else {
+            my_compensation += (value - total) + my_sum;
+        }
+        my_sum = total;
+        return *this;
+    }
+
+    Float_ get() const {
+        return my_sum + my_compensation;
+    }
+
+    template<typename Output_>
+    explicit operator Output_() const {
+        return get();
+    }
+
+private:
+    Float_ my_sum;
+    Float_ my_compensation = 0;
+};
+
+// Compensated sums are held in at least double precision, so that only the
+// final result is narrowed to 'Sum_'.
+template<typename Sum_>
+using CompensatedValue = typename std::common_type<Sum_, double>::type;
+
+template<bool compensated_, typename Sum_>
+using SumValue = typename std::conditional<compensated_, CompensatedValue<Sum_>, Sum_>::type;
+
+template<bool compensated_, typename Sum_>
+using SumAccumulator = typename std::conditional<compensated_, CompensatedSum<CompensatedValue<Sum_> >, Sum_>::type;
+/**
+ * @endcond
+ */
+
+}
+
+#endif
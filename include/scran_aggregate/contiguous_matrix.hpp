@@ -0,0 +1,190 @@
+#ifndef SCRAN_AGGREGATE_CONTIGUOUS_MATRIX_HPP
+#define SCRAN_AGGREGATE_CONTIGUOUS_MATRIX_HPP
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+
+#include "tatami/tatami.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "utils.hpp"
+
+/**
+ * @file contiguous_matrix.hpp
+ * @brief Aggregated statistics in a single contiguous allocation.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @brief Matrix of aggregated statistics in a single contiguous allocation.
+ *
+ * This avoids a separate allocation for each group and can be passed directly to other frameworks, e.g., as a NumPy array or R matrix.
+ * It can also be converted to a `tatami::Matrix` without any copies via `contiguous_matrix_to_tatami()`.
+ *
+ * @tparam Value_ Type of the statistic.
+ */
+template<typename Value_>
+struct ContiguousMatrix {
+    /**
+     * Number of rows.
+     */
+    std::size_t num_rows = 0;
+
+    /**
+     * Number of columns.
+     */
+    std::size_t num_columns = 0;
+
+    /**
+     * Whether `values` is stored in row-major order.
+     * If false, it is stored in column-major order.
+     */
+    bool row_major = false;
+
+    /**
+     * Vector of length equal to the product of `num_rows` and `num_columns`, containing the values of the matrix.
+     */
+    std::vector<Value_> values;
+};
+
+/**
+ * Convert a `ContiguousMatrix` into a `tatami::DenseMatrix` without copying its values.
+ *
+ * @tparam Index_ Integer type of the row/column indices of the `tatami::Matrix`.
+ * @tparam Value_ Type of the statistic.
+ *
+ * @param matrix Matrix of statistics, typically produced by `aggregate_across_cells_contiguous()` or `aggregate_across_genes_contiguous()`.
+ * This is moved into the output object.
+ *
+ * @return Pointer to a `tatami::DenseMatrix` that holds the values of `matrix`.
+ */
+template<typename Index_ = int, typename Value_>
+std::shared_ptr<tatami::Matrix<Value_, Index_> > contiguous_matrix_to_tatami(ContiguousMatrix<Value_> matrix) {
+    const auto nrow = sanisizer::cast<Index_>(matrix.num_rows);
+    const auto ncol = sanisizer::cast<Index_>(matrix.num_columns);
+    return std::make_shared<tatami::DenseMatrix<Value_, Index_, std::vector<Value_> > >(nrow, ncol, std::move(matrix.values), matrix.row_major);
+}
+
+/**
+ * @cond
+ */
+template<typename Value_>
+void allocate_contiguous_matrix(ContiguousMatrix<Value_>& matrix, const std::size_t nrow, const std::size_t ncol, const bool row_major) {
+    matrix.num_rows = nrow;
+    matrix.num_columns = ncol;
+    matrix.row_major = row_major;
+    matrix.values.resize(
+        sanisizer::product<I<decltype(matrix.values.size())> >(nrow, ncol)
+#ifdef SCRAN_AGGREGATE_TEST_INIT
+        , SCRAN_AGGREGATE_TEST_INIT
+#endif
+    );
+}
+
+// Pointers to the start of each column, where consecutive rows are separated by the returned stride.
+template<typename Value_>
+std::pair<std::vector<Value_*>, std::size_t> contiguous_column_pointers(ContiguousMatrix<Value_>& matrix) {
+    auto output = sanisizer::create<std::vector<Value_*> >(matrix.num_columns);
+    for (I<decltype(matrix.num_columns)> c = 0; c < matrix.num_columns; ++c) {
+        output[c] = matrix.values.data() + (matrix.row_major ? c : c * matrix.num_rows);
+    }
+    return std::make_pair(std::move(output), matrix.row_major ? matrix.num_columns : static_cast<std::size_t>(1));
+}
+
+// Pointers to the start of each row, where consecutive columns are separated by the returned stride.
+template<typename Value_>
+std::pair<std::vector<Value_*>, std::size_t> contiguous_row_pointers(ContiguousMatrix<Value_>& matrix) {
+    auto output = sanisizer::create<std::vector<Value_*> >(matrix.num_rows);
+    for (I<decltype(matrix.num_rows)> r = 0; r < matrix.num_rows; ++r) {
+        output[r] = matrix.values.data() + (matrix.row_major ? r * matrix.num_columns : r);
+    }
+    return std::make_pair(std::move(output), matrix.row_major ? static_cast<std::size_t>(1) : matrix.num_rows);
+}
+
+template<typename Output_, typename Index_>
+void fill_strided(Output_* const ptr, const Index_ start, const Index_ length, const std::size_t stride, const Output_ value) {
+    if (stride == 1) {
+        std::fill_n(ptr + start, length, value);
+    } else {
+        for (Index_ i = start, end = start + length; i < end; ++i) {
+            ptr[static_cast<std::size_t>(i) * stride] = value;
+        }
+    }
+}
+
+// Same as tatami_stats::LocalOutputBuffers but the output arrays may be strided.
+// The first thread writes directly to the output if the stride is 1 and the
+// local values are of the same type as the output. Otherwise, the local values
+// (e.g., compensated sums) are converted to 'Output_' upon transfer.
+template<typename Output_, class GetOutput_, typename Local_ = Output_>
+class StridedOutputBuffers {
+public:
+    template<typename Index_>
+    StridedOutputBuffers(const int thread, const std::size_t number, const Index_ start, const Index_ length, const std::size_t stride, GetOutput_ outfun, const Output_ fill = 0) :
+        my_number(number),
+        my_start(start),
+        my_length(length),
+        my_stride(stride),
+        my_use_local(thread > 0 || stride != 1 || !std::is_same<Output_, Local_>::value),
+        my_getter(std::move(outfun))
+    {
+        if (my_use_local) {
+            sanisizer::resize(my_buffers, my_number);
+            for (auto& buffer : my_buffers) {
+                tatami::resize_container_to_Index_size(buffer, length, fill);
+            }
+        } else if constexpr(std::is_same<Output_, Local_>::value) {
+            for (std::size_t i = 0; i < my_number; ++i) {
+                std::fill_n(my_getter(i) + my_start, my_length, fill);
+            }
+        }
+    }
+
+    Local_* data(const std::size_t i) {
+        if constexpr(std::is_same<Output_, Local_>::value) {
+            if (!my_use_local) {
+                return my_getter(i) + my_start;
+            }
+        }
+        return my_buffers[i].data();
+    }
+
+    std::size_t scratch_bytes() const {
+        std::size_t total = 0;
+        for (const auto& buffer : my_buffers) {
+            total += buffer.capacity() * sizeof(Local_);
+        }
+        return total;
+    }
+
+    void transfer() {
+        if (!my_use_local) {
+            return;
+        }
+        for (std::size_t i = 0; i < my_number; ++i) {
+            const auto& current = my_buffers[i];
+            const auto output = my_getter(i);
+            for (std::size_t j = 0; j < my_length; ++j) {
+                output[(my_start + j) * my_stride] = static_cast<Output_>(current[j]);
+            }
+        }
+    }
+
+private:
+    std::size_t my_number;
+    std::size_t my_start, my_length, my_stride;
+    bool my_use_local;
+    GetOutput_ my_getter;
+    std::vector<std::vector<Local_> > my_buffers;
+};
+/**
+ * @endcond
+ */
+
+}
+
+#endif
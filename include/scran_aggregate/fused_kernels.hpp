@@ -0,0 +1,187 @@
+#ifndef SCRAN_AGGREGATE_FUSED_KERNELS_HPP
+#define SCRAN_AGGREGATE_FUSED_KERNELS_HPP
+
+#include <cstdint>
+#include <type_traits>
+
+/**
+ * @file fused_kernels.hpp
+ * @brief Fused kernels for accumulating sums and detected cells.
+ *
+ * On x86-64 with GCC or Clang, vectorized kernels are selected at runtime based on the CPU's support for AVX2 or AVX-512.
+ * This can be disabled by defining the `SCRAN_AGGREGATE_DISABLE_SIMD` macro, in which case only the portable kernel is used.
+ */
+
+#if !defined(SCRAN_AGGREGATE_DISABLE_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCRAN_AGGREGATE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace scran_aggregate {
+
+/**
+ * @cond
+ */
+template<typename Value_, typename Index_, typename Sum_, typename Detected_>
+void add_sums_and_detected_portable(const Value_* const values, const Index_ n, Sum_* const sums, Detected_* const detected) {
+    for (Index_ i = 0; i < n; ++i) {
+        const auto val = values[i];
+        sums[i] += val;
+        detected[i] += (val > 0);
+    }
+}
+
+#ifdef SCRAN_AGGREGATE_X86_SIMD
+enum class SimdLevel : char { NONE, AVX2, AVX512 };
+
+inline SimdLevel detect_simd_level() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::NONE;
+}
+
+inline SimdLevel simd_level() {
+    static const SimdLevel level = detect_simd_level();
+    return level;
+}
+
+// All kernels return the number of processed elements, leaving the remainder to the portable kernel.
+// Comparisons use ordered predicates so that NaNs are not considered to be detected, consistent with 'val > 0'.
+template<typename Index_>
+__attribute__((target("avx2"))) Index_ add_sums_and_detected_avx2(const double* const values, const Index_ n, double* const sums, std::int32_t* const detected) {
+    const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1);
+    Index_ i = 0;
+    for (; n - i >= 4; i += 4) {
+        const __m256d val = _mm256_loadu_pd(values + i);
+        _mm256_storeu_pd(sums + i, _mm256_add_pd(_mm256_loadu_pd(sums + i), val));
+        const __m128i hits = _mm256_cvtpd_epi32(_mm256_and_pd(_mm256_cmp_pd(val, zero, _CMP_GT_OQ), one));
+        const auto dptr = reinterpret_cast<__m128i*>(detected + i);
+        _mm_storeu_si128(dptr, _mm_add_epi32(_mm_loadu_si128(dptr), hits));
+    }
+    return i;
+}
+
+template<typename Index_>
+__attribute__((target("avx2"))) Index_ add_sums_and_detected_avx2(const float* const values, const Index_ n, float* const sums, std::int32_t* const detected) {
+    const __m256 zero = _mm256_setzero_ps();
+    Index_ i = 0;
+    for (; n - i >= 8; i += 8) {
+        const __m256 val = _mm256_loadu_ps(values + i);
+        _mm256_storeu_ps(sums + i, _mm256_add_ps(_mm256_loadu_ps(sums + i), val));
+        const __m256i mask = _mm256_castps_si256(_mm256_cmp_ps(val, zero, _CMP_GT_OQ)); // all bits set is -1.
+        const auto dptr = reinterpret_cast<__m256i*>(detected + i);
+        _mm256_storeu_si256(dptr, _mm256_sub_epi32(_mm256_loadu_si256(dptr), mask));
+    }
+    return i;
+}
+
+template<typename Index_>
+__attribute__((target("avx2"))) Index_ add_sums_and_detected_avx2(const float* const values, const Index_ n, double* const sums, std::int32_t* const detected) {
+    const __m128 zero = _mm_setzero_ps();
+    Index_ i = 0;
+    for (; n - i >= 4; i += 4) {
+        const __m128 val = _mm_loadu_ps(values + i);
+        _mm256_storeu_pd(sums + i, _mm256_add_pd(_mm256_loadu_pd(sums + i), _mm256_cvtps_pd(val)));
+        const __m128i mask = _mm_castps_si128(_mm_cmpgt_ps(val, zero));
+        const auto dptr = reinterpret_cast<__m128i*>(detected + i);
+        _mm_storeu_si128(dptr, _mm_sub_epi32(_mm_loadu_si128(dptr), mask));
+    }
+    return i;
+}
+
+// Some versions of GCC's AVX-512 intrinsics trigger spurious warnings about uninitialized variables.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+
+template<typename Index_>
+__attribute__((target("avx512f"))) Index_ add_sums_and_detected_avx512(const double* const values, const Index_ n, double* const sums, std::int32_t* const detected) {
+    const __m512d zero = _mm512_setzero_pd();
+    Index_ i = 0;
+    for (; n - i >= 8; i += 8) {
+        const __m512d val = _mm512_loadu_pd(values + i);
+        _mm512_storeu_pd(sums + i, _mm512_add_pd(_mm512_loadu_pd(sums + i), val));
+        const __m256i hits = _mm512_castsi512_si256(_mm512_maskz_set1_epi32(_mm512_cmp_pd_mask(val, zero, _CMP_GT_OQ), 1));
+        const auto dptr = reinterpret_cast<__m256i*>(detected + i);
+        _mm256_storeu_si256(dptr, _mm256_add_epi32(_mm256_loadu_si256(dptr), hits));
+    }
+    return i;
+}
+
+template<typename Index_>
+__attribute__((target("avx512f"))) Index_ add_sums_and_detected_avx512(const float* const values, const Index_ n, float* const sums, std::int32_t* const detected) {
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512i one = _mm512_set1_epi32(1);
+    Index_ i = 0;
+    for (; n - i >= 16; i += 16) {
+        const __m512 val = _mm512_loadu_ps(values + i);
+        _mm512_storeu_ps(sums + i, _mm512_add_ps(_mm512_loadu_ps(sums + i), val));
+        const __m512i current = _mm512_loadu_si512(detected + i);
+        _mm512_storeu_si512(detected + i, _mm512_mask_add_epi32(current, _mm512_cmp_ps_mask(val, zero, _CMP_GT_OQ), current, one));
+    }
+    return i;
+}
+
+template<typename Index_>
+__attribute__((target("avx512f"))) Index_ add_sums_and_detected_avx512(const float* const values, const Index_ n, double* const sums, std::int32_t* const detected) {
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512i one = _mm512_set1_epi32(1);
+    Index_ i = 0;
+    for (; n - i >= 16; i += 16) {
+        const __m512 val = _mm512_loadu_ps(values + i);
+        const __m256 lower = _mm256_loadu_ps(values + i), upper = _mm256_loadu_ps(values + i + 8);
+        _mm512_storeu_pd(sums + i, _mm512_add_pd(_mm512_loadu_pd(sums + i), _mm512_cvtps_pd(lower)));
+        _mm512_storeu_pd(sums + i + 8, _mm512_add_pd(_mm512_loadu_pd(sums + i + 8), _mm512_cvtps_pd(upper)));
+        const __m512i current = _mm512_loadu_si512(detected + i);
+        _mm512_storeu_si512(detected + i, _mm512_mask_add_epi32(current, _mm512_cmp_ps_mask(val, zero, _CMP_GT_OQ), current, one));
+    }
+    return i;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+// Adds each value to the corresponding sum and increments the corresponding detected count if the value is positive.
+// This uses a single pass over 'values' and dispatches to vectorized kernels for common type combinations.
+template<typename Value_, typename Index_, typename Sum_, typename Detected_>
+void add_sums_and_detected(const Value_* const values, const Index_ n, Sum_* const sums, Detected_* const detected) {
+    Index_ done = 0;
+
+#ifdef SCRAN_AGGREGATE_X86_SIMD
+    constexpr bool supported =
+        std::is_same<Detected_, std::int32_t>::value && (
+            (std::is_same<Value_, double>::value && std::is_same<Sum_, double>::value) ||
+            (std::is_same<Value_, float>::value && (std::is_same<Sum_, float>::value || std::is_same<Sum_, double>::value))
+        );
+    if constexpr(supported) {
+        switch (simd_level()) {
+            case SimdLevel::AVX512:
+                done = add_sums_and_detected_avx512(values, n, sums, detected);
+                break;
+            case SimdLevel::AVX2:
+                done = add_sums_and_detected_avx2(values, n, sums, detected);
+                break;
+            default:
+                break;
+        }
+    }
+#endif
+
+    add_sums_and_detected_portable(values + done, static_cast<Index_>(n - done), sums + done, detected + done);
+}
+/**
+ * @endcond
+ */
+
+}
+
+#endif
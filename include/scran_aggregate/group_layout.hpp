@@ -0,0 +1,174 @@
+#ifndef SCRAN_AGGREGATE_GROUP_LAYOUT_HPP
+#define SCRAN_AGGREGATE_GROUP_LAYOUT_HPP
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "utils.hpp"
+
+/**
+ * @file group_layout.hpp
+ * @brief Group-sorted layout of cells for segmented computations.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @cond
+ */
+template<typename Index_>
+struct GroupLayout {
+    // Number of cells in each group.
+    std::vector<Index_> sizes;
+
+    // Start of each group's segment in the group-sorted order, of length equal to the number of groups plus 1.
+    std::vector<std::size_t> offsets;
+
+    // Indices of the cells in group-sorted order. Cells in the same group are ordered by increasing index.
+    std::vector<Index_> permutation;
+
+    // Whether the cells are already in group-sorted order, i.e., 'permutation' is the identity.
+    bool sorted = true;
+};
+
+// Cells with negative group assignments are ignored.
+template<typename Group_>
+bool is_ignored_group(const Group_ g) {
+    if constexpr(std::is_signed<Group_>::value) {
+        return g < 0;
+    } else {
+        return false;
+    }
+}
+
+template<typename Index_, typename Group_>
+GroupLayout<Index_> create_group_layout(const Group_* const group, const Index_ n, const std::size_t ngroups) {
+    GroupLayout<Index_> layout;
+    sanisizer::resize(layout.sizes, ngroups);
+    for (Index_ c = 0; c < n; ++c) {
+        if (is_ignored_group(group[c])) {
+            layout.sorted = false; // ignored cells are not in the permutation, so it can't be the identity.
+            continue;
+        }
+        ++(layout.sizes[group[c]]);
+        if (c && group[c] < group[c - 1]) {
+            layout.sorted = false;
+        }
+    }
+
+    sanisizer::resize(layout.offsets, sanisizer::sum<std::size_t>(ngroups, 1));
+    for (std::size_t g = 0; g < ngroups; ++g) {
+        layout.offsets[g + 1] = layout.offsets[g] + layout.sizes[g];
+    }
+
+    tatami::resize_container_to_Index_size(layout.permutation, layout.offsets[ngroups]);
+    auto running = layout.offsets;
+    for (Index_ c = 0; c < n; ++c) {
+        if (!is_ignored_group(group[c])) {
+            layout.permutation[running[group[c]]++] = c;
+        }
+    }
+
+    return layout;
+}
+
+// Reductions over a contiguous segment of group-sorted values. For sums, we
+// use several independent accumulators to break the loop-carried dependency,
+// which allows the compiler to vectorize the loop; this means that the result
+// may differ from a serial summation by floating-point round-off.
+template<typename Sum_, typename Value_, typename Index_>
+Sum_ segment_sum(const Value_* const ptr, const Index_ n) {
+    Sum_ acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    Index_ k = 0;
+    for (; n - k >= 4; k += 4) {
+        acc0 += ptr[k];
+        acc1 += ptr[k + 1];
+        acc2 += ptr[k + 2];
+        acc3 += ptr[k + 3];
+    }
+    for (; k < n; ++k) {
+        acc0 += ptr[k];
+    }
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+template<typename Detected_, typename Value_, typename Index_>
+Detected_ segment_detected(const Value_* const ptr, const Index_ n) {
+    Detected_ count = 0;
+    for (Index_ k = 0; k < n; ++k) {
+        count += (ptr[k] > 0);
+    }
+    return count;
+}
+
+// Integer data can be stored as-is for the counting median, otherwise we
+// convert to the floating-point type as in tatami_stats::medians::direct.
+template<typename Data_, typename Float_>
+using MedianValue = typename std::conditional<std::is_integral<Data_>::value, Data_, Float_>::type;
+
+template<typename Value_, typename Index_>
+class SegmentMedians {
+private:
+    std::vector<Index_> my_histogram;
+
+public:
+    template<typename Float_>
+    Float_ compute(Value_* const ptr, const Index_ n) {
+        if constexpr(std::is_integral<Value_>::value) {
+            if (n) {
+                // For small integers (e.g., counts), a histogram is O(n) and avoids comparisons during selection.
+                const auto range = std::minmax_element(ptr, ptr + n);
+                const Value_ lower = *(range.first);
+                const auto span = static_cast<unsigned long long>(*(range.second)) - static_cast<unsigned long long>(lower);
+                if (span <= std::max(static_cast<unsigned long long>(n), static_cast<unsigned long long>(256))) {
+                    return counting_median<Float_>(ptr, n, lower, span + 1);
+                }
+            }
+        }
+        return tatami_stats::medians::direct<Float_>(ptr, n, false);
+    }
+
+private:
+    template<typename Float_>
+    Float_ counting_median(const Value_* const ptr, const Index_ n, const Value_ lower, const unsigned long long nbins) {
+        my_histogram.clear();
+        my_histogram.resize(nbins);
+        for (Index_ i = 0; i < n; ++i) {
+            ++my_histogram[ptr[i] - lower];
+        }
+
+        // Finding the values at ranks floor((n - 1) / 2) and n / 2.
+        const Index_ target_left = (n - 1) / 2, target_right = n / 2;
+        Index_ cumulative = 0;
+        std::size_t b = 0;
+        while (cumulative + my_histogram[b] <= target_left) {
+            cumulative += my_histogram[b];
+            ++b;
+        }
+        const Float_ left = static_cast<Float_>(lower) + static_cast<Float_>(b);
+        if (target_left == target_right) {
+            return left;
+        }
+
+        while (cumulative + my_histogram[b] <= target_right) {
+            cumulative += my_histogram[b];
+            ++b;
+        }
+        const Float_ right = static_cast<Float_>(lower) + static_cast<Float_>(b);
+        return (left + right) / 2;
+    }
+};
+/**
+ * @endcond
+ */
+
+}
+
+#endif
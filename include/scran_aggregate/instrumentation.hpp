@@ -0,0 +1,185 @@
+#ifndef SCRAN_AGGREGATE_INSTRUMENTATION_HPP
+#define SCRAN_AGGREGATE_INSTRUMENTATION_HPP
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+#ifdef SCRAN_AGGREGATE_INSTRUMENTATION
+#include <chrono>
+#endif
+
+/**
+ * @file instrumentation.hpp
+ * @brief Optional instrumentation of the aggregation kernels.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @brief Timings and counters for a single thread.
+ *
+ * All times are reported in seconds of wall time.
+ */
+struct ThreadInstrumentation {
+    /**
+     * Time spent extracting rows or columns from the `tatami::Matrix`.
+     */
+    double extraction_time = 0;
+
+    /**
+     * Time spent accumulating the sums, numbers of detected cells, sums of squares, minima and maxima.
+     */
+    double accumulation_time = 0;
+
+    /**
+     * Time spent computing the medians and quantiles from the gathered values.
+     */
+    double median_time = 0;
+
+    /**
+     * Time spent reducing thread-local partial statistics into the output buffers.
+     */
+    double reduction_time = 0;
+
+    /**
+     * Number of rows extracted from the matrix.
+     */
+    std::size_t rows_fetched = 0;
+
+    /**
+     * Number of columns extracted from the matrix.
+     */
+    std::size_t columns_fetched = 0;
+
+    /**
+     * Number of values processed after extraction.
+     * For sparse matrices, this only counts the structural non-zeros.
+     */
+    std::size_t nonzeros_processed = 0;
+
+    /**
+     * Number of bytes allocated for thread-local scratch space, e.g., extraction buffers and partial statistics.
+     */
+    std::size_t scratch_bytes = 0;
+};
+
+/**
+ * @brief Instrumentation of a call to `aggregate_across_cells()` or `aggregate_across_genes()`.
+ *
+ * An instance of this class can be supplied in `AggregateAcrossCellsOptions::instrumentation` or `AggregateAcrossGenesOptions::instrumentation`.
+ * It will only be filled if the `SCRAN_AGGREGATE_INSTRUMENTATION` macro is defined before including any **scran_aggregate** header.
+ * Otherwise, all instrumentation is compiled out so that there is no overhead in the default build.
+ * The macro should be defined consistently in all translation units of the same program.
+ */
+struct Instrumentation {
+    /**
+     * Timings and counters for each thread.
+     * This is cleared at the start of each call and resized to the number of threads.
+     */
+    std::vector<ThreadInstrumentation> threads;
+
+    /**
+     * @return Timings and counters summed across all threads.
+     */
+    ThreadInstrumentation total() const {
+        ThreadInstrumentation output;
+        for (const auto& current : threads) {
+            output.extraction_time += current.extraction_time;
+            output.accumulation_time += current.accumulation_time;
+            output.median_time += current.median_time;
+            output.reduction_time += current.reduction_time;
+            output.rows_fetched += current.rows_fetched;
+            output.columns_fetched += current.columns_fetched;
+            output.nonzeros_processed += current.nonzeros_processed;
+            output.scratch_bytes += current.scratch_bytes;
+        }
+        return output;
+    }
+};
+
+/**
+ * @cond
+ */
+template<class Vector_>
+std::size_t vector_bytes(const Vector_& vec) {
+    return vec.capacity() * sizeof(typename Vector_::value_type);
+}
+
+#ifdef SCRAN_AGGREGATE_INSTRUMENTATION
+inline void prepare_instrumentation(Instrumentation* const instrumentation, const int num_threads) {
+    if (instrumentation) {
+        instrumentation->threads.clear();
+        instrumentation->threads.resize(std::max(1, num_threads));
+    }
+}
+
+inline void merge_instrumentation(Instrumentation* const instrumentation, const int thread, const Instrumentation& other) {
+    if (instrumentation) {
+        auto& current = instrumentation->threads[thread];
+        const auto more = other.total();
+        current.extraction_time += more.extraction_time;
+        current.accumulation_time += more.accumulation_time;
+        current.median_time += more.median_time;
+        current.reduction_time += more.reduction_time;
+        current.rows_fetched += more.rows_fetched;
+        current.columns_fetched += more.columns_fetched;
+        current.nonzeros_processed += more.nonzeros_processed;
+        current.scratch_bytes += more.scratch_bytes;
+    }
+}
+
+// Each phase is timed from the end of the previous phase, so only one clock
+// query is required at each phase boundary.
+class InstrumentationTimer {
+public:
+    InstrumentationTimer(Instrumentation* const instrumentation, const int thread) :
+        my_record(instrumentation ? &(instrumentation->threads[thread]) : NULL)
+    {
+        restart();
+    }
+
+    void restart() {
+        if (my_record) {
+            my_last = std::chrono::steady_clock::now();
+        }
+    }
+
+    void lap(double ThreadInstrumentation::* phase) {
+        if (my_record) {
+            const auto now = std::chrono::steady_clock::now();
+            my_record->*phase += std::chrono::duration<double>(now - my_last).count();
+            my_last = now;
+        }
+    }
+
+    void add(std::size_t ThreadInstrumentation::* counter, const std::size_t value) {
+        if (my_record) {
+            my_record->*counter += value;
+        }
+    }
+
+private:
+    ThreadInstrumentation* my_record;
+    std::chrono::steady_clock::time_point my_last;
+};
+#else
+inline void prepare_instrumentation(Instrumentation* const, const int) {}
+
+inline void merge_instrumentation(Instrumentation* const, const int, const Instrumentation&) {}
+
+class InstrumentationTimer {
+public:
+    InstrumentationTimer(Instrumentation* const, const int) {}
+    void restart() {}
+    void lap(double ThreadInstrumentation::*) {}
+    void add(std::size_t ThreadInstrumentation::*, const std::size_t) {}
+};
+#endif
+/**
+ * @endcond
+ */
+
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef SCRAN_AGGREGATE_PARALLELIZE_BY_COST_HPP
+#define SCRAN_AGGREGATE_PARALLELIZE_BY_COST_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+/**
+ * @file parallelize_by_cost.hpp
+ * @brief Cost-aware partitioning of jobs across threads.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @cond
+ */
+// Split [0, n) into contiguous ranges of roughly equal cost for each thread.
+// 'cumulative' should have length n + 1 where the cost of job i is
+// 'cumulative[i + 1] - cumulative[i]', e.g., the pointers of a compressed
+// sparse matrix. Returns the boundaries of the ranges, of length equal to the
+// number of ranges plus 1.
+template<typename Index_>
+std::vector<Index_> partition_by_cost(const std::size_t* const cumulative, const Index_ n, const int num_threads) {
+    const auto nranges = std::max(1, num_threads);
+    auto boundaries = sanisizer::create<std::vector<Index_> >(sanisizer::sum<std::size_t>(nranges, 1));
+    boundaries[nranges] = n;
+
+    const auto first = cumulative[0];
+    const double total = cumulative[n] - first;
+    const auto last = cumulative + n + 1;
+    for (int t = 1; t < nranges; ++t) {
+        const std::size_t target = first + static_cast<std::size_t>(total * t / nranges);
+        const Index_ found = std::lower_bound(cumulative, last, target) - cumulative;
+        boundaries[t] = std::max(boundaries[t - 1], std::min(found, n));
+    }
+
+    return boundaries;
+}
+
+// Same as tatami::parallelize(), but each thread is assigned a range of jobs
+// with roughly equal total cost instead of a roughly equal number of jobs.
+// This is useful when the costs are skewed, e.g., for sparse matrices where
+// a few genes have many more non-zero values than the others.
+template<typename Index_, class Function_>
+void parallelize_by_cost(Function_ fun, const Index_ n, const std::size_t* const cumulative, const int num_threads) {
+    if (cumulative == NULL || num_threads <= 1) {
+        tatami::parallelize(std::move(fun), n, num_threads);
+        return;
+    }
+
+    const auto boundaries = partition_by_cost(cumulative, n, num_threads);
+    tatami::parallelize([&](const int t, const int start, const int length) -> void {
+        for (int r = start, end = start + length; r < end; ++r) {
+            const auto range_start = boundaries[r];
+            const auto range_end = boundaries[r + 1];
+            if (range_end > range_start) {
+                fun(t, range_start, static_cast<Index_>(range_end - range_start));
+            }
+        }
+    }, num_threads, num_threads);
+}
+/**
+ * @endcond
+ */
+
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef SCRAN_AGGREGATE_QUANTILE_SKETCH_HPP
+#define SCRAN_AGGREGATE_QUANTILE_SKETCH_HPP
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstddef>
+#include <utility>
+
+/**
+ * @file quantile_sketch.hpp
+ * @brief Mergeable sketch for approximate quantiles.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @brief Mergeable sketch for approximate quantiles.
+ *
+ * This implements a deterministic variant of the KLL sketch (Karnin, Lang and Liberty, 2016).
+ * Observations are stored in a hierarchy of compactors where each item at level \f$h\f$ represents \f$2^h\f$ observations.
+ * When a compactor exceeds its capacity, it is sorted and every second item is promoted to the next level.
+ * The capacity of each level decreases geometrically from the top, so the total memory usage is roughly \f$3k\f$ values for a sketch size of \f$k\f$,
+ * regardless of the number of observations.
+ * Quantiles are exact if fewer than \f$k\f$ observations have been added.
+ *
+ * @tparam Value_ Floating-point type of the observations.
+ */
+template<typename Value_>
+class QuantileSketch {
+public:
+    /**
+     * @param size Sketch size \f$k\f$, determining the accuracy and memory usage of the sketch.
+     * Values below 2 are treated as 2.
+     */
+    QuantileSketch(const std::size_t size) : my_size(std::max(size, static_cast<std::size_t>(2))) {
+        my_levels.resize(1);
+    }
+
+    /**
+     * @cond
+     */
+    QuantileSketch() : QuantileSketch(200) {}
+    /**
+     * @endcond
+     */
+
+private:
+    std::size_t my_size;
+    std::vector<std::vector<Value_> > my_levels;
+    std::size_t my_num_levels = 1; // we don't shrink my_levels upon clear() to avoid reallocations later.
+    unsigned long long my_count = 0;
+    bool my_flip = false;
+    std::vector<std::pair<Value_, unsigned long long> > my_weighted;
+
+    std::size_t capacity(const std::size_t level) const {
+        // Capacity is k * (2/3)^depth for a level at the specified depth from the top.
+        double cap = my_size;
+        for (std::size_t depth = my_num_levels - 1 - level; depth > 0; --depth) {
+            cap *= 2.0 / 3.0;
+            if (cap <= 2) {
+                return 2;
+            }
+        }
+        return std::max(static_cast<std::size_t>(std::ceil(cap)), static_cast<std::size_t>(2));
+    }
+
+    void add_level() {
+        if (my_num_levels == my_levels.size()) {
+            my_levels.emplace_back();
+        }
+        ++my_num_levels;
+    }
+
+    void compress() {
+        for (std::size_t h = 0; h < my_num_levels; ++h) {
+            if (my_levels[h].size() < capacity(h)) {
+                continue;
+            }
+
+            if (h + 1 == my_num_levels) {
+                add_level();
+            }
+            auto& current = my_levels[h];
+            auto& next = my_levels[h + 1];
+
+            std::sort(current.begin(), current.end());
+            const std::size_t num = current.size();
+            const std::size_t paired = num - (num % 2);
+
+            // Alternating between the odd and even items to avoid systematic bias.
+            const std::size_t offset = my_flip;
+            my_flip = !my_flip;
+            for (std::size_t i = offset; i < paired; i += 2) {
+                next.push_back(current[i]);
+            }
+
+            // Leftover item stays at the current level.
+            if (paired != num) {
+                current[0] = current[num - 1];
+                current.resize(1);
+            } else {
+                current.clear();
+            }
+        }
+    }
+
+public:
+    /**
+     * Add an observation to the sketch.
+     * @param value Value of the observation.
+     */
+    void add(const Value_ value) {
+        my_levels[0].push_back(value);
+        ++my_count;
+        if (my_levels[0].size() >= capacity(0)) {
+            compress();
+        }
+    }
+
+    /**
+     * Add multiple observations of the same value to the sketch.
+     * These are stored exactly as a single weighted item that is not subject to compaction.
+     * This is intended for a small number of distinct values with many observations, e.g., the implicit zeros of a sparse vector.
+     *
+     * @param value Value of the observations.
+     * @param number Number of observations.
+     */
+    void add(const Value_ value, const unsigned long long number) {
+        if (number == 0) {
+            return;
+        }
+        my_count += number;
+        for (auto& w : my_weighted) {
+            if (w.first == value) {
+                w.second += number;
+                return;
+            }
+        }
+        my_weighted.emplace_back(value, number);
+    }
+
+    /**
+     * Merge another sketch into this one.
+     * The result is a sketch that summarizes the observations of both sketches.
+     *
+     * @param other Another sketch.
+     * This should have the same sketch size as the current sketch.
+     */
+    void merge(const QuantileSketch& other) {
+        while (my_num_levels < other.my_num_levels) {
+            add_level();
+        }
+        for (std::size_t h = 0; h < other.my_num_levels; ++h) {
+            const auto& src = other.my_levels[h];
+            my_levels[h].insert(my_levels[h].end(), src.begin(), src.end());
+        }
+        my_count += other.my_count;
+        for (const auto& ow : other.my_weighted) {
+            bool found = false;
+            for (auto& w : my_weighted) {
+                if (w.first == ow.first) {
+                    w.second += ow.second;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                my_weighted.push_back(ow);
+            }
+        }
+
+        // Multiple rounds may be necessary as the capacities of the lower levels shrink when new levels are added.
+        while (true) {
+            bool okay = true;
+            for (std::size_t h = 0; h < my_num_levels; ++h) {
+                if (my_levels[h].size() >= capacity(h)) {
+                    okay = false;
+                    break;
+                }
+            }
+            if (okay) {
+                break;
+            }
+            compress();
+        }
+    }
+
+    /**
+     * Remove all observations from the sketch.
+     * This retains the allocated memory for efficient re-use of the sketch.
+     */
+    void clear() {
+        for (std::size_t h = 0; h < my_num_levels; ++h) {
+            my_levels[h].clear();
+        }
+        my_num_levels = 1;
+        my_count = 0;
+        my_flip = false;
+        my_weighted.clear();
+    }
+
+    /**
+     * @return Number of observations that were added to the sketch.
+     */
+    unsigned long long count() const {
+        return my_count;
+    }
+
+    /**
+     * @return Number of values that are currently stored in the sketch.
+     */
+    std::size_t stored() const {
+        std::size_t total = 0;
+        for (std::size_t h = 0; h < my_num_levels; ++h) {
+            total += my_levels[h].size();
+        }
+        return total + my_weighted.size();
+    }
+
+private:
+    std::vector<std::pair<Value_, unsigned long long> > my_workspace;
+
+    void prepare_workspace() {
+        my_workspace.clear();
+        for (std::size_t h = 0; h < my_num_levels; ++h) {
+            const unsigned long long weight = static_cast<unsigned long long>(1) << h;
+            for (const auto v : my_levels[h]) {
+                my_workspace.emplace_back(v, weight);
+            }
+        }
+        my_workspace.insert(my_workspace.end(), my_weighted.begin(), my_weighted.end());
+        std::sort(my_workspace.begin(), my_workspace.end());
+    }
+
+    Value_ value_at_rank(const unsigned long long rank) const {
+        // Each item with weight w occupies w consecutive ranks.
+        std::size_t position = 0;
+        unsigned long long cumulative = 0;
+        while (cumulative + my_workspace[position].second <= rank) {
+            cumulative += my_workspace[position].second;
+            ++position;
+        }
+        return my_workspace[position].first;
+    }
+
+    template<typename Output_>
+    Output_ quantile_from_workspace(const double probability) const {
+        // Interpolating between the order statistics, equivalent to R's type 7 quantiles if the sketch is exact.
+        const double target = probability * static_cast<double>(my_count - 1);
+        const unsigned long long lower = std::floor(target);
+        const Output_ lower_value = value_at_rank(lower);
+        const double frac = target - lower;
+        if (frac == 0) {
+            return lower_value;
+        }
+        const Output_ upper_value = value_at_rank(lower + 1);
+        return lower_value + (upper_value - lower_value) * frac;
+    }
+
+public:
+    /**
+     * @tparam Output_ Floating-point type of the output.
+     * @param probability Probability of the quantile, in \f$[0, 1]\f$.
+     * @return Approximate quantile of the observations.
+     * This is NaN if no observations were added.
+     */
+    template<typename Output_ = Value_>
+    Output_ quantile(const double probability) {
+        if (my_count == 0) {
+            return std::numeric_limits<Output_>::quiet_NaN();
+        }
+        prepare_workspace();
+        return quantile_from_workspace<Output_>(probability);
+    }
+
+    /**
+     * @tparam Output_ Floating-point type of the output.
+     * @param num Number of probabilities.
+     * @param[in] probabilities Pointer to an array of length `num`, containing probabilities in \f$[0, 1]\f$.
+     * @param[out] output Pointer to an array of length `num`, to be filled with the approximate quantiles for each probability.
+     * This is filled with NaNs if no observations were added.
+     */
+    template<typename Output_>
+    void quantiles(const std::size_t num, const double* const probabilities, Output_* const output) {
+        if (my_count == 0) {
+            std::fill_n(output, num, std::numeric_limits<Output_>::quiet_NaN());
+            return;
+        }
+        prepare_workspace();
+        for (std::size_t q = 0; q < num; ++q) {
+            output[q] = quantile_from_workspace<Output_>(probabilities[q]);
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef SCRAN_AGGREGATE_ROLL_UP_ACROSS_CELLS_HPP
+#define SCRAN_AGGREGATE_ROLL_UP_ACROSS_CELLS_HPP
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "aggregate_across_cells.hpp"
+#include "combine_factors.hpp"
+#include "utils.hpp"
+
+/**
+ * @file roll_up_across_cells.hpp
+ * @brief Roll up aggregated statistics into coarser groupings.
+ */
+
+namespace scran_aggregate {
+
+/**
+ * @brief Options for `roll_up_across_cells()`.
+ */
+struct RollUpAcrossCellsOptions {
+    /**
+     * Number of threads to use.
+     * The parallelization scheme is determined by `tatami::parallelize()`.
+     */
+    int num_threads = 1;
+};
+
+/**
+ * @brief Results of `roll_up_across_cells()`.
+ *
+ * @tparam Sum_ Numeric type of the sum.
+ * @tparam Detected_ Type of the number of detected cells.
+ * @tparam Float_ Floating-point type of the other statistics.
+ * @tparam Factor_ Type of the factor levels.
+ */
+template <typename Sum_, typename Detected_, typename Float_, typename Factor_>
+struct RollUpAcrossCellsResults {
+    /**
+     * Vector of length equal to the number of retained factors.
+     * Each inner vector is of length equal to the number of coarse groups, and contains the levels of the corresponding factor for each coarse group.
+     * Coarse groups are sorted in the same manner as the combinations reported by `combine_factors()`.
+     */
+    std::vector<std::vector<Factor_> > levels;
+
+    /**
+     * Vector of length equal to the number of fine-grained groups (i.e., combinations) in the input results,
+     * containing the index of the coarse group to which each combination was assigned.
+     */
+    std::vector<std::size_t> combined;
+
+    /**
+     * Aggregated statistics for each coarse group.
+     * Only the sums, numbers of detected cells, sums of squares, minima and maxima are reported as the other statistics cannot be rolled up.
+     */
+    AggregateAcrossCellsResults<Sum_, Detected_, Float_> aggregates;
+};
+
+/**
+ * @cond
+ */
+template<typename Output_, class Combine_>
+std::vector<std::vector<Output_> > roll_up_statistic(
+    const std::vector<std::vector<Output_> >& fine,
+    const std::vector<std::vector<std::size_t> >& members,
+    const std::size_t num_genes,
+    const Output_ initial,
+    Combine_ combine,
+    const RollUpAcrossCellsOptions& options
+) {
+    std::vector<std::vector<Output_> > output;
+    if (fine.empty()) {
+        return output;
+    }
+
+    const auto ncoarse = members.size();
+    sanisizer::resize(output, ncoarse);
+    for (auto& coarse : output) {
+        sanisizer::resize(coarse, num_genes, initial);
+    }
+
+    // Parallelizing over genes, so each thread only touches its own slice of each group's vector.
+    tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+        for (I<decltype(ncoarse)> c = 0; c < ncoarse; ++c) {
+            const auto outptr = output[c].data() + start;
+            for (const auto f : members[c]) {
+                const auto inptr = fine[f].data() + start;
+                for (std::size_t i = 0; i < length; ++i) {
+                    outptr[i] = combine(outptr[i], inptr[i]);
+                }
+            }
+        }
+    }, num_genes, options.num_threads);
+
+    return output;
+}
+
+template<typename Sum_, typename Detected_, typename Float_>
+std::pair<std::size_t, std::size_t> count_aggregated_dimensions(const AggregateAcrossCellsResults<Sum_, Detected_, Float_>& results) {
+    // Returns the number of groups and genes from the first available statistic.
+    if (!results.sums.empty()) {
+        return std::make_pair(results.sums.size(), results.sums.front().size());
+    }
+    if (!results.detected.empty()) {
+        return std::make_pair(results.detected.size(), results.detected.front().size());
+    }
+    if (!results.sums_of_squares.empty()) {
+        return std::make_pair(results.sums_of_squares.size(), results.sums_of_squares.front().size());
+    }
+    if (!results.minima.empty()) {
+        return std::make_pair(results.minima.size(), results.minima.front().size());
+    }
+    if (!results.maxima.empty()) {
+        return std::make_pair(results.maxima.size(), results.maxima.front().size());
+    }
+    return std::make_pair(static_cast<std::size_t>(0), static_cast<std::size_t>(0));
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Roll up the aggregated statistics for combinations of factors (e.g., cluster and sample) into coarser groupings that only involve a subset of the factors (e.g., cluster only).
+ * This is much faster than calling `aggregate_across_cells()` again on the coarser grouping, as it does not require another pass over the expression matrix.
+ * Specifically, the time complexity is proportional to the product of the number of genes and combinations, rather than the number of non-zero expression values.
+ *
+ * For each coarse group, the sums, numbers of detected cells and sums of squares are computed by summing the statistics of the corresponding combinations.
+ * The minima and maxima are computed by taking the minimum and maximum across the corresponding combinations, ignoring any NaNs from combinations with no cells.
+ * Medians and quantiles cannot be derived from the statistics of the combinations, so they are not reported in the output.
+ *
+ * @tparam Sum_ Numeric type of the sum.
+ * @tparam Detected_ Type of the number of detected cells.
+ * @tparam Float_ Floating-point type of the other statistics.
+ * @tparam Factor_ Type of the factor levels.
+ *
+ * @param results Results of `aggregate_across_cells()` where each group is a combination of factor levels, typically created by `combine_factors()` or `combine_factors_unused()`.
+ * @param levels Levels of the factors for each combination, as returned by `combine_factors()` or `combine_factors_unused()`.
+ * Each inner vector should have length equal to the number of groups in `results`.
+ * @param keep Indices of the factors in `levels` to retain in the coarse groupings.
+ * If empty, all combinations are rolled up into a single group.
+ * @param options Further options.
+ *
+ * @return Statistics for the coarse groups, along with the levels of the retained factors for each coarse group.
+ */
+template<typename Sum_, typename Detected_, typename Float_, typename Factor_>
+RollUpAcrossCellsResults<Sum_, Detected_, Float_, Factor_> roll_up_across_cells(
+    const AggregateAcrossCellsResults<Sum_, Detected_, Float_>& results,
+    const std::vector<std::vector<Factor_> >& levels,
+    const std::vector<std::size_t>& keep,
+    const RollUpAcrossCellsOptions& options
+) {
+    const auto dims = count_aggregated_dimensions(results);
+    const auto nfine = dims.first;
+    const auto ngenes = dims.second;
+    std::vector<const Factor_*> kept;
+    kept.reserve(keep.size());
+    for (const auto k : keep) {
+        if (k >= levels.size()) {
+            throw std::runtime_error("factor indices to keep are out of range");
+        }
+        const auto& current = levels[k];
+        if (current.size() != nfine) {
+            throw std::runtime_error("length of each factor should be equal to the number of groups");
+        }
+        kept.push_back(current.data());
+    }
+
+    RollUpAcrossCellsResults<Sum_, Detected_, Float_, Factor_> output;
+    sanisizer::resize(output.combined, nfine);
+    output.levels = combine_factors(nfine, kept, output.combined.data());
+
+    const std::size_t ncoarse = [&]{
+        if (nfine) {
+            return *std::max_element(output.combined.begin(), output.combined.end()) + 1;
+        } else {
+            return static_cast<std::size_t>(0);
+        }
+    }();
+    auto members = sanisizer::create<std::vector<std::vector<std::size_t> > >(ncoarse);
+    for (I<decltype(nfine)> f = 0; f < nfine; ++f) {
+        members[output.combined[f]].push_back(f);
+    }
+
+    auto& aggr = output.aggregates;
+    aggr.sums = roll_up_statistic<Sum_>(results.sums, members, ngenes, 0, [](Sum_ l, Sum_ r) -> Sum_ { return l + r; }, options);
+    aggr.detected = roll_up_statistic<Detected_>(results.detected, members, ngenes, 0, [](Detected_ l, Detected_ r) -> Detected_ { return l + r; }, options);
+    aggr.sums_of_squares = roll_up_statistic<Sum_>(results.sums_of_squares, members, ngenes, 0, [](Sum_ l, Sum_ r) -> Sum_ { return l + r; }, options);
+
+    // std::fmin and std::fmax ignore NaNs unless both arguments are NaN,
+    // so coarse groups with no cells are still reported as NaN.
+    const Float_ nan = std::numeric_limits<Float_>::quiet_NaN();
+    aggr.minima = roll_up_statistic<Float_>(results.minima, members, ngenes, nan, [](Float_ l, Float_ r) -> Float_ { return std::fmin(l, r); }, options);
+    aggr.maxima = roll_up_statistic<Float_>(results.maxima, members, ngenes, nan, [](Float_ l, Float_ r) -> Float_ { return std::fmax(l, r); }, options);
+
+    return output;
+}
+
+}
+
+#endif
@@ -3,6 +3,13 @@
 
 #include "aggregate_across_genes.hpp"
 #include "aggregate_across_cells.hpp"
+#include "aggregate_across_cells_plan.hpp"
+#include "aggregate_across_cells_accumulator.hpp"
+#include "aggregate_across_cells_sparse.hpp"
+#include "roll_up_across_cells.hpp"
+#include "quantile_sketch.hpp"
+#include "contiguous_matrix.hpp"
+#include "instrumentation.hpp"
 #include "combine_factors.hpp"
 #include "clean_factor.hpp"
 
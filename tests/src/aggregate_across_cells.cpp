@@ -1,7 +1,9 @@
 #include "scran_tests/scran_tests.hpp"
 
 #include <map>
+#include <cmath>
 #include <random>
+#include <limits>
 
 #include "scran_aggregate/aggregate_across_cells.hpp"
 
@@ -222,3 +224,1401 @@ INSTANTIATE_TEST_SUITE_P(
         ::testing::Values(1, 3) // number of threads
     )
 );
+
+TEST(AggregateAcrossCells, MedianBlocks) {
+    int nr = 57, nc = 99;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.3;
+        sparams.lower = 1;
+        sparams.upper = 10;
+        sparams.seed = 42;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    auto grouping = create_groupings(nc, 4);
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, grouping.data(), opt);
+
+    // Forcing the column-major path to process rows in small blocks.
+    for (int block : { 1, 5, 10 }) {
+        opt.median_buffer_size = nc * block;
+        for (int nthreads : { 1, 3 }) {
+            opt.num_threads = nthreads;
+            auto dres = scran_aggregate::aggregate_across_cells(*dense_column, grouping.data(), opt);
+            auto sres = scran_aggregate::aggregate_across_cells(*sparse_column, grouping.data(), opt);
+            for (int l = 0; l < 4; ++l) {
+                EXPECT_EQ(ref.medians[l], dres.medians[l]);
+                EXPECT_EQ(ref.sums[l], dres.sums[l]);
+                EXPECT_EQ(ref.detected[l], dres.detected[l]);
+                EXPECT_EQ(ref.medians[l], sres.medians[l]);
+                EXPECT_EQ(ref.sums[l], sres.sums[l]);
+                EXPECT_EQ(ref.detected[l], sres.detected[l]);
+            }
+        }
+    }
+}
+
+/*********************************************/
+
+class AggregateAcrossCellsQuantileTest : public ::testing::TestWithParam<std::tuple<int, int> > {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        int nr = 67, nc = 118;
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.5;
+            sparams.lower = 1;
+            sparams.upper = 10;
+            sparams.seed = 123;
+            return sparams;
+        }());
+
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+};
+
+TEST_P(AggregateAcrossCellsQuantileTest, Exact) {
+    auto param = GetParam();
+    auto ngroups = std::get<0>(param);
+    auto nthreads = std::get<1>(param);
+    std::vector<int> groupings = create_groupings(dense_row->ncol(), ngroups);
+
+    // Sketches are exact if they're larger than the group size.
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.5, 0.1, 0.9 };
+    opt.quantile_sketch_size = 1000;
+    opt.num_threads = nthreads;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, groupings.data(), opt);
+    ASSERT_EQ(ref.quantiles.size(), 3);
+
+    for (int l = 0; l < ngroups; ++l) {
+        scran_tests::compare_almost_equal_containers(ref.medians[l], ref.quantiles[0][l], {});
+    }
+
+    std::vector<std::vector<double> > by_group(ngroups);
+    const int NR = dense_row->nrow(), NC = dense_row->ncol();
+    auto ext = dense_row->dense_row();
+    std::vector<double> buffer(NC);
+    for (int r = 0; r < NR; ++r) {
+        auto ptr = ext->fetch(r, buffer.data());
+        for (int l = 0; l < ngroups; ++l) {
+            by_group[l].clear();
+        }
+        for (int c = 0; c < NC; ++c) {
+            by_group[groupings[c]].push_back(ptr[c]);
+        }
+        for (int l = 0; l < ngroups; ++l) {
+            std::sort(by_group[l].begin(), by_group[l].end());
+            const double lower_target = 0.1 * (by_group[l].size() - 1);
+            const size_t lower_index = lower_target;
+            const double expected_lower = by_group[l][lower_index] + (by_group[l][lower_index + 1] - by_group[l][lower_index]) * (lower_target - lower_index);
+            scran_tests::compare_almost_equal(expected_lower, ref.quantiles[1][l][r]);
+        }
+    }
+
+    auto compare = [&](const auto& other) -> void {
+        for (int q = 0; q < 3; ++q) {
+            for (int l = 0; l < ngroups; ++l) {
+                scran_tests::compare_almost_equal_containers(ref.quantiles[q][l], other.quantiles[q][l], {});
+            }
+        }
+    };
+
+    compare(scran_aggregate::aggregate_across_cells(*sparse_row, groupings.data(), opt));
+    compare(scran_aggregate::aggregate_across_cells(*dense_column, groupings.data(), opt));
+    compare(scran_aggregate::aggregate_across_cells(*sparse_column, groupings.data(), opt));
+
+    // Same results when processing the column-major matrices in blocks.
+    opt.median_buffer_size = 1;
+    compare(scran_aggregate::aggregate_across_cells(*dense_column, groupings.data(), opt));
+    compare(scran_aggregate::aggregate_across_cells(*sparse_column, groupings.data(), opt));
+}
+
+TEST_P(AggregateAcrossCellsQuantileTest, Approximate) {
+    auto param = GetParam();
+    auto ngroups = std::get<0>(param);
+    auto nthreads = std::get<1>(param);
+    std::vector<int> groupings = create_groupings(dense_row->ncol(), ngroups);
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_sums = false;
+    opt.compute_detected = false;
+    opt.quantile_probabilities = std::vector<double>{ 0.5 };
+    opt.quantile_sketch_size = 8;
+    opt.num_threads = nthreads;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, groupings.data(), opt);
+
+    // Approximations are still within the range of the data.
+    for (int l = 0; l < ngroups; ++l) {
+        for (auto x : ref.quantiles[0][l]) {
+            EXPECT_GE(x, 0);
+            EXPECT_LE(x, 10);
+        }
+    }
+
+    // Results are the same regardless of the matrix representation.
+    auto compare = [&](const auto& other) -> void {
+        for (int l = 0; l < ngroups; ++l) {
+            EXPECT_EQ(ref.quantiles[0][l], other.quantiles[0][l]);
+        }
+    };
+    compare(scran_aggregate::aggregate_across_cells(*dense_column, groupings.data(), opt));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AggregateAcrossCells,
+    AggregateAcrossCellsQuantileTest,
+    ::testing::Combine(
+        ::testing::Values(2, 3, 5), // number of clusters
+        ::testing::Values(1, 3) // number of threads
+    )
+);
+
+/*********************************************/
+
+class AggregateAcrossCellsMomentsTest : public ::testing::TestWithParam<std::tuple<int, int> > {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        int nr = 77, nc = 101;
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.2;
+            sparams.seed = 999;
+            return sparams;
+        }());
+
+        // Adding a fully dense row to check that the extremes are correct when there are no implicit zeros.
+        for (int c = 0; c < nc; ++c) {
+            vec[c] = 1 + c % 7;
+        }
+
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+};
+
+TEST_P(AggregateAcrossCellsMomentsTest, Basic) {
+    auto param = GetParam();
+    auto ngroups = std::get<0>(param);
+    auto nthreads = std::get<1>(param);
+    std::vector<int> groupings = create_groupings(dense_row->ncol(), ngroups);
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    opt.num_threads = nthreads;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, groupings.data(), opt);
+    ASSERT_EQ(ref.sums_of_squares.size(), ngroups);
+    ASSERT_EQ(ref.minima.size(), ngroups);
+    ASSERT_EQ(ref.maxima.size(), ngroups);
+
+    std::vector<std::vector<int> > collected_indices(ngroups);
+    const int NR = dense_row->nrow(), NC = dense_row->ncol();
+    for (int c = 0; c < NC; ++c) {
+        collected_indices[groupings[c]].push_back(c);
+    }
+
+    auto ext = dense_row->dense_row();
+    std::vector<double> buffer(NC);
+    for (int l = 0; l < ngroups; ++l) {
+        const auto& indices = collected_indices[l];
+        std::vector<double> expected_sumsq(NR), expected_min(NR), expected_max(NR);
+        for (int r = 0; r < NR; ++r) {
+            auto ptr = ext->fetch(r, buffer.data());
+            expected_min[r] = ptr[indices.front()];
+            expected_max[r] = ptr[indices.front()];
+            for (auto c : indices) {
+                expected_sumsq[r] += ptr[c] * ptr[c];
+                expected_min[r] = std::min(expected_min[r], ptr[c]);
+                expected_max[r] = std::max(expected_max[r], ptr[c]);
+            }
+        }
+        scran_tests::compare_almost_equal_containers(expected_sumsq, ref.sums_of_squares[l], {});
+        EXPECT_EQ(expected_min, ref.minima[l]);
+        EXPECT_EQ(expected_max, ref.maxima[l]);
+
+        // Checking the variance calculation.
+        std::vector<double> variances(NR);
+        scran_aggregate::compute_variances(NR, indices.size(), ref.sums[l].data(), ref.sums_of_squares[l].data(), variances.data());
+        auto submat = tatami::make_DelayedSubset(dense_row, indices, false);
+        auto expected_var = tatami_stats::variances::by_row(*submat, {});
+        scran_tests::compare_almost_equal_containers(expected_var, variances, {});
+    }
+
+    auto compare = [&](const auto& other) -> void {
+        for (int l = 0; l < ngroups; ++l) {
+            scran_tests::compare_almost_equal_containers(ref.sums_of_squares[l], other.sums_of_squares[l], {});
+            EXPECT_EQ(ref.minima[l], other.minima[l]);
+            EXPECT_EQ(ref.maxima[l], other.maxima[l]);
+        }
+    };
+
+    compare(scran_aggregate::aggregate_across_cells(*sparse_row, groupings.data(), opt));
+    compare(scran_aggregate::aggregate_across_cells(*dense_column, groupings.data(), opt));
+    compare(scran_aggregate::aggregate_across_cells(*sparse_column, groupings.data(), opt));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AggregateAcrossCells,
+    AggregateAcrossCellsMomentsTest,
+    ::testing::Combine(
+        ::testing::Values(2, 3, 5), // number of clusters
+        ::testing::Values(1, 3) // number of threads
+    )
+);
+
+TEST(AggregateAcrossCells, EmptyGroups) {
+    std::vector<double> vec { 1, 0, 2, 3, 0, 4 };
+    tatami::DenseRowMatrix<double, int> dense_row(2, 3, vec);
+    tatami::DenseColumnMatrix<double, int> dense_column(3, 2, vec); // transposed, but we only care about the empty group here.
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+
+    std::vector<int> groupings { 0, 2, 0 };
+    auto res = scran_aggregate::aggregate_across_cells(dense_row, groupings.data(), opt);
+    ASSERT_EQ(res.minima.size(), 3);
+    EXPECT_TRUE(std::isnan(res.minima[1][0]));
+    EXPECT_TRUE(std::isnan(res.maxima[1][1]));
+    EXPECT_EQ(res.minima[0][0], 1);
+    EXPECT_EQ(res.maxima[0][1], 4);
+
+    std::vector<int> groupings2 { 1, 1 };
+    auto res2 = scran_aggregate::aggregate_across_cells(dense_column, groupings2.data(), opt);
+    ASSERT_EQ(res2.minima.size(), 2);
+    EXPECT_TRUE(std::isnan(res2.minima[0][0]));
+    EXPECT_TRUE(std::isnan(res2.maxima[0][2]));
+
+    std::vector<double> variances(2);
+    std::vector<double> sums { 1, 2 }, sumsq { 1, 4 };
+    scran_aggregate::compute_variances(2, 1, sums.data(), sumsq.data(), variances.data());
+    EXPECT_TRUE(std::isnan(variances[0]));
+    EXPECT_TRUE(std::isnan(variances[1]));
+}
+
+TEST(AggregateAcrossCells, IntegerMedians) {
+    int nr = 43, nc = 87;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.6;
+        sparams.lower = 0;
+        sparams.upper = 20;
+        sparams.seed = 77;
+        return sparams;
+    }());
+
+    std::vector<int> ivec(vec.begin(), vec.end());
+    for (int c = 0; c < nc; c += 2) {
+        ivec[c] *= 1000; // forcing a large range in the first row, to trigger the fallback to selection.
+    }
+    std::vector<double> dvec(ivec.begin(), ivec.end());
+
+    auto ref_mat = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(dvec)));
+    tatami::DenseRowMatrix<int, int> int_row(nr, nc, ivec);
+    tatami::DenseColumnMatrix<int, int> int_column(nr, nc, [&]{
+        std::vector<int> transposed(ivec.size());
+        for (int r = 0; r < nr; ++r) {
+            for (int c = 0; c < nc; ++c) {
+                transposed[c * nr + r] = ivec[r * nc + c];
+            }
+        }
+        return transposed;
+    }());
+
+    for (int ngroups : { 1, 3, 6 }) {
+        auto grouping = create_groupings(nc, ngroups);
+        scran_aggregate::AggregateAcrossCellsOptions opt;
+        opt.compute_medians = true;
+        auto res = scran_aggregate::aggregate_across_cells(int_row, grouping.data(), opt);
+        auto cres = scran_aggregate::aggregate_across_cells(int_column, grouping.data(), opt);
+
+        std::vector<std::vector<int> > collected_indices(ngroups);
+        for (int c = 0; c < nc; ++c) {
+            collected_indices[grouping[c]].push_back(c);
+        }
+
+        for (int l = 0; l < ngroups; ++l) {
+            auto submat = tatami::make_DelayedSubset(ref_mat, collected_indices[l], false);
+            auto expected_med = tatami_stats::medians::by_row(*submat, {});
+            EXPECT_EQ(expected_med, res.medians[l]);
+            EXPECT_EQ(expected_med, cres.medians[l]);
+        }
+    }
+}
+
+TEST(AggregateAcrossCells, GroupSortedRows) {
+    int nr = 37, nc = 151;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.4;
+        sparams.seed = 99;
+        return sparams;
+    }());
+    tatami::DenseRowMatrix<double, int> mat(nr, nc, std::move(vec));
+
+    for (int ngroups : { 1, 3, 7 }) {
+        auto grouping = create_groupings(nc, ngroups);
+        auto sorted_grouping = grouping;
+        std::sort(sorted_grouping.begin(), sorted_grouping.end());
+
+        for (const auto& curgroup : { grouping, sorted_grouping }) {
+            scran_aggregate::AggregateAcrossCellsOptions opt;
+            opt.compute_medians = true;
+            auto ref = scran_aggregate::aggregate_across_cells(mat, curgroup.data(), opt);
+
+            opt.group_sorted_rows = true;
+            for (int nthreads : { 1, 3 }) {
+                opt.num_threads = nthreads;
+                auto res = scran_aggregate::aggregate_across_cells(mat, curgroup.data(), opt);
+                for (int l = 0; l < ngroups; ++l) {
+                    scran_tests::compare_almost_equal_containers(ref.sums[l], res.sums[l], {});
+                    EXPECT_EQ(ref.detected[l], res.detected[l]);
+                    EXPECT_EQ(ref.medians[l], res.medians[l]);
+                }
+            }
+        }
+    }
+}
+
+TEST(AggregateAcrossCells, FusedColumnKernels) {
+    // Using odd dimensions to check that the remainders are handled correctly.
+    int nr = 101, nc = 23;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.5;
+        sparams.lower = -5;
+        sparams.upper = 10;
+        sparams.seed = 123;
+        return sparams;
+    }());
+
+    std::vector<float> fvec(vec.begin(), vec.end());
+    std::vector<float> ftransposed(fvec.size());
+    for (int r = 0; r < nr; ++r) {
+        for (int c = 0; c < nc; ++c) {
+            ftransposed[c * nr + r] = fvec[r * nc + c];
+        }
+    }
+    tatami::DenseRowMatrix<float, int> frow(nr, nc, fvec);
+    tatami::DenseColumnMatrix<float, int> fcol(nr, nc, ftransposed);
+
+    std::vector<double> dtransposed(ftransposed.begin(), ftransposed.end());
+    tatami::DenseRowMatrix<double, int> drow(nr, nc, std::vector<double>(fvec.begin(), fvec.end()));
+    tatami::DenseColumnMatrix<double, int> dcol(nr, nc, std::move(dtransposed));
+
+    auto grouping = create_groupings(nc, 3);
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    for (int nthreads : { 1, 3 }) {
+        opt.num_threads = nthreads;
+
+        auto dref = scran_aggregate::aggregate_across_cells(drow, grouping.data(), opt);
+        auto dres = scran_aggregate::aggregate_across_cells(dcol, grouping.data(), opt);
+        EXPECT_EQ(dref.sums, dres.sums);
+        EXPECT_EQ(dref.detected, dres.detected);
+
+        auto fref = scran_aggregate::aggregate_across_cells<float>(frow, grouping.data(), opt);
+        auto fres = scran_aggregate::aggregate_across_cells<float>(fcol, grouping.data(), opt);
+        EXPECT_EQ(fref.sums, fres.sums);
+        EXPECT_EQ(fref.detected, fres.detected);
+
+        auto wref = scran_aggregate::aggregate_across_cells<double>(frow, grouping.data(), opt);
+        auto wres = scran_aggregate::aggregate_across_cells<double>(fcol, grouping.data(), opt);
+        EXPECT_EQ(wref.sums, wres.sums);
+        EXPECT_EQ(wref.detected, wres.detected);
+        EXPECT_EQ(wres.sums, dres.sums);
+    }
+}
+
+TEST(AggregateAcrossCells, GroupTiles) {
+    int nr = 67, nc = 131;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.3;
+        sparams.lower = -2;
+        sparams.upper = 10;
+        sparams.seed = 2024;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    // Shuffling the groups so that each tile's cells are not contiguous.
+    int ngroups = 13;
+    std::vector<int> grouping(nc);
+    std::mt19937_64 rng(99);
+    for (auto& g : grouping) {
+        g = rng() % ngroups;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.2, 0.7 };
+    auto dref = scran_aggregate::aggregate_across_cells(*dense_column, grouping.data(), opt);
+    auto sref = scran_aggregate::aggregate_across_cells(*sparse_column, grouping.data(), opt);
+
+    for (std::size_t limit : { 1, 1000, 5000 }) {
+        opt.column_buffer_memory = limit;
+        for (int nthreads : { 1, 3 }) {
+            opt.num_threads = nthreads;
+            auto dres = scran_aggregate::aggregate_across_cells(*dense_column, grouping.data(), opt);
+            auto sres = scran_aggregate::aggregate_across_cells(*sparse_column, grouping.data(), opt);
+
+            EXPECT_EQ(dref.sums, dres.sums);
+            EXPECT_EQ(dref.detected, dres.detected);
+            EXPECT_EQ(dref.sums_of_squares, dres.sums_of_squares);
+            EXPECT_EQ(dref.minima, dres.minima);
+            EXPECT_EQ(dref.maxima, dres.maxima);
+            EXPECT_EQ(dref.medians, dres.medians);
+            EXPECT_EQ(dref.quantiles, dres.quantiles);
+
+            EXPECT_EQ(sref.sums, sres.sums);
+            EXPECT_EQ(sref.detected, sres.detected);
+            EXPECT_EQ(sref.sums_of_squares, sres.sums_of_squares);
+            EXPECT_EQ(sref.minima, sres.minima);
+            EXPECT_EQ(sref.maxima, sres.maxima);
+            EXPECT_EQ(sref.medians, sres.medians);
+            EXPECT_EQ(sref.quantiles, sres.quantiles);
+        }
+    }
+}
+
+TEST(AggregateAcrossCells, CacheBlocks) {
+    int nr = 83, nc = 97;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.15;
+        sparams.seed = 8080;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    auto grouping = create_groupings(nc, 7);
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.5 };
+    opt.column_cache_size = std::numeric_limits<std::size_t>::max();
+
+    for (const auto& input : { dense_column, sparse_column }) {
+        auto ref = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt);
+
+        // Forcing a block for every row, or several rows per block.
+        for (std::size_t cache : { 1, 1000 }) {
+            for (int nthreads : { 1, 3 }) {
+                auto copt = opt;
+                copt.column_cache_size = cache;
+                copt.num_threads = nthreads;
+                auto res = scran_aggregate::aggregate_across_cells(*input, grouping.data(), copt);
+                EXPECT_EQ(ref.sums, res.sums);
+                EXPECT_EQ(ref.detected, res.detected);
+                EXPECT_EQ(ref.sums_of_squares, res.sums_of_squares);
+                EXPECT_EQ(ref.minima, res.minima);
+                EXPECT_EQ(ref.maxima, res.maxima);
+                EXPECT_EQ(ref.medians, res.medians);
+                EXPECT_EQ(ref.quantiles, res.quantiles);
+
+                // Combined with group tiles.
+                copt.column_buffer_memory = 200;
+                auto tres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), copt);
+                EXPECT_EQ(ref.sums, tres.sums);
+                EXPECT_EQ(ref.detected, tres.detected);
+                EXPECT_EQ(ref.minima, tres.minima);
+            }
+        }
+    }
+}
+
+TEST(AggregateAcrossCells, GeneCosts) {
+    int nr = 73, nc = 91;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.1;
+        sparams.seed = 9191;
+        return sparams;
+    }());
+
+    // Making the first few genes much denser than the others.
+    std::mt19937_64 rng(191);
+    for (int r = 0; r < 5; ++r) {
+        for (int c = 0; c < nc; ++c) {
+            vec[r * nc + c] = rng() % 20;
+        }
+    }
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    // Using the number of non-zero values in each gene, as in the pointers of a compressed sparse row matrix.
+    std::vector<std::size_t> costs(nr + 1);
+    {
+        auto ext = tatami::consecutive_extractor<true>(*sparse_row, true, 0, nr);
+        std::vector<double> vbuffer(nc);
+        std::vector<int> ibuffer(nc);
+        for (int r = 0; r < nr; ++r) {
+            costs[r + 1] = costs[r] + ext->fetch(vbuffer.data(), ibuffer.data()).number;
+        }
+    }
+
+    auto grouping = create_groupings(nc, 4);
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.compute_maxima = true;
+
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto ref = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt);
+
+        for (int nthreads : { 2, 5 }) {
+            auto copt = opt;
+            copt.num_threads = nthreads;
+            copt.gene_costs = costs.data();
+            auto res = scran_aggregate::aggregate_across_cells(*input, grouping.data(), copt);
+            EXPECT_EQ(ref.sums, res.sums);
+            EXPECT_EQ(ref.detected, res.detected);
+            EXPECT_EQ(ref.medians, res.medians);
+            EXPECT_EQ(ref.maxima, res.maxima);
+
+            // Costs are still indexed by the original genes when subsetting.
+            copt.gene_subset = std::vector<std::size_t>{ 0, 1, 2, 10, 20, 30, 40, 50, 60, 70 };
+            auto sres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), copt);
+            for (int g = 0; g < 4; ++g) {
+                for (std::size_t i = 0; i < copt.gene_subset->size(); ++i) {
+                    EXPECT_EQ(ref.sums[g][(*copt.gene_subset)[i]], sres.sums[g][i]);
+                }
+            }
+
+            // Multiple groupings respect the costs as well.
+            copt.gene_subset.reset();
+            auto other = create_groupings(nc, 3);
+            auto mres = scran_aggregate::aggregate_across_cells(*input, std::vector<const int*>{ grouping.data(), other.data() }, copt);
+            EXPECT_EQ(ref.sums, mres[0].sums);
+            EXPECT_EQ(ref.medians, mres[0].medians);
+        }
+    }
+}
+
+TEST(AggregateAcrossCells, ShortWide) {
+    int nr = 6, nc = 503;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.3;
+        sparams.lower = -3;
+        sparams.upper = 10;
+        sparams.seed = 6060;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+
+    // Group 5 only has cells at the start, so it is not present in most threads;
+    // group 4 is not present at all and should have NaN extremes.
+    std::vector<int> grouping(nc);
+    for (int c = 0; c < nc; ++c) {
+        grouping[c] = (c < 10 ? 5 : c % 4);
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+
+    auto compare = [&](const auto& expected, const auto& observed) -> void {
+        ASSERT_EQ(expected.sums.size(), observed.sums.size());
+        for (std::size_t g = 0; g < expected.sums.size(); ++g) {
+            scran_tests::compare_almost_equal_containers(expected.sums[g], observed.sums[g], {});
+            scran_tests::compare_almost_equal_containers(expected.sums_of_squares[g], observed.sums_of_squares[g], {});
+        }
+        EXPECT_EQ(expected.detected, observed.detected);
+        ASSERT_EQ(expected.minima.size(), observed.minima.size());
+        for (std::size_t g = 0; g < expected.minima.size(); ++g) {
+            for (std::size_t i = 0; i < expected.minima[g].size(); ++i) {
+                if (std::isnan(expected.minima[g][i])) {
+                    EXPECT_TRUE(std::isnan(observed.minima[g][i]));
+                    EXPECT_TRUE(std::isnan(observed.maxima[g][i]));
+                } else {
+                    EXPECT_EQ(expected.minima[g][i], observed.minima[g][i]);
+                    EXPECT_EQ(expected.maxima[g][i], observed.maxima[g][i]);
+                }
+            }
+        }
+    };
+
+    for (const auto& input : { dense_row, sparse_row }) {
+        auto ref = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt);
+        EXPECT_TRUE(std::isnan(ref.minima[4][0]));
+
+        for (int nthreads : { 2, 7 }) {
+            auto popt = opt;
+            popt.num_threads = nthreads;
+            compare(ref, scran_aggregate::aggregate_across_cells(*input, grouping.data(), popt));
+
+            auto sopt = popt;
+            sopt.compute_detected = false;
+            auto sres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), sopt);
+            for (int g = 0; g < 6; ++g) {
+                scran_tests::compare_almost_equal_containers(ref.sums[g], sres.sums[g], {});
+            }
+
+            // Works with ignored cells, gene subsets and transformations.
+            auto ignored = grouping;
+            for (int c = 0; c < nc; c += 3) {
+                ignored[c] = -1;
+            }
+            auto iopt = opt;
+            iopt.gene_subset = std::vector<std::size_t>{ 1, 3, 4 };
+            auto iref = scran_aggregate::aggregate_across_cells(*input, ignored.data(), iopt);
+            iopt.num_threads = nthreads;
+            compare(iref, scran_aggregate::aggregate_across_cells(*input, ignored.data(), iopt));
+
+            auto scale = [](double x, int c) -> double { return x * (1 + c % 3); };
+            auto positive = [](double x) -> bool { return x > 0; };
+            auto tref = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt, scale, positive);
+            compare(tref, scran_aggregate::aggregate_across_cells(*input, grouping.data(), popt, scale, positive));
+        }
+
+        // Medians and quantiles fall back to the usual parallelization over genes.
+        auto mopt = opt;
+        mopt.compute_medians = true;
+        auto mref = scran_aggregate::aggregate_across_cells(*input, grouping.data(), mopt);
+        mopt.num_threads = 4;
+        auto mres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), mopt);
+        EXPECT_EQ(mref.medians.size(), mres.medians.size());
+        for (std::size_t g = 0; g < mref.medians.size(); ++g) {
+            scran_tests::compare_almost_equal_containers(mref.medians[g], mres.medians[g], {});
+        }
+    }
+}
+
+TEST(AggregateAcrossCells, ManySparseGroups) {
+    int nr = 51, nc = 200;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.05;
+        sparams.seed = 1001;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+
+    // Most groups are not touched by any given row.
+    auto grouping = create_groupings(nc, 97);
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    for (int nthreads : { 1, 3 }) {
+        opt.num_threads = nthreads;
+        auto ref = scran_aggregate::aggregate_across_cells(*dense_row, grouping.data(), opt);
+        auto res = scran_aggregate::aggregate_across_cells(*sparse_row, grouping.data(), opt);
+        EXPECT_EQ(ref.sums, res.sums);
+        EXPECT_EQ(ref.detected, res.detected);
+
+        auto sopt = opt;
+        sopt.compute_detected = false;
+        auto sres = scran_aggregate::aggregate_across_cells(*sparse_row, grouping.data(), sopt);
+        EXPECT_EQ(ref.sums, sres.sums);
+        EXPECT_TRUE(sres.detected.empty());
+    }
+}
+
+TEST(AggregateAcrossCells, Contiguous) {
+    int nr = 45, nc = 91;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.3;
+        sparams.seed = 31;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    int ngroups = 7;
+    auto grouping = create_groupings(nc, ngroups);
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.5 };
+
+    auto check = [&](const auto& ref, const auto& mat) -> void {
+        EXPECT_EQ(mat.num_rows, static_cast<std::size_t>(nr));
+        EXPECT_EQ(mat.num_columns, static_cast<std::size_t>(ngroups));
+        for (int g = 0; g < ngroups; ++g) {
+            for (int i = 0; i < nr; ++i) {
+                auto val = mat.values[mat.row_major ? i * ngroups + g : g * nr + i];
+                EXPECT_EQ(ref[g][i], val);
+            }
+        }
+    };
+
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto ref = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt);
+        for (bool gene_major : { true, false }) {
+            for (int nthreads : { 1, 3 }) {
+                opt.num_threads = nthreads;
+                auto res = scran_aggregate::aggregate_across_cells_contiguous(*input, grouping.data(), gene_major, opt);
+                EXPECT_EQ(res.sums.row_major, gene_major);
+                check(ref.sums, res.sums);
+                check(ref.detected, res.detected);
+                check(ref.medians, res.medians);
+                check(ref.sums_of_squares, res.sums_of_squares);
+                check(ref.minima, res.minima);
+                check(ref.maxima, res.maxima);
+                check(ref.quantiles[0], res.quantiles[0]);
+            }
+            opt.num_threads = 1;
+        }
+    }
+
+    // Converting to a tatami matrix without copying.
+    auto res = scran_aggregate::aggregate_across_cells_contiguous(*sparse_column, grouping.data(), true, opt);
+    auto ptr = res.sums.values.data();
+    auto converted = scran_aggregate::contiguous_matrix_to_tatami(std::move(res.sums));
+    EXPECT_EQ(converted->nrow(), nr);
+    EXPECT_EQ(converted->ncol(), ngroups);
+    EXPECT_TRUE(converted->prefer_rows());
+    auto ext = converted->dense_row();
+    std::vector<double> buffer(ngroups);
+    auto row = ext->fetch(0, buffer.data());
+    EXPECT_EQ(std::vector<double>(row, row + ngroups), std::vector<double>(ptr, ptr + ngroups));
+}
+
+TEST(AggregateAcrossCells, MultipleGroupings) {
+    int nr = 57, nc = 83;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.2;
+        sparams.seed = 777;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    auto by_cluster = create_groupings(nc, 5);
+    auto by_sample = create_groupings(nc, 3);
+    std::vector<int> by_combined(nc);
+    std::mt19937_64 rng(1234);
+    for (auto& g : by_combined) {
+        g = rng() % 11;
+    }
+    std::vector<const int*> groupings{ by_cluster.data(), by_sample.data(), by_combined.data() };
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.3, 0.9 };
+
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        std::vector<scran_aggregate::AggregateAcrossCellsResults<double, int, double> > ref;
+        for (auto g : groupings) {
+            ref.push_back(scran_aggregate::aggregate_across_cells(*input, g, opt));
+        }
+
+        // Forcing multiple blocks per thread with a small buffer.
+        for (std::size_t limit : { 100, 10000000 }) {
+            for (int nthreads : { 1, 3 }) {
+                auto mopt = opt;
+                mopt.multiple_buffer_size = limit;
+                mopt.num_threads = nthreads;
+                auto res = scran_aggregate::aggregate_across_cells(*input, groupings, mopt);
+                ASSERT_EQ(res.size(), groupings.size());
+
+                for (std::size_t i = 0; i < groupings.size(); ++i) {
+                    EXPECT_EQ(ref[i].sums, res[i].sums);
+                    EXPECT_EQ(ref[i].detected, res[i].detected);
+                    EXPECT_EQ(ref[i].medians, res[i].medians);
+                    EXPECT_EQ(ref[i].sums_of_squares, res[i].sums_of_squares);
+                    EXPECT_EQ(ref[i].minima, res[i].minima);
+                    EXPECT_EQ(ref[i].maxima, res[i].maxima);
+                    EXPECT_EQ(ref[i].quantiles, res[i].quantiles);
+                }
+            }
+        }
+    }
+
+    // Different statistics and layouts can be requested for each grouping.
+    {
+        auto ref_cluster = scran_aggregate::aggregate_across_cells(*sparse_column, by_cluster.data(), opt);
+        auto ref_sample = scran_aggregate::aggregate_across_cells(*sparse_column, by_sample.data(), opt);
+
+        std::vector<double> cluster_sums(nr * 5);
+        std::vector<int> sample_detected(nr * 3);
+        std::vector<scran_aggregate::AggregateAcrossCellsBuffers<double, int, double> > buffers(2);
+        for (int g = 0; g < 5; ++g) {
+            buffers[0].sums.push_back(cluster_sums.data() + g * nr);
+        }
+        for (int g = 0; g < 3; ++g) {
+            buffers[1].detected.push_back(sample_detected.data() + g);
+        }
+        buffers[1].stride = 3;
+
+        auto mopt = opt;
+        mopt.multiple_buffer_size = 200;
+        scran_aggregate::aggregate_across_cells(*sparse_column, std::vector<const int*>{ by_cluster.data(), by_sample.data() }, buffers, mopt);
+        for (int g = 0; g < 5; ++g) {
+            EXPECT_EQ(ref_cluster.sums[g], std::vector<double>(cluster_sums.begin() + g * nr, cluster_sums.begin() + (g + 1) * nr));
+        }
+        for (int g = 0; g < 3; ++g) {
+            for (int i = 0; i < nr; ++i) {
+                EXPECT_EQ(ref_sample.detected[g][i], sample_detected[i * 3 + g]);
+            }
+        }
+    }
+
+    scran_tests::expect_error([&]() -> void {
+        std::vector<scran_aggregate::AggregateAcrossCellsBuffers<double, int, double> > buffers(1);
+        scran_aggregate::aggregate_across_cells(*dense_row, groupings, buffers, opt);
+    }, "number of groupings");
+}
+
+TEST(AggregateAcrossCells, CellWeights) {
+    int nr = 49, nc = 77;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.25;
+        sparams.seed = 2025;
+        return sparams;
+    }());
+
+    std::vector<double> weights(nc);
+    std::mt19937_64 rng(55);
+    for (auto& w : weights) {
+        w = 0.5 + (rng() % 100) / 50.0;
+    }
+
+    // Scaling the matrix manually to obtain the expected results.
+    auto scaled = vec;
+    for (int r = 0; r < nr; ++r) {
+        for (int c = 0; c < nc; ++c) {
+            scaled[r * nc + c] *= weights[c];
+        }
+    }
+    tatami::DenseRowMatrix<double, int> ref_mat(nr, nc, std::move(scaled));
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    auto grouping = create_groupings(nc, 6);
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    auto ref = scran_aggregate::aggregate_across_cells(ref_mat, grouping.data(), opt);
+
+    opt.cell_weights = weights.data();
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        for (int nthreads : { 1, 3 }) {
+            opt.num_threads = nthreads;
+            auto res = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt);
+            for (int g = 0; g < 6; ++g) {
+                scran_tests::compare_almost_equal_containers(ref.sums[g], res.sums[g], {});
+                scran_tests::compare_almost_equal_containers(ref.sums_of_squares[g], res.sums_of_squares[g], {});
+                scran_tests::compare_almost_equal_containers(ref.minima[g], res.minima[g], {});
+                scran_tests::compare_almost_equal_containers(ref.maxima[g], res.maxima[g], {});
+            }
+            EXPECT_EQ(ref.detected, res.detected);
+
+            // Checking the specialized kernels when only one of sums or detected is requested.
+            auto sopt = opt;
+            sopt.compute_detected = false;
+            auto sres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), sopt);
+            for (int g = 0; g < 6; ++g) {
+                scran_tests::compare_almost_equal_containers(ref.sums[g], sres.sums[g], {});
+            }
+
+            auto dopt = opt;
+            dopt.compute_sums = false;
+            auto dres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), dopt);
+            EXPECT_EQ(ref.detected, dres.detected);
+        }
+    }
+
+    // Weights take precedence over the group-sorted row reductions.
+    opt.num_threads = 1;
+    opt.group_sorted_rows = true;
+    auto res = scran_aggregate::aggregate_across_cells(*dense_row, grouping.data(), opt);
+    for (int g = 0; g < 6; ++g) {
+        scran_tests::compare_almost_equal_containers(ref.sums[g], res.sums[g], {});
+    }
+
+    // Medians and quantiles are computed from the weighted values.
+    opt.compute_medians = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.8 };
+    opt.group_sorted_rows = false;
+    auto mref = [&]{
+        auto ropt = opt;
+        ropt.cell_weights = NULL;
+        return scran_aggregate::aggregate_across_cells(ref_mat, grouping.data(), ropt);
+    }();
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt);
+        for (int g = 0; g < 6; ++g) {
+            scran_tests::compare_almost_equal_containers(mref.medians[g], res.medians[g], {});
+            scran_tests::compare_almost_equal_containers(mref.quantiles[0][g], res.quantiles[0][g], {});
+        }
+    }
+}
+
+TEST(AggregateAcrossCells, Transformed) {
+    int nr = 52, nc = 69;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.3;
+        sparams.lower = 0;
+        sparams.upper = 10;
+        sparams.seed = 3030;
+        return sparams;
+    }());
+
+    std::vector<double> size_factors(nc);
+    for (int c = 0; c < nc; ++c) {
+        size_factors[c] = 0.5 + (c % 7) / 4.0;
+    }
+    auto lognorm = [&](double x, int c) -> double { return std::log1p(x / size_factors[c]); };
+    auto above = [](double x) -> bool { return x > 0.5; };
+
+    auto transformed = vec;
+    for (int r = 0; r < nr; ++r) {
+        for (int c = 0; c < nc; ++c) {
+            auto& current = transformed[r * nc + c];
+            current = lognorm(current, c);
+        }
+    }
+    tatami::DenseRowMatrix<double, int> ref_mat(nr, nc, transformed);
+
+    auto shifted = vec;
+    for (auto& x : shifted) {
+        x += 1;
+    }
+    tatami::DenseRowMatrix<double, int> shift_mat(nr, nc, std::move(shifted));
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    auto grouping = create_groupings(nc, 5);
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.25 };
+    auto ref = scran_aggregate::aggregate_across_cells(ref_mat, grouping.data(), opt);
+
+    // Manually computing the detected cells with a threshold.
+    std::vector<std::vector<int> > ref_detected(5, std::vector<int>(nr));
+    for (int r = 0; r < nr; ++r) {
+        for (int c = 0; c < nc; ++c) {
+            ref_detected[grouping[c]][r] += above(transformed[r * nc + c]);
+        }
+    }
+
+    auto compare = [&](const auto& expected, const auto& observed) -> void {
+        for (int g = 0; g < 5; ++g) {
+            scran_tests::compare_almost_equal_containers(expected.sums[g], observed.sums[g], {});
+            scran_tests::compare_almost_equal_containers(expected.sums_of_squares[g], observed.sums_of_squares[g], {});
+            scran_tests::compare_almost_equal_containers(expected.medians[g], observed.medians[g], {});
+            scran_tests::compare_almost_equal_containers(expected.minima[g], observed.minima[g], {});
+            scran_tests::compare_almost_equal_containers(expected.maxima[g], observed.maxima[g], {});
+            scran_tests::compare_almost_equal_containers(expected.quantiles[0][g], observed.quantiles[0][g], {});
+        }
+    };
+
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        for (int nthreads : { 1, 3 }) {
+            opt.num_threads = nthreads;
+            auto res = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt, lognorm, above);
+            compare(ref, res);
+            EXPECT_EQ(ref_detected, res.detected);
+
+            // Checking the specialized kernels when only one of sums or detected is requested.
+            auto sopt = opt;
+            sopt.compute_detected = false;
+            auto sres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), sopt, lognorm, above);
+            for (int g = 0; g < 5; ++g) {
+                scran_tests::compare_almost_equal_containers(ref.sums[g], sres.sums[g], {});
+            }
+
+            auto dopt = opt;
+            dopt.compute_sums = false;
+            auto dres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), dopt, lognorm, above);
+            EXPECT_EQ(ref_detected, dres.detected);
+        }
+    }
+
+    // Transformations that do not preserve zeros cause sparse matrices to be treated as dense.
+    {
+        auto shift = [](double x, int) -> double { return x + 1; };
+        opt.num_threads = 1;
+        auto sref = scran_aggregate::aggregate_across_cells(shift_mat, grouping.data(), opt);
+        for (const auto& input : { sparse_row, sparse_column }) {
+            auto res = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt, shift, [](double x) -> bool { return x > 0; });
+            compare(sref, res);
+            EXPECT_EQ(sref.detected, res.detected);
+        }
+    }
+
+    // Weights are applied before the transformation.
+    {
+        std::vector<double> weights(nc);
+        for (int c = 0; c < nc; ++c) {
+            weights[c] = 1 / size_factors[c];
+        }
+        auto wopt = opt;
+        wopt.cell_weights = weights.data();
+        auto res = scran_aggregate::aggregate_across_cells(*sparse_column, grouping.data(), wopt, [](double x, int) -> double { return std::log1p(x); }, above);
+        compare(ref, res);
+        EXPECT_EQ(ref_detected, res.detected);
+    }
+}
+
+TEST(AggregateAcrossCells, Subsetting) {
+    int nr = 61, nc = 87;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.2;
+        sparams.seed = 4242;
+        return sparams;
+    }());
+
+    // Ignoring every fifth cell and every third gene.
+    auto grouping = create_groupings(nc, 6);
+    std::vector<int> kept_grouping;
+    std::vector<int> kept_cells;
+    for (int c = 0; c < nc; ++c) {
+        if (c % 5 == 0) {
+            grouping[c] = -1;
+        } else {
+            kept_cells.push_back(c);
+            kept_grouping.push_back(grouping[c]);
+        }
+    }
+    std::vector<std::size_t> gene_subset;
+    for (int r = 0; r < nr; ++r) {
+        if (r % 3 != 1) {
+            gene_subset.push_back(r);
+        }
+    }
+
+    std::vector<double> subsetted;
+    for (auto r : gene_subset) {
+        for (auto c : kept_cells) {
+            subsetted.push_back(vec[r * nc + c]);
+        }
+    }
+    tatami::DenseRowMatrix<double, int> ref_mat(gene_subset.size(), kept_cells.size(), std::move(subsetted));
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.4 };
+    auto ref = scran_aggregate::aggregate_across_cells(ref_mat, kept_grouping.data(), opt);
+
+    auto compare = [&](const auto& expected, const auto& observed) -> void {
+        ASSERT_EQ(expected.sums.size(), observed.sums.size());
+        for (std::size_t g = 0; g < expected.sums.size(); ++g) {
+            scran_tests::compare_almost_equal_containers(expected.sums[g], observed.sums[g], {});
+            scran_tests::compare_almost_equal_containers(expected.sums_of_squares[g], observed.sums_of_squares[g], {});
+        }
+        EXPECT_EQ(expected.detected, observed.detected);
+        EXPECT_EQ(expected.medians, observed.medians);
+        EXPECT_EQ(expected.minima, observed.minima);
+        EXPECT_EQ(expected.maxima, observed.maxima);
+        EXPECT_EQ(expected.quantiles, observed.quantiles);
+    };
+
+    opt.gene_subset = gene_subset;
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        for (int nthreads : { 1, 3 }) {
+            opt.num_threads = nthreads;
+            compare(ref, scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt));
+
+            // Also checking the specialized kernels and the group tiles.
+            auto sopt = opt;
+            sopt.compute_detected = false;
+            sopt.column_buffer_memory = 500;
+            auto sres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), sopt);
+            for (int g = 0; g < 6; ++g) {
+                scran_tests::compare_almost_equal_containers(ref.sums[g], sres.sums[g], {});
+            }
+        }
+
+        // Cells are still ignored without any subsetting of the genes.
+        auto copt = opt;
+        copt.gene_subset.reset();
+        auto cres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), copt);
+        for (int g = 0; g < 6; ++g) {
+            for (std::size_t i = 0; i < gene_subset.size(); ++i) {
+                EXPECT_EQ(ref.detected[g][i], cres.detected[g][gene_subset[i]]);
+                EXPECT_EQ(ref.maxima[g][i], cres.maxima[g][gene_subset[i]]);
+            }
+        }
+
+        // Weights and transformations are indexed by the original cell.
+        std::vector<double> weights(nc);
+        for (int c = 0; c < nc; ++c) {
+            weights[c] = (c % 5 == 0 ? 1000 : 1);
+        }
+        auto wopt = opt;
+        wopt.cell_weights = weights.data();
+        compare(ref, scran_aggregate::aggregate_across_cells(*input, grouping.data(), wopt));
+
+        auto tres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), opt, [&](double x, int c) -> double { return x * weights[c]; }, [](double x) -> bool { return x > 0; });
+        compare(ref, tres);
+
+        // Multiple groupings are also subsetted.
+        auto mopt = opt;
+        mopt.multiple_buffer_size = 200;
+        auto all_groupings = create_groupings(nc, 3);
+        auto mref = scran_aggregate::aggregate_across_cells(*input, all_groupings.data(), opt);
+        auto mres = scran_aggregate::aggregate_across_cells(*input, std::vector<const int*>{ grouping.data(), all_groupings.data() }, mopt);
+        compare(ref, mres[0]);
+        compare(mref, mres[1]);
+    }
+
+    opt.gene_subset = std::vector<std::size_t>{ 5, 2 };
+    scran_tests::expect_error([&]() -> void {
+        scran_aggregate::aggregate_across_cells(*dense_row, grouping.data(), opt);
+    }, "sorted and unique");
+
+    opt.gene_subset = std::vector<std::size_t>{ static_cast<std::size_t>(nr) };
+    scran_tests::expect_error([&]() -> void {
+        scran_aggregate::aggregate_across_cells(*dense_row, grouping.data(), opt);
+    }, "out of range");
+}
+
+TEST(AggregateAcrossCells, MemoryEstimate) {
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    const int nr = 1000, nc = 5000;
+    auto ref = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 10, opt);
+    EXPECT_GT(ref.by_row, static_cast<std::size_t>(0));
+    EXPECT_GT(ref.by_column, static_cast<std::size_t>(0));
+    EXPECT_EQ(ref.by_row_cells, std::numeric_limits<std::size_t>::max()); // not applicable for a single thread.
+
+    // Each thread holds a row of the matrix in the row path.
+    EXPECT_GE(ref.by_row, nc * sizeof(double));
+    auto sparse = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, true, 10, opt);
+    EXPECT_GT(sparse.by_row, ref.by_row);
+
+    // More threads require more memory in the row path, but not the column
+    // path as the partial statistics for each thread only span its genes.
+    auto topt = opt;
+    topt.num_threads = 4;
+    auto threaded = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 10, topt);
+    EXPECT_GT(threaded.by_row, ref.by_row);
+    EXPECT_GE(threaded.by_column, ref.by_column);
+    EXPECT_NE(threaded.by_row_cells, std::numeric_limits<std::size_t>::max());
+
+    // Medians require each thread to hold all values for a row, or a block of rows.
+    auto mopt = opt;
+    mopt.compute_medians = true;
+    auto medians = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 10, mopt);
+    EXPECT_GE(medians.by_row, ref.by_row + nc * sizeof(double));
+    EXPECT_GE(medians.by_column, ref.by_column + nc * sizeof(double));
+    mopt.median_buffer_size = nc; // i.e., one row per block.
+    auto capped = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 10, mopt);
+    EXPECT_LT(capped.by_column, medians.by_column);
+
+    // Column path scales with the number of groups, unless tiling is enabled.
+    auto many = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 1000, opt);
+    EXPECT_GT(many.by_column, ref.by_column + nr * 1000 * sizeof(double));
+    auto copt = opt;
+    copt.column_buffer_memory = 10000;
+    auto tiled = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 1000, copt);
+    EXPECT_LT(tiled.by_column, many.by_column);
+
+    // Gene subsets reduce the memory usage of the column path.
+    auto sopt = opt;
+    sopt.gene_subset = std::vector<std::size_t>{ 0, 1, 2 };
+    auto subsetted = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 1000, sopt);
+    EXPECT_LT(subsetted.by_column, many.by_column);
+}
+
+TEST(AggregateAcrossCells, MemoryBudget) {
+    int nr = 59, nc = 143;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.2;
+        sparams.seed = 2424;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    auto grouping = create_groupings(nc, 9);
+    grouping[0] = -1;
+
+    auto compare = [](const auto& ref, const auto& res) -> void {
+        for (int g = 0; g < 9; ++g) {
+            scran_tests::compare_almost_equal_containers(ref.sums[g], res.sums[g], {});
+            scran_tests::compare_almost_equal_containers(ref.sums_of_squares[g], res.sums_of_squares[g], {});
+        }
+        EXPECT_EQ(ref.detected, res.detected);
+        EXPECT_EQ(ref.minima, res.minima);
+        EXPECT_EQ(ref.maxima, res.maxima);
+        EXPECT_EQ(ref.medians, res.medians);
+        EXPECT_EQ(ref.quantiles, res.quantiles);
+    };
+
+    for (bool medians : { false, true }) {
+        scran_aggregate::AggregateAcrossCellsOptions opt;
+        opt.compute_sums_of_squares = true;
+        opt.compute_minima = true;
+        opt.compute_maxima = true;
+        if (medians) {
+            opt.compute_medians = true;
+            opt.quantile_probabilities = std::vector<double>{ 0.3 };
+        }
+        auto ref = scran_aggregate::aggregate_across_cells(*dense_row, grouping.data(), opt);
+
+        auto estimate = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 9, opt);
+        for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+            // Trying a budget that fits everything, one that requires fewer
+            // threads or tiling, and one that fits nothing.
+            for (std::size_t budget : { std::numeric_limits<std::size_t>::max() - 1, estimate.by_column / 2, estimate.by_row / 2, static_cast<std::size_t>(0) }) {
+                auto bopt = opt;
+                bopt.num_threads = 3;
+                bopt.memory_budget = budget;
+                compare(ref, scran_aggregate::aggregate_across_cells(*input, grouping.data(), bopt));
+
+                // Same for a gene subset, which may use the short-and-wide path.
+                bopt.gene_subset = std::vector<std::size_t>{ 1, 5, 58 };
+                auto sres = scran_aggregate::aggregate_across_cells(*input, grouping.data(), bopt);
+                for (int g = 0; g < 9; ++g) {
+                    for (std::size_t i = 0; i < bopt.gene_subset->size(); ++i) {
+                        const auto gene = (*bopt.gene_subset)[i];
+                        EXPECT_FLOAT_EQ(ref.sums[g][gene], sres.sums[g][i]);
+                        EXPECT_EQ(ref.detected[g][gene], sres.detected[g][i]);
+                        EXPECT_EQ(ref.maxima[g][gene], sres.maxima[g][i]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(AggregateAcrossCells, CompensatedSums) {
+    // Many cells per group so that naive single-precision sums lose accuracy.
+    int nr = 4, nc = 200000;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.5;
+        sparams.lower = 0;
+        sparams.upper = 1;
+        sparams.seed = 1357;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    auto grouping = create_groupings(nc, 2);
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_sums_of_squares = true;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, grouping.data(), opt);
+
+    // Computing the largest error relative to the double-precision reference, in units of float epsilon.
+    auto max_error = [&](const auto& observed, const std::vector<std::size_t>& genes) -> double {
+        double error = 0;
+        for (int g = 0; g < 2; ++g) {
+            for (std::size_t i = 0; i < genes.size(); ++i) {
+                const double expected = ref.sums[g][genes[i]], expected_sq = ref.sums_of_squares[g][genes[i]];
+                error = std::max(error, std::abs(observed.sums[g][i] - expected) / expected);
+                error = std::max(error, std::abs(observed.sums_of_squares[g][i] - expected_sq) / expected_sq);
+            }
+        }
+        return error / std::numeric_limits<float>::epsilon();
+    };
+    const std::vector<std::size_t> all_genes{ 0, 1, 2, 3 };
+
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        for (int nthreads : { 1, 3 }) {
+            auto copt = opt;
+            copt.num_threads = nthreads;
+            auto naive = scran_aggregate::aggregate_across_cells<float>(*input, grouping.data(), copt);
+            EXPECT_GT(max_error(naive, all_genes), 1);
+
+            copt.compensated_sums = true;
+            auto compensated = scran_aggregate::aggregate_across_cells<float>(*input, grouping.data(), copt);
+            EXPECT_LE(max_error(compensated, all_genes), 1);
+            EXPECT_EQ(ref.detected, compensated.detected);
+
+            // Segmented reductions are not used with compensation.
+            auto sorted = copt;
+            sorted.group_sorted_rows = true;
+            EXPECT_LE(max_error(scran_aggregate::aggregate_across_cells<float>(*input, grouping.data(), sorted), all_genes), 1);
+
+            // Same for a gene subset, which may use the short-and-wide path.
+            auto sopt = copt;
+            sopt.gene_subset = std::vector<std::size_t>{ 2 };
+            EXPECT_LE(max_error(scran_aggregate::aggregate_across_cells<float>(*input, grouping.data(), sopt), *(sopt.gene_subset)), 1);
+        }
+    }
+
+    // Compensation has no effect on double-precision sums beyond rounding.
+    auto dopt = opt;
+    dopt.compensated_sums = true;
+    auto dres = scran_aggregate::aggregate_across_cells(*dense_column, grouping.data(), dopt);
+    for (int g = 0; g < 2; ++g) {
+        scran_tests::compare_almost_equal_containers(ref.sums[g], dres.sums[g], {});
+        scran_tests::compare_almost_equal_containers(ref.sums_of_squares[g], dres.sums_of_squares[g], {});
+    }
+
+    // Compensated accumulators take more memory.
+    auto naive_estimate = scran_aggregate::estimate_aggregate_across_cells_memory<float>(nr, nc, false, 2, opt);
+    auto compensated_estimate = scran_aggregate::estimate_aggregate_across_cells_memory<float>(nr, nc, false, 2, dopt);
+    EXPECT_GT(compensated_estimate.by_row, naive_estimate.by_row);
+    EXPECT_GT(compensated_estimate.by_column, naive_estimate.by_column);
+}
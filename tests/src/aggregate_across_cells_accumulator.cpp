@@ -0,0 +1,170 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include <vector>
+
+#include "scran_aggregate/aggregate_across_cells_accumulator.hpp"
+
+class AggregateAcrossCellsAccumulatorTest : public ::testing::TestWithParam<std::tuple<int, int> > {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        int nr = 98, nc = 121;
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.1;
+            return sparams;
+        }());
+
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    static std::vector<std::pair<std::shared_ptr<tatami::NumericMatrix>, std::vector<int> > > split(
+        const std::shared_ptr<tatami::NumericMatrix>& mat,
+        const std::vector<int>& groupings,
+        int nchunks)
+    {
+        std::vector<std::pair<std::shared_ptr<tatami::NumericMatrix>, std::vector<int> > > output;
+        const int NC = mat->ncol();
+        const int per_chunk = (NC + nchunks - 1) / nchunks;
+        for (int start = 0; start < NC; start += per_chunk) {
+            const int end = std::min(NC, start + per_chunk);
+            std::vector<int> keep;
+            for (int c = start; c < end; ++c) {
+                keep.push_back(c);
+            }
+            output.emplace_back(
+                tatami::make_DelayedSubset(mat, std::move(keep), false),
+                std::vector<int>(groupings.begin() + start, groupings.begin() + end)
+            );
+        }
+        return output;
+    }
+};
+
+TEST_P(AggregateAcrossCellsAccumulatorTest, Chunked) {
+    auto param = GetParam();
+    auto ngroups = std::get<0>(param);
+    auto nthreads = std::get<1>(param);
+
+    // Using a grouping where each chunk only has a subset of groups, plus some groups that are split across chunks.
+    const int NC = dense_row->ncol();
+    std::vector<int> groupings(NC);
+    for (int c = 0; c < NC; ++c) {
+        groupings[c] = (c * ngroups) / NC;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.num_threads = nthreads;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, groupings.data(), opt);
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        scran_aggregate::AggregateAcrossCellsAccumulator<int> acc(mat->nrow(), ngroups, opt);
+        EXPECT_EQ(acc.num_genes(), mat->nrow());
+        EXPECT_EQ(acc.num_groups(), ngroups);
+
+        for (const auto& chunk : split(mat, groupings, 4)) {
+            acc.add(*(chunk.first), chunk.second.data());
+        }
+
+        auto res = acc.finish();
+        ASSERT_EQ(res.sums.size(), ngroups);
+        ASSERT_EQ(res.detected.size(), ngroups);
+        EXPECT_TRUE(res.medians.empty());
+        for (int l = 0; l < ngroups; ++l) {
+            scran_tests::compare_almost_equal_containers(ref.sums[l], res.sums[l], {});
+            EXPECT_EQ(ref.detected[l], res.detected[l]);
+        }
+    }
+}
+
+TEST_P(AggregateAcrossCellsAccumulatorTest, Merged) {
+    auto param = GetParam();
+    auto ngroups = std::get<0>(param);
+    auto nthreads = std::get<1>(param);
+
+    const int NC = dense_row->ncol();
+    std::vector<int> groupings(NC);
+    for (int c = 0; c < NC; ++c) {
+        groupings[c] = c % ngroups;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.num_threads = nthreads;
+    auto ref = scran_aggregate::aggregate_across_cells(*sparse_column, groupings.data(), opt);
+
+    // Alternating chunks between two accumulators, and then merging them.
+    scran_aggregate::AggregateAcrossCellsAccumulator<int> acc1(dense_row->nrow(), ngroups, opt);
+    scran_aggregate::AggregateAcrossCellsAccumulator<int> acc2(dense_row->nrow(), ngroups, opt);
+    auto chunks = split(sparse_column, groupings, 5);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        auto& acc = (i % 2 == 0 ? acc1 : acc2);
+        acc.add(*(chunks[i].first), chunks[i].second.data());
+    }
+
+    acc1.merge(acc2);
+    for (int l = 0; l < ngroups; ++l) {
+        scran_tests::compare_almost_equal_containers(ref.sums[l], acc1.get_sums()[l], {});
+        EXPECT_EQ(ref.detected[l], acc1.get_detected()[l]);
+    }
+
+    // Merging into an empty accumulator is just a copy.
+    scran_aggregate::AggregateAcrossCellsAccumulator<int> empty(dense_row->nrow(), ngroups, opt);
+    empty.merge(acc1);
+    for (int l = 0; l < ngroups; ++l) {
+        EXPECT_EQ(empty.get_sums()[l], acc1.get_sums()[l]);
+        EXPECT_EQ(empty.get_detected()[l], acc1.get_detected()[l]);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AggregateAcrossCellsAccumulator,
+    AggregateAcrossCellsAccumulatorTest,
+    ::testing::Combine(
+        ::testing::Values(2, 3, 7), // number of clusters
+        ::testing::Values(1, 3) // number of threads
+    )
+);
+
+TEST(AggregateAcrossCellsAccumulator, Skipping) {
+    std::vector<double> vec { 1, 0, 2, 3, 0, 4 };
+    tatami::DenseRowMatrix<double, int> mat(2, 3, std::move(vec));
+    std::vector<int> groupings { 0, 1, 0 };
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_sums = false;
+    scran_aggregate::AggregateAcrossCellsAccumulator<int> acc(2, 2, opt);
+    acc.add(mat, groupings.data());
+    acc.add(mat, groupings.data());
+
+    EXPECT_TRUE(acc.get_sums().empty());
+    std::vector<int> expected0 { 4, 4 };
+    EXPECT_EQ(acc.get_detected()[0], expected0);
+    std::vector<int> expected1 { 0, 0 };
+    EXPECT_EQ(acc.get_detected()[1], expected1);
+}
+
+TEST(AggregateAcrossCellsAccumulator, Errors) {
+    std::vector<double> vec(6);
+    tatami::DenseRowMatrix<double, int> mat(2, 3, std::move(vec));
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    scran_aggregate::AggregateAcrossCellsAccumulator<int> acc(3, 2, opt);
+    std::vector<int> groupings { 0, 1, 0 };
+    scran_tests::expect_error([&]() {
+        acc.add(mat, groupings.data());
+    }, "number of rows");
+
+    scran_aggregate::AggregateAcrossCellsAccumulator<int> acc2(2, 2, opt);
+    groupings[1] = 2;
+    scran_tests::expect_error([&]() {
+        acc2.add(mat, groupings.data());
+    }, "out of range");
+
+    scran_tests::expect_error([&]() {
+        acc.merge(acc2);
+    }, "same number");
+}
@@ -0,0 +1,164 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include <vector>
+#include <cmath>
+
+#include "scran_aggregate/aggregate_across_cells.hpp"
+#include "scran_aggregate/aggregate_across_cells_plan.hpp"
+
+TEST(AggregateAcrossCellsPlan, Basic) {
+    std::vector<int> groups { 2, 0, -1, 1, 0, 2, -1, 0 };
+    scran_aggregate::AggregateAcrossCellsPlan<int, int> plan(groups.size(), groups.data());
+
+    EXPECT_EQ(plan.num_cells(), 8);
+    EXPECT_EQ(plan.num_groups(), 3);
+    EXPECT_EQ(plan.group_sizes(), std::vector<int>({ 3, 1, 2 }));
+    EXPECT_EQ(plan.offsets(), std::vector<std::size_t>({ 0, 3, 4, 6 }));
+    EXPECT_EQ(plan.permutation(), std::vector<int>({ 1, 4, 7, 3, 0, 5 }));
+    EXPECT_EQ(std::vector<int>(plan.group(), plan.group() + 8), groups);
+
+    ASSERT_TRUE(plan.kept_cells());
+    EXPECT_EQ(*(plan.kept_cells()), std::vector<int>({ 0, 1, 3, 4, 5, 7 }));
+    EXPECT_EQ(std::vector<int>(plan.compact_group(), plan.compact_group() + 6), std::vector<int>({ 2, 0, 1, 0, 2, 0 }));
+
+    // Same results with no ignored cells.
+    std::vector<int> kept { 1, 0, 1, 0 };
+    scran_aggregate::AggregateAcrossCellsPlan<int, int> kplan(kept.size(), kept.data());
+    EXPECT_EQ(kplan.num_groups(), 2);
+    EXPECT_EQ(kplan.group_sizes(), std::vector<int>({ 2, 2 }));
+    EXPECT_EQ(kplan.permutation(), std::vector<int>({ 1, 3, 0, 2 }));
+    EXPECT_FALSE(kplan.kept_cells());
+    EXPECT_EQ(kplan.compact_group(), kplan.group());
+
+    // All cells are ignored.
+    std::vector<int> ignored { -1, -1 };
+    scran_aggregate::AggregateAcrossCellsPlan<int, int> iplan(ignored.size(), ignored.data());
+    EXPECT_EQ(iplan.num_groups(), 0);
+    EXPECT_TRUE(iplan.permutation().empty());
+    EXPECT_TRUE(iplan.kept_cells()->empty());
+}
+
+class AggregateAcrossCellsPlanTest : public ::testing::TestWithParam<std::tuple<int, bool> > {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        int nr = 88, nc = 126;
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.15;
+            sparams.lower = 1;
+            sparams.upper = 10;
+            sparams.seed = 8675309;
+            return sparams;
+        }());
+
+        dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    template<class Results_>
+    static void compare(const Results_& expected, const Results_& observed) {
+        ASSERT_EQ(expected.sums.size(), observed.sums.size());
+        for (std::size_t g = 0; g < expected.sums.size(); ++g) {
+            scran_tests::compare_almost_equal_containers(expected.sums[g], observed.sums[g], {});
+            scran_tests::compare_almost_equal_containers(expected.sums_of_squares[g], observed.sums_of_squares[g], {});
+        }
+        EXPECT_EQ(expected.detected, observed.detected);
+        EXPECT_EQ(expected.medians, observed.medians);
+        EXPECT_EQ(expected.minima, observed.minima);
+        EXPECT_EQ(expected.maxima, observed.maxima);
+        EXPECT_EQ(expected.quantiles, observed.quantiles);
+    }
+};
+
+TEST_P(AggregateAcrossCellsPlanTest, Consistency) {
+    const auto params = GetParam();
+    const int nthreads = std::get<0>(params);
+    const bool ignore = std::get<1>(params);
+
+    const int nc = dense_row->ncol();
+    std::vector<int> groups(nc);
+    for (int c = 0; c < nc; ++c) {
+        groups[c] = (ignore && c % 5 == 0 ? -1 : (c * 7) % 6);
+    }
+    scran_aggregate::AggregateAcrossCellsPlan<int, int> plan(nc, groups.data());
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.num_threads = nthreads;
+    opt.compute_sums_of_squares = true;
+    opt.compute_minima = true;
+    opt.compute_maxima = true;
+    opt.quantile_probabilities = std::vector<double>{ 0.2, 0.8 };
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto ref = scran_aggregate::aggregate_across_cells(*mat, groups.data(), opt);
+        compare(ref, scran_aggregate::aggregate_across_cells(*mat, plan, opt));
+
+        // Re-using the same plan with different options.
+        auto sopt = opt;
+        sopt.gene_subset = std::vector<std::size_t>{ 0, 5, 10, 50, 87 };
+        compare(
+            scran_aggregate::aggregate_across_cells(*mat, groups.data(), sopt),
+            scran_aggregate::aggregate_across_cells(*mat, plan, sopt)
+        );
+
+        auto log1p = [](double x, int) -> double { return std::log1p(x); };
+        auto above = [](double y) -> bool { return y > 1; };
+        compare(
+            scran_aggregate::aggregate_across_cells(*mat, groups.data(), opt, log1p, above),
+            scran_aggregate::aggregate_across_cells(*mat, plan, opt, log1p, above)
+        );
+
+        std::vector<double> weights(nc);
+        for (int c = 0; c < nc; ++c) {
+            weights[c] = 1.0 / (1 + c % 4);
+        }
+        auto wopt = opt;
+        wopt.cell_weights = weights.data();
+        compare(
+            scran_aggregate::aggregate_across_cells(*mat, groups.data(), wopt),
+            scran_aggregate::aggregate_across_cells(*mat, plan, wopt)
+        );
+    }
+
+    // Checking the short-and-wide case, where each thread processes a range of cells.
+    auto fopt = opt;
+    fopt.quantile_probabilities.clear();
+    fopt.gene_subset = std::vector<std::size_t>{ 1, 2 };
+    for (const auto& mat : { dense_row, sparse_row }) {
+        compare(
+            scran_aggregate::aggregate_across_cells(*mat, groups.data(), fopt),
+            scran_aggregate::aggregate_across_cells(*mat, plan, fopt)
+        );
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AggregateAcrossCellsPlan,
+    AggregateAcrossCellsPlanTest,
+    ::testing::Combine(
+        ::testing::Values(1, 3), // number of threads
+        ::testing::Values(false, true) // whether to ignore some cells
+    )
+);
+
+TEST(AggregateAcrossCellsPlan, Errors) {
+    auto mat = tatami::DenseRowMatrix<double, int>(2, 3, std::vector<double>(6));
+
+    std::vector<int> groups { 0, 1, 0, 1 };
+    scran_aggregate::AggregateAcrossCellsPlan<int, int> plan(groups.size(), groups.data());
+    scran_tests::expect_error([&]() -> void {
+        scran_aggregate::aggregate_across_cells(mat, plan, scran_aggregate::AggregateAcrossCellsOptions());
+    }, "number of cells");
+
+    scran_aggregate::AggregateAcrossCellsPlan<int, int> plan2(3, groups.data());
+    std::vector<double> sums(2);
+    scran_aggregate::AggregateAcrossCellsBuffers<double, int, double> buffers;
+    buffers.sums.push_back(sums.data());
+    scran_tests::expect_error([&]() -> void {
+        scran_aggregate::aggregate_across_cells(mat, plan2, buffers, scran_aggregate::AggregateAcrossCellsOptions());
+    }, "number of groups");
+}
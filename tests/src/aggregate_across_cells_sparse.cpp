@@ -0,0 +1,133 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include <vector>
+#include <random>
+
+#include "scran_aggregate/aggregate_across_cells_sparse.hpp"
+
+class AggregateAcrossCellsSparseTest : public ::testing::TestWithParam<std::tuple<int, int> > {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        int nr = 87, nc = 143;
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.05;
+            return sparams;
+        }());
+
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    template<typename Value_>
+    static void compare(const std::vector<std::vector<Value_> >& ref, const scran_aggregate::CompressedSparseRows<Value_, int>& sparse) {
+        size_t ngroups = ref.size();
+        ASSERT_EQ(sparse.num_columns, ngroups);
+        ASSERT_EQ(sparse.num_rows, ref.front().size());
+        ASSERT_EQ(sparse.pointers.size(), sparse.num_rows + 1);
+
+        for (size_t r = 0; r < sparse.num_rows; ++r) {
+            std::vector<Value_> expanded(ngroups);
+            for (auto k = sparse.pointers[r]; k < sparse.pointers[r + 1]; ++k) {
+                EXPECT_NE(sparse.values[k], 0);
+                if (k > sparse.pointers[r]) {
+                    EXPECT_LT(sparse.indices[k - 1], sparse.indices[k]);
+                }
+                expanded[sparse.indices[k]] = sparse.values[k];
+            }
+            for (size_t g = 0; g < ngroups; ++g) {
+                EXPECT_EQ(ref[g][r], expanded[g]);
+            }
+        }
+    }
+};
+
+TEST_P(AggregateAcrossCellsSparseTest, Basic) {
+    auto param = GetParam();
+    auto ngroups = std::get<0>(param);
+    auto nthreads = std::get<1>(param);
+
+    const int NC = dense_row->ncol();
+    std::vector<int> groupings(NC);
+    std::mt19937_64 rng(ngroups * 10 + nthreads);
+    for (auto& g : groupings) {
+        g = rng() % ngroups;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.num_threads = nthreads;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, groupings.data(), opt);
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_aggregate::aggregate_across_cells_sparse(*mat, groupings.data(), opt);
+        compare(ref.sums, res.sums);
+        compare(ref.detected, res.detected);
+    }
+
+    // Forcing the column-major path to process the rows in small blocks.
+    auto bopt = opt;
+    bopt.sparse_buffer_size = ngroups * 5;
+    for (const auto& mat : { dense_column, sparse_column }) {
+        auto res = scran_aggregate::aggregate_across_cells_sparse(*mat, groupings.data(), bopt);
+        compare(ref.sums, res.sums);
+        compare(ref.detected, res.detected);
+    }
+
+    // Only computing one of the statistics.
+    auto sopt = opt;
+    sopt.compute_detected = false;
+    auto sres = scran_aggregate::aggregate_across_cells_sparse(*sparse_column, groupings.data(), sopt);
+    compare(ref.sums, sres.sums);
+    EXPECT_TRUE(sres.detected.values.empty());
+    EXPECT_EQ(sres.detected.num_rows, 0u);
+
+    auto dopt = opt;
+    dopt.compute_sums = false;
+    auto dres = scran_aggregate::aggregate_across_cells_sparse(*sparse_row, groupings.data(), dopt);
+    compare(ref.detected, dres.detected);
+    EXPECT_TRUE(dres.sums.values.empty());
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AggregateAcrossCellsSparse,
+    AggregateAcrossCellsSparseTest,
+    ::testing::Combine(
+        ::testing::Values(2, 7, 50), // number of groups
+        ::testing::Values(1, 3) // number of threads
+    )
+);
+
+TEST(AggregateAcrossCellsSparse, Tatami) {
+    int nr = 23, nc = 41;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.1;
+        return sparams;
+    }());
+    tatami::DenseRowMatrix<double, int> mat(nr, nc, std::move(vec));
+
+    std::vector<int> groupings(nc);
+    for (int c = 0; c < nc; ++c) {
+        groupings[c] = c % 9;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    auto ref = scran_aggregate::aggregate_across_cells(mat, groupings.data(), opt);
+    auto res = scran_aggregate::aggregate_across_cells_sparse(mat, groupings.data(), opt);
+
+    auto converted = scran_aggregate::compressed_sparse_rows_to_tatami(std::move(res.sums));
+    EXPECT_EQ(converted->nrow(), nr);
+    EXPECT_EQ(converted->ncol(), 9);
+    EXPECT_TRUE(converted->is_sparse());
+
+    auto ext = converted->dense_column();
+    std::vector<double> buffer(nr);
+    for (int g = 0; g < 9; ++g) {
+        auto ptr = ext->fetch(g, buffer.data());
+        EXPECT_EQ(ref.sums[g], std::vector<double>(ptr, ptr + nr));
+    }
+}
@@ -2,6 +2,9 @@
 
 #include <map>
 #include <random>
+#include <limits>
+#include <numeric>
+#include <cmath>
 
 #include "scran_aggregate/aggregate_across_genes.hpp"
 
@@ -167,6 +170,143 @@ TEST_P(AggregateAcrossGenesTest, Empty) {
     EXPECT_EQ(res4.sum.size(), 0);
 }
 
+TEST_P(AggregateAcrossGenesTest, Contiguous) {
+    auto nthreads = GetParam();
+
+    const size_t nsets = 20;
+    int ngenes = dense_row->nrow();
+    std::vector<std::vector<int> > mock_sets(nsets);
+    std::vector<std::vector<double> > mock_weights(nsets);
+    std::mt19937_64 rng(nsets * nthreads + 1);
+    std::uniform_real_distribution runif;
+    for (size_t s = 0; s < nsets; ++s) {
+        for (int g = 0; g < ngenes; ++g) {
+            if (runif(rng) < 0.2) {
+                mock_sets[s].push_back(g);
+                mock_weights[s].push_back(runif(rng));
+            }
+        }
+    }
+
+    std::vector<std::tuple<size_t, const int*, const double*> > gene_sets;
+    for (size_t s = 0; s < nsets; ++s) {
+        gene_sets.emplace_back(mock_sets[s].size(), mock_sets[s].data(), (s % 2 ? mock_weights[s].data() : static_cast<double*>(NULL)));
+    }
+
+    scran_aggregate::AggregateAcrossGenesOptions opt;
+    opt.num_threads = nthreads; 
+    opt.average = true;
+    auto ref = scran_aggregate::aggregate_across_genes(*dense_row, gene_sets, opt);
+    int ncells = dense_row->ncol();
+
+    for (const auto& mat : { dense_row, sparse_row, dense_column, sparse_column }) {
+        for (bool set_major : { true, false }) {
+            auto res = scran_aggregate::aggregate_across_genes_contiguous(*mat, gene_sets, set_major, opt);
+            EXPECT_EQ(res.sum.num_rows, nsets);
+            EXPECT_EQ(res.sum.num_columns, static_cast<std::size_t>(ncells));
+            EXPECT_EQ(res.sum.row_major, set_major);
+
+            auto converted = scran_aggregate::contiguous_matrix_to_tatami(std::move(res.sum));
+            auto ext = converted->dense_row();
+            std::vector<double> buffer(ncells);
+            for (size_t s = 0; s < nsets; ++s) {
+                auto ptr = ext->fetch(s, buffer.data());
+                EXPECT_EQ(ref.sum[s], std::vector<double>(ptr, ptr + ncells));
+            }
+        }
+    }
+}
+
+TEST_P(AggregateAcrossGenesTest, CellCosts) {
+    auto nthreads = GetParam();
+
+    std::vector<std::vector<int> > mock_sets(20);
+    std::mt19937_64 rng(nthreads + 100);
+    std::uniform_real_distribution runif;
+    int ngenes = dense_row->nrow();
+    for (auto& grp : mock_sets) {
+        for (int g = 0; g < ngenes; ++g) {
+            if (runif(rng) < 0.2) {
+                grp.push_back(g);
+            }
+        }
+    }
+
+    std::vector<std::tuple<size_t, const int*, const double*> > gene_sets;
+    for (const auto& grp : mock_sets) {
+        gene_sets.emplace_back(grp.size(), grp.data(), static_cast<double*>(NULL));
+    }
+
+    scran_aggregate::AggregateAcrossGenesOptions opt;
+    opt.num_threads = nthreads;
+    auto ref = scran_aggregate::aggregate_across_genes(*dense_row, gene_sets, opt);
+
+    // Using the number of non-zero values in each cell, as in the pointers of a compressed sparse column matrix.
+    int ncells = dense_row->ncol();
+    std::vector<std::size_t> nnz_costs(ncells + 1);
+    {
+        auto ext = tatami::consecutive_extractor<true>(*sparse_column, false, 0, ncells);
+        std::vector<double> vbuffer(ngenes);
+        std::vector<int> ibuffer(ngenes);
+        for (int c = 0; c < ncells; ++c) {
+            nnz_costs[c + 1] = nnz_costs[c] + ext->fetch(vbuffer.data(), ibuffer.data()).number;
+        }
+    }
+
+    // Also checking a very skewed cost where some threads have no cells.
+    std::vector<std::size_t> skewed_costs(ncells + 1, 1000);
+    skewed_costs[0] = 0;
+
+    for (const auto& costs : { nnz_costs, skewed_costs }) {
+        opt.cell_costs = costs.data();
+        for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+            auto res = scran_aggregate::aggregate_across_genes(*input, gene_sets, opt);
+            for (size_t s = 0; s < mock_sets.size(); ++s) {
+                EXPECT_EQ(ref.sum[s], res.sum[s]);
+            }
+        }
+    }
+}
+
+TEST_P(AggregateAcrossGenesTest, MemoryBudget) {
+    auto nthreads = GetParam();
+
+    std::vector<std::vector<int> > mock_sets(15);
+    std::mt19937_64 rng(nthreads + 200);
+    std::uniform_real_distribution runif;
+    int ngenes = dense_row->nrow();
+    for (auto& grp : mock_sets) {
+        for (int g = 0; g < ngenes; ++g) {
+            if (runif(rng) < 0.2) {
+                grp.push_back(g);
+            }
+        }
+    }
+
+    std::vector<std::tuple<size_t, const int*, const double*> > gene_sets;
+    std::vector<std::size_t> set_sizes;
+    for (const auto& grp : mock_sets) {
+        gene_sets.emplace_back(grp.size(), grp.data(), static_cast<double*>(NULL));
+        set_sizes.push_back(grp.size());
+    }
+
+    scran_aggregate::AggregateAcrossGenesOptions opt;
+    opt.num_threads = nthreads;
+    opt.average = true;
+    auto ref = scran_aggregate::aggregate_across_genes(*dense_row, gene_sets, opt);
+
+    auto estimate = scran_aggregate::estimate_aggregate_across_genes_memory(ngenes, static_cast<int>(dense_row->ncol()), false, set_sizes, opt);
+    for (std::size_t budget : { std::numeric_limits<std::size_t>::max() - 1, estimate.by_row / 2, static_cast<std::size_t>(0) }) {
+        opt.memory_budget = budget;
+        for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+            auto res = scran_aggregate::aggregate_across_genes(*input, gene_sets, opt);
+            for (size_t s = 0; s < mock_sets.size(); ++s) {
+                scran_tests::compare_almost_equal_containers(ref.sum[s], res.sum[s], {});
+            }
+        }
+    }
+}
+
 INSTANTIATE_TEST_SUITE_P(
     AggregateAcrossGenes,
     AggregateAcrossGenesTest,
@@ -197,3 +337,90 @@ TEST(AggregateAcrossGenes, OutOfRange) {
         scran_aggregate::aggregate_across_genes(mat, gene_sets, opt);
     }, "out of range");
 }
+
+TEST(AggregateAcrossGenes, MemoryEstimate) {
+    scran_aggregate::AggregateAcrossGenesOptions opt;
+    std::vector<std::size_t> set_sizes { 10, 20, 30 };
+    auto ref = scran_aggregate::estimate_aggregate_across_genes_memory(1000, 5000, false, set_sizes, opt);
+
+    // Row path holds the partial sums for each set and cell.
+    EXPECT_GE(ref.by_row, 3 * 5000 * sizeof(double));
+    EXPECT_LT(ref.by_column, ref.by_row);
+
+    auto sparse = scran_aggregate::estimate_aggregate_across_genes_memory(1000, 5000, true, set_sizes, opt);
+    EXPECT_GT(sparse.by_row, ref.by_row);
+
+    opt.num_threads = 4;
+    auto threaded = scran_aggregate::estimate_aggregate_across_genes_memory(1000, 5000, false, set_sizes, opt);
+    EXPECT_GT(threaded.by_column, ref.by_column);
+
+    set_sizes.push_back(100);
+    auto more = scran_aggregate::estimate_aggregate_across_genes_memory(1000, 5000, false, set_sizes, opt);
+    EXPECT_GT(more.by_row, threaded.by_row);
+    EXPECT_GT(more.by_column, threaded.by_column);
+}
+
+TEST(AggregateAcrossGenes, CompensatedSums) {
+    // Large gene sets so that naive single-precision sums lose accuracy.
+    int nr = 100000, nc = 6;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.5;
+        sparams.lower = 0;
+        sparams.upper = 1;
+        sparams.seed = 2468;
+        return sparams;
+    }());
+
+    auto dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    std::vector<int> set(nr);
+    std::iota(set.begin(), set.end(), 0);
+    std::vector<double> weights(nr);
+    for (int r = 0; r < nr; ++r) {
+        weights[r] = 1.0 / (1 + r % 3);
+    }
+    std::vector<std::tuple<std::size_t, const int*, const double*> > gene_sets;
+    gene_sets.emplace_back(set.size(), set.data(), static_cast<double*>(NULL));
+    gene_sets.emplace_back(set.size(), set.data(), weights.data());
+
+    scran_aggregate::AggregateAcrossGenesOptions opt;
+    auto ref = scran_aggregate::aggregate_across_genes(*dense_row, gene_sets, opt);
+
+    // Computing the largest error relative to the double-precision reference, in units of float epsilon.
+    auto max_error = [&](const auto& observed) -> double {
+        double error = 0;
+        for (int s = 0; s < 2; ++s) {
+            for (int c = 0; c < nc; ++c) {
+                error = std::max(error, std::abs(observed.sum[s][c] - ref.sum[s][c]) / ref.sum[s][c]);
+            }
+        }
+        return error / std::numeric_limits<float>::epsilon();
+    };
+
+    for (const auto& input : { dense_row, dense_column, sparse_row, sparse_column }) {
+        for (int nthreads : { 1, 3 }) {
+            auto copt = opt;
+            copt.num_threads = nthreads;
+            EXPECT_GT(max_error(scran_aggregate::aggregate_across_genes<float>(*input, gene_sets, copt)), 1);
+
+            copt.compensated_sums = true;
+            EXPECT_LE(max_error(scran_aggregate::aggregate_across_genes<float>(*input, gene_sets, copt)), 1);
+
+            // Averages are computed from the narrowed sums.
+            copt.average = true;
+            auto averaged = scran_aggregate::aggregate_across_genes<float>(*input, gene_sets, copt);
+            for (int c = 0; c < nc; ++c) {
+                EXPECT_FLOAT_EQ(averaged.sum[0][c], ref.sum[0][c] / nr);
+            }
+        }
+    }
+
+    auto naive_estimate = scran_aggregate::estimate_aggregate_across_genes_memory<float>(nr, nc, false, std::vector<std::size_t>{ set.size() }, opt);
+    opt.compensated_sums = true;
+    auto compensated_estimate = scran_aggregate::estimate_aggregate_across_genes_memory<float>(nr, nc, false, std::vector<std::size_t>{ set.size() }, opt);
+    EXPECT_GT(compensated_estimate.by_row, naive_estimate.by_row);
+}
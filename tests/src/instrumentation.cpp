@@ -0,0 +1,210 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include "scran_aggregate/aggregate_across_cells.hpp"
+#include "scran_aggregate/aggregate_across_genes.hpp"
+
+class InstrumentationTest : public ::testing::TestWithParam<int> {
+protected:
+    inline static int nr = 57, nc = 131;
+    inline static std::size_t nnz;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.2;
+            sparams.seed = 4242;
+            return sparams;
+        }());
+        nnz = vec.size() - std::count(vec.begin(), vec.end(), 0);
+
+        dense_row = std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    static void check_record(const scran_aggregate::ThreadInstrumentation& record) {
+        EXPECT_GE(record.extraction_time, 0);
+        EXPECT_GE(record.accumulation_time, 0);
+        EXPECT_GE(record.median_time, 0);
+        EXPECT_GE(record.reduction_time, 0);
+    }
+};
+
+TEST_P(InstrumentationTest, Cells) {
+    const int nthreads = GetParam();
+    std::vector<int> groups(nc);
+    for (int c = 0; c < nc; ++c) {
+        groups[c] = c % 7;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, groups.data(), opt);
+
+    scran_aggregate::Instrumentation instrumentation;
+    opt.num_threads = nthreads;
+    opt.instrumentation = &instrumentation;
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_aggregate::aggregate_across_cells(*mat, groups.data(), opt);
+        for (int g = 0; g < 7; ++g) {
+            scran_tests::compare_almost_equal_containers(ref.sums[g], res.sums[g], {});
+            EXPECT_EQ(ref.detected[g], res.detected[g]);
+            EXPECT_EQ(ref.medians[g], res.medians[g]);
+        }
+
+        EXPECT_EQ(instrumentation.threads.size(), static_cast<std::size_t>(nthreads));
+        for (const auto& record : instrumentation.threads) {
+            check_record(record);
+        }
+
+        const auto total = instrumentation.total();
+        EXPECT_EQ(total.nonzeros_processed, (mat->sparse() ? nnz : static_cast<std::size_t>(nr * nc)));
+        EXPECT_GT(total.scratch_bytes, static_cast<std::size_t>(0));
+
+        // The estimated memory usage is an upper bound on the observed scratch space.
+        const auto estimate = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, mat->sparse(), 7, opt);
+        EXPECT_LE(total.scratch_bytes, (mat->prefer_rows() ? estimate.by_row : estimate.by_column));
+
+        if (mat->prefer_rows()) {
+            EXPECT_EQ(total.rows_fetched, static_cast<std::size_t>(nr));
+            EXPECT_EQ(total.columns_fetched, static_cast<std::size_t>(0));
+        } else {
+            EXPECT_EQ(total.rows_fetched, static_cast<std::size_t>(0));
+            EXPECT_GE(total.columns_fetched, static_cast<std::size_t>(nc));
+            EXPECT_EQ(total.columns_fetched % nc, static_cast<std::size_t>(0));
+        }
+    }
+
+    // Records from a previous call are discarded.
+    opt.num_threads = 1;
+    opt.compute_medians = false;
+    scran_aggregate::aggregate_across_cells(*sparse_row, groups.data(), opt);
+    EXPECT_EQ(instrumentation.threads.size(), static_cast<std::size_t>(1));
+    EXPECT_EQ(instrumentation.threads.front().rows_fetched, static_cast<std::size_t>(nr));
+    EXPECT_EQ(instrumentation.threads.front().nonzeros_processed, nnz);
+}
+
+TEST_P(InstrumentationTest, CellsByCell) {
+    const int nthreads = GetParam();
+    std::vector<int> groups(nc);
+    for (int c = 0; c < nc; ++c) {
+        groups[c] = c % 3;
+    }
+
+    // Only a few genes, so each thread processes a range of cells for all genes.
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.gene_subset = std::vector<std::size_t>{ 1, 10, 20 };
+    opt.num_threads = nthreads;
+    scran_aggregate::Instrumentation instrumentation;
+    opt.instrumentation = &instrumentation;
+
+    for (const auto& mat : { dense_row, sparse_row }) {
+        scran_aggregate::aggregate_across_cells(*mat, groups.data(), opt);
+        EXPECT_EQ(instrumentation.threads.size(), static_cast<std::size_t>(nthreads));
+        for (const auto& record : instrumentation.threads) {
+            check_record(record);
+        }
+        EXPECT_GE(instrumentation.total().rows_fetched, static_cast<std::size_t>(3));
+        EXPECT_EQ(instrumentation.total().rows_fetched % 3, static_cast<std::size_t>(0));
+    }
+}
+
+TEST_P(InstrumentationTest, MemoryBudget) {
+    const int nthreads = GetParam();
+    std::vector<int> groups(nc);
+    for (int c = 0; c < nc; ++c) {
+        groups[c] = c % 5;
+    }
+
+    scran_aggregate::AggregateAcrossCellsOptions opt;
+    opt.compute_medians = true;
+    auto ref = scran_aggregate::aggregate_across_cells(*dense_row, groups.data(), opt);
+    const auto single = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 5, opt);
+
+    // A budget that only fits a single thread.
+    scran_aggregate::Instrumentation instrumentation;
+    opt.num_threads = nthreads;
+    opt.instrumentation = &instrumentation;
+    opt.memory_budget = single.by_row;
+    auto res = scran_aggregate::aggregate_across_cells(*dense_row, groups.data(), opt);
+    EXPECT_EQ(ref.medians, res.medians);
+    EXPECT_EQ(instrumentation.threads.size(), static_cast<std::size_t>(1));
+    EXPECT_LE(instrumentation.total().scratch_bytes, single.by_row);
+
+    // A budget that fits all threads.
+    opt.memory_budget = std::numeric_limits<std::size_t>::max() - 1;
+    scran_aggregate::aggregate_across_cells(*dense_row, groups.data(), opt);
+    EXPECT_EQ(instrumentation.threads.size(), static_cast<std::size_t>(nthreads));
+
+    // For column-major matrices, the tiles are shrunk to fit the budget.
+    opt.compute_medians = false;
+    opt.num_threads = 1;
+    const auto column = scran_aggregate::estimate_aggregate_across_cells_memory(nr, nc, false, 5, opt);
+    opt.num_threads = nthreads;
+    opt.memory_budget = column.by_column - 1;
+    auto cres = scran_aggregate::aggregate_across_cells(*dense_column, groups.data(), opt);
+    EXPECT_EQ(ref.detected, cres.detected);
+    EXPECT_LE(instrumentation.total().scratch_bytes, column.by_column);
+    EXPECT_EQ(instrumentation.threads.size(), static_cast<std::size_t>(nthreads)); // tiling is preferred over fewer threads.
+
+    scran_aggregate::AggregateAcrossGenesOptions gopt;
+    std::vector<int> set { 0, 5, 10 };
+    std::vector<std::tuple<std::size_t, const int*, const double*> > gene_sets;
+    gene_sets.emplace_back(set.size(), set.data(), static_cast<double*>(NULL));
+    const auto gsingle = scran_aggregate::estimate_aggregate_across_genes_memory(nr, nc, false, std::vector<std::size_t>{ set.size() }, gopt);
+    gopt.num_threads = nthreads;
+    gopt.instrumentation = &instrumentation;
+    gopt.memory_budget = gsingle.by_column;
+    scran_aggregate::aggregate_across_genes(*dense_column, gene_sets, gopt);
+    EXPECT_EQ(instrumentation.threads.size(), static_cast<std::size_t>(1));
+}
+
+TEST_P(InstrumentationTest, Genes) {
+    const int nthreads = GetParam();
+    std::vector<int> set1 { 0, 5, 10, 20 }, set2 { 1, 5, 8, 12, 50 };
+    std::vector<std::tuple<std::size_t, const int*, const double*> > gene_sets;
+    gene_sets.emplace_back(set1.size(), set1.data(), static_cast<double*>(NULL));
+    gene_sets.emplace_back(set2.size(), set2.data(), static_cast<double*>(NULL));
+
+    scran_aggregate::AggregateAcrossGenesOptions opt;
+    auto ref = scran_aggregate::aggregate_across_genes(*dense_row, gene_sets, opt);
+
+    scran_aggregate::Instrumentation instrumentation;
+    opt.num_threads = nthreads;
+    opt.instrumentation = &instrumentation;
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_aggregate::aggregate_across_genes(*mat, gene_sets, opt);
+        scran_tests::compare_almost_equal_containers(ref.sum[0], res.sum[0], {});
+        scran_tests::compare_almost_equal_containers(ref.sum[1], res.sum[1], {});
+
+        EXPECT_EQ(instrumentation.threads.size(), static_cast<std::size_t>(nthreads));
+        for (const auto& record : instrumentation.threads) {
+            check_record(record);
+        }
+
+        const auto total = instrumentation.total();
+        if (mat->prefer_rows()) {
+            EXPECT_GE(total.rows_fetched, static_cast<std::size_t>(8));
+            EXPECT_EQ(total.rows_fetched % 8, static_cast<std::size_t>(0)); // 8 unique genes across both sets.
+            EXPECT_EQ(total.columns_fetched, static_cast<std::size_t>(0));
+        } else {
+            EXPECT_EQ(total.rows_fetched, static_cast<std::size_t>(0));
+            EXPECT_EQ(total.columns_fetched, static_cast<std::size_t>(nc));
+            EXPECT_EQ(total.nonzeros_processed, static_cast<std::size_t>(nc * 8));
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Instrumentation,
+    InstrumentationTest,
+    ::testing::Values(1, 3) // number of threads
+);
@@ -0,0 +1,129 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+#include "scran_aggregate/quantile_sketch.hpp"
+
+static double reference_quantile(std::vector<double> values, double prob) {
+    std::sort(values.begin(), values.end());
+    double target = prob * (values.size() - 1);
+    size_t lower = std::floor(target);
+    double frac = target - lower;
+    if (frac == 0) {
+        return values[lower];
+    }
+    return values[lower] + (values[lower + 1] - values[lower]) * frac;
+}
+
+// Fraction of values that are less than or equal to the specified value.
+static double empirical_rank(const std::vector<double>& sorted, double value) {
+    return static_cast<double>(std::upper_bound(sorted.begin(), sorted.end(), value) - sorted.begin()) / sorted.size();
+}
+
+TEST(QuantileSketch, Exact) {
+    std::mt19937_64 rng(42);
+    std::normal_distribution<double> dist;
+    std::vector<double> values;
+    scran_aggregate::QuantileSketch<double> sketch(100);
+    for (int i = 0; i < 77; ++i) {
+        values.push_back(dist(rng));
+        sketch.add(values.back());
+    }
+
+    EXPECT_EQ(sketch.count(), 77);
+    EXPECT_EQ(sketch.stored(), 77);
+    for (double p : { 0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 1.0 }) {
+        EXPECT_FLOAT_EQ(sketch.quantile(p), reference_quantile(values, p));
+    }
+
+    std::vector<double> probs { 0.5, 0.2, 0.8 };
+    std::vector<double> output(3);
+    sketch.quantiles(probs.size(), probs.data(), output.data());
+    for (size_t q = 0; q < probs.size(); ++q) {
+        EXPECT_FLOAT_EQ(output[q], reference_quantile(values, probs[q]));
+    }
+
+    sketch.clear();
+    EXPECT_EQ(sketch.count(), 0);
+    EXPECT_TRUE(std::isnan(sketch.quantile(0.5)));
+}
+
+TEST(QuantileSketch, Approximate) {
+    std::mt19937_64 rng(69);
+    std::uniform_real_distribution<double> dist;
+    std::vector<double> values;
+    scran_aggregate::QuantileSketch<double> sketch(200);
+    for (int i = 0; i < 100000; ++i) {
+        values.push_back(dist(rng));
+        sketch.add(values.back());
+    }
+
+    EXPECT_EQ(sketch.count(), 100000);
+    EXPECT_LT(sketch.stored(), 1000);
+
+    std::sort(values.begin(), values.end());
+    for (double p : { 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99 }) {
+        EXPECT_LT(std::abs(empirical_rank(values, sketch.quantile(p)) - p), 0.02);
+    }
+}
+
+TEST(QuantileSketch, Weighted) {
+    scran_aggregate::QuantileSketch<double> sketch(10);
+    sketch.add(0, 1000);
+    sketch.add(1);
+    sketch.add(2, 37);
+    EXPECT_EQ(sketch.count(), 1038);
+    EXPECT_LT(sketch.stored(), 50);
+    EXPECT_EQ(sketch.quantile(0.5), 0);
+    EXPECT_EQ(sketch.quantile(1), 2);
+
+    // Comparing to an exact sketch.
+    scran_aggregate::QuantileSketch<double> exact(100);
+    std::vector<double> values;
+    for (int i = 0; i < 20; ++i) {
+        values.push_back(i);
+        exact.add(i);
+    }
+    exact.add(0, 30);
+    values.resize(values.size() + 30);
+    EXPECT_EQ(exact.count(), 50);
+    for (double p : { 0.0, 0.3, 0.5, 0.7, 0.95, 1.0 }) {
+        EXPECT_FLOAT_EQ(exact.quantile(p), reference_quantile(values, p));
+    }
+}
+
+TEST(QuantileSketch, Merge) {
+    std::mt19937_64 rng(1000);
+    std::normal_distribution<double> dist;
+    std::vector<double> values;
+    scran_aggregate::QuantileSketch<double> combined(200);
+    for (int s = 0; s < 10; ++s) {
+        scran_aggregate::QuantileSketch<double> sketch(200);
+        for (int i = 0; i < 5000; ++i) {
+            values.push_back(dist(rng));
+            sketch.add(values.back());
+        }
+        combined.merge(sketch);
+    }
+
+    EXPECT_EQ(combined.count(), 50000);
+    EXPECT_LT(combined.stored(), 1000);
+
+    std::sort(values.begin(), values.end());
+    for (double p : { 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99 }) {
+        EXPECT_LT(std::abs(empirical_rank(values, combined.quantile(p)) - p), 0.02);
+    }
+
+    // Merging small sketches is still exact.
+    scran_aggregate::QuantileSketch<double> left(100), right(100);
+    std::vector<double> small { 5, 1, 3, 8, 2, 9, 4 };
+    for (size_t i = 0; i < small.size(); ++i) {
+        (i % 2 ? left : right).add(small[i]);
+    }
+    left.merge(right);
+    EXPECT_EQ(left.count(), small.size());
+    EXPECT_EQ(left.quantile(0.5), 4);
+}
@@ -0,0 +1,161 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include <vector>
+#include <random>
+#include <cmath>
+
+#include "scran_aggregate/roll_up_across_cells.hpp"
+
+class RollUpAcrossCellsTest : public ::testing::TestWithParam<int> {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> matrix;
+    inline static std::vector<int> cluster, sample;
+
+    static void SetUpTestSuite() {
+        int nr = 63, nc = 121;
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.2;
+            sparams.lower = -5;
+            sparams.upper = 10;
+            return sparams;
+        }());
+        matrix = tatami::convert_to_compressed_sparse(std::make_shared<tatami::DenseRowMatrix<double, int> >(nr, nc, std::move(vec)).get(), false);
+
+        std::mt19937_64 rng(42);
+        cluster.resize(nc);
+        sample.resize(nc);
+        for (int c = 0; c < nc; ++c) {
+            cluster[c] = rng() % 4;
+            sample[c] = rng() % 6;
+        }
+    }
+
+    static scran_aggregate::AggregateAcrossCellsOptions aggregation_options() {
+        scran_aggregate::AggregateAcrossCellsOptions opt;
+        opt.compute_sums_of_squares = true;
+        opt.compute_minima = true;
+        opt.compute_maxima = true;
+        return opt;
+    }
+
+    template<typename Float_>
+    static void compare_almost_equal(const std::vector<std::vector<Float_> >& ref, const std::vector<std::vector<Float_> >& obs) {
+        ASSERT_EQ(ref.size(), obs.size());
+        for (size_t g = 0; g < ref.size(); ++g) {
+            scran_tests::compare_almost_equal_containers(ref[g], obs[g], {});
+        }
+    }
+};
+
+TEST_P(RollUpAcrossCellsTest, Basic) {
+    auto nthreads = GetParam();
+    auto aopt = aggregation_options();
+
+    std::vector<int> combined(cluster.size());
+    auto levels = scran_aggregate::combine_factors(cluster.size(), std::vector<const int*>{ cluster.data(), sample.data() }, combined.data());
+    auto fine = scran_aggregate::aggregate_across_cells(*matrix, combined.data(), aopt);
+
+    scran_aggregate::RollUpAcrossCellsOptions ropt;
+    ropt.num_threads = nthreads;
+
+    // Rolling up to each individual factor.
+    for (std::size_t f = 0; f < 2; ++f) {
+        const auto& factor = (f == 0 ? cluster : sample);
+        auto ref = scran_aggregate::aggregate_across_cells(*matrix, factor.data(), aopt);
+        auto rolled = scran_aggregate::roll_up_across_cells(fine, levels, std::vector<std::size_t>{ f }, ropt);
+
+        ASSERT_EQ(rolled.levels.size(), 1u);
+        ASSERT_EQ(rolled.levels[0].size(), ref.sums.size());
+        for (std::size_t g = 0; g < rolled.levels[0].size(); ++g) {
+            EXPECT_EQ(rolled.levels[0][g], static_cast<int>(g));
+        }
+        ASSERT_EQ(rolled.combined.size(), levels[0].size());
+        for (std::size_t c = 0; c < rolled.combined.size(); ++c) {
+            EXPECT_EQ(rolled.combined[c], static_cast<std::size_t>(levels[f][c]));
+        }
+
+        compare_almost_equal(ref.sums, rolled.aggregates.sums);
+        EXPECT_EQ(ref.detected, rolled.aggregates.detected);
+        compare_almost_equal(ref.sums_of_squares, rolled.aggregates.sums_of_squares);
+        EXPECT_EQ(ref.minima, rolled.aggregates.minima);
+        EXPECT_EQ(ref.maxima, rolled.aggregates.maxima);
+        EXPECT_TRUE(rolled.aggregates.medians.empty());
+        EXPECT_TRUE(rolled.aggregates.quantiles.empty());
+    }
+
+    // Rolling up everything into a single group.
+    {
+        std::vector<int> single(cluster.size());
+        auto ref = scran_aggregate::aggregate_across_cells(*matrix, single.data(), aopt);
+        auto rolled = scran_aggregate::roll_up_across_cells(fine, levels, std::vector<std::size_t>{}, ropt);
+        EXPECT_TRUE(rolled.levels.empty());
+        EXPECT_EQ(rolled.combined, std::vector<std::size_t>(levels[0].size()));
+        compare_almost_equal(ref.sums, rolled.aggregates.sums);
+        EXPECT_EQ(ref.detected, rolled.aggregates.detected);
+        EXPECT_EQ(ref.minima, rolled.aggregates.minima);
+        EXPECT_EQ(ref.maxima, rolled.aggregates.maxima);
+    }
+}
+
+TEST_P(RollUpAcrossCellsTest, Unused) {
+    auto nthreads = GetParam();
+    auto aopt = aggregation_options();
+
+    // Adding an unused level for each factor, so that some combinations have no cells.
+    std::vector<int> combined(cluster.size());
+    auto levels = scran_aggregate::combine_factors_unused(
+        cluster.size(),
+        std::vector<std::pair<const int*, int> >{ { cluster.data(), 5 }, { sample.data(), 7 } },
+        combined.data()
+    );
+    auto fine = scran_aggregate::aggregate_across_cells(*matrix, combined.data(), aopt);
+    fine.sums.resize(levels[0].size(), std::vector<double>(matrix->nrow()));
+    fine.detected.resize(levels[0].size(), std::vector<int>(matrix->nrow()));
+    fine.sums_of_squares.resize(levels[0].size(), std::vector<double>(matrix->nrow()));
+    fine.minima.resize(levels[0].size(), std::vector<double>(matrix->nrow(), std::numeric_limits<double>::quiet_NaN()));
+    fine.maxima.resize(levels[0].size(), std::vector<double>(matrix->nrow(), std::numeric_limits<double>::quiet_NaN()));
+
+    scran_aggregate::RollUpAcrossCellsOptions ropt;
+    ropt.num_threads = nthreads;
+    auto rolled = scran_aggregate::roll_up_across_cells(fine, levels, std::vector<std::size_t>{ 0 }, ropt);
+    ASSERT_EQ(rolled.levels[0].size(), 5u);
+
+    auto ref = scran_aggregate::aggregate_across_cells(*matrix, cluster.data(), aopt);
+    for (int g = 0; g < 4; ++g) {
+        scran_tests::compare_almost_equal_containers(ref.sums[g], rolled.aggregates.sums[g], {});
+        EXPECT_EQ(ref.detected[g], rolled.aggregates.detected[g]);
+        EXPECT_EQ(ref.minima[g], rolled.aggregates.minima[g]);
+        EXPECT_EQ(ref.maxima[g], rolled.aggregates.maxima[g]);
+    }
+
+    // Unused level has zero sums and NaN extremes.
+    EXPECT_EQ(rolled.aggregates.sums[4], std::vector<double>(matrix->nrow()));
+    EXPECT_EQ(rolled.aggregates.detected[4], std::vector<int>(matrix->nrow()));
+    for (auto x : rolled.aggregates.minima[4]) {
+        EXPECT_TRUE(std::isnan(x));
+    }
+    for (auto x : rolled.aggregates.maxima[4]) {
+        EXPECT_TRUE(std::isnan(x));
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    RollUpAcrossCells,
+    RollUpAcrossCellsTest,
+    ::testing::Values(1, 3) // number of threads
+);
+
+TEST(RollUpAcrossCells, Errors) {
+    scran_aggregate::AggregateAcrossCellsResults<double, int, double> fine;
+    fine.sums.resize(3, std::vector<double>(10));
+    std::vector<std::vector<int> > levels{ { 0, 1, 2 }, { 0, 0 } };
+
+    scran_aggregate::RollUpAcrossCellsOptions ropt;
+    scran_tests::expect_error([&]() -> void {
+        scran_aggregate::roll_up_across_cells(fine, levels, std::vector<std::size_t>{ 2 }, ropt);
+    }, "out of range");
+    scran_tests::expect_error([&]() -> void {
+        scran_aggregate::roll_up_across_cells(fine, levels, std::vector<std::size_t>{ 1 }, ropt);
+    }, "length of each factor");
+}